@@ -0,0 +1,122 @@
+#include "aggregate_handler.h"
+
+using namespace std;
+
+namespace katd {
+
+// No key has all bits set, since types and serials are small.
+static const uint64_t kEmptyKey = ~0ULL;
+
+AggregateHandler::AggregateHandler(bool per_pid)
+  : per_pid_(per_pid),
+    total_(0),
+    next_serial_(0),
+    keys_(1024, kEmptyKey),
+    counts_(1024),
+    size_(0) {
+}
+
+void AggregateHandler::addHandler(Handler* handler) {
+  handlers_.push_back(handler);
+}
+
+// Packs the path id, the type and the serial of the program into one
+// word. Serials wrap at 2^29 programs.
+uint64_t AggregateHandler::getKey(const Event& event, uint32_t serial) const {
+  uint64_t key = event.path_id;
+  key |= static_cast<uint64_t>(event.type & 7) << 32;
+  if (per_pid_)
+    key |= static_cast<uint64_t>(serial & ((1 << 29) - 1)) << 35;
+  return key;
+}
+
+// Returns the bucket of |key|, or the empty bucket to put it in.
+size_t AggregateHandler::findBucket(uint64_t key) const {
+  size_t mask = keys_.size() - 1;
+  // Fibonacci hashing spreads path ids which are allocated in order.
+  size_t i = (key * 0x9e3779b97f4a7c15ULL) >> 32;
+  for (;; i++) {
+    i &= mask;
+    if (keys_[i] == key || keys_[i] == kEmptyKey)
+      return i;
+  }
+}
+
+void AggregateHandler::handleEvent(const Event& event) {
+  total_++;
+  uint32_t serial = 0;
+  if (per_pid_) {
+    bool inserted;
+    uint32_t* s = serials_.insert(event.pid, &inserted);
+    if (inserted)
+      *s = next_serial_++;
+    serial = *s;
+  }
+  uint64_t key = getKey(event, serial);
+  size_t i = findBucket(key);
+  if (keys_[i] == key) {
+    counts_[i]++;
+    return;
+  }
+
+  keys_[i] = key;
+  counts_[i] = 1;
+  if (++size_ * 2 > keys_.size())
+    grow();
+  for (size_t j = 0; j < handlers_.size(); j++)
+    handlers_[j]->handleEvent(event);
+}
+
+void AggregateHandler::handleFork(int parent_pid, int pid) {
+  for (size_t i = 0; i < handlers_.size(); i++)
+    handlers_[i]->handleFork(parent_pid, pid);
+}
+
+void AggregateHandler::handleExec(int pid, const vector<string>& args) {
+  serials_.erase(pid);
+  for (size_t i = 0; i < handlers_.size(); i++)
+    handlers_[i]->handleExec(pid, args);
+}
+
+void AggregateHandler::handleProcessTimes(int pid,
+                                          const ProcessTimes& times) {
+  for (size_t i = 0; i < handlers_.size(); i++)
+    handlers_[i]->handleProcessTimes(pid, times);
+}
+
+void AggregateHandler::handleExit(int pid) {
+  // The pid may be reused by another process.
+  serials_.erase(pid);
+  for (size_t i = 0; i < handlers_.size(); i++)
+    handlers_[i]->handleExit(pid);
+}
+
+void AggregateHandler::flush() {
+  for (size_t i = 0; i < handlers_.size(); i++)
+    handlers_[i]->flush();
+}
+
+uint32_t AggregateHandler::getCount(const Event& event) const {
+  const uint32_t* serial = serials_.find(event.pid);
+  if (per_pid_ && !serial)
+    return 0;
+  uint64_t key = getKey(event, serial ? *serial : 0);
+  size_t i = findBucket(key);
+  return keys_[i] == key ? counts_[i] : 0;
+}
+
+void AggregateHandler::grow() {
+  vector<uint64_t> keys(keys_.size() * 2, kEmptyKey);
+  vector<uint32_t> counts(keys.size());
+  keys.swap(keys_);
+  counts.swap(counts_);
+  for (size_t i = 0; i < keys.size(); i++) {
+    if (keys[i] == kEmptyKey)
+      continue;
+    size_t j = findBucket(keys[i]);
+    keys_[j] = keys[i];
+    counts_[j] = counts[i];
+  }
+}
+
+}  // namespace katd
@@ -0,0 +1,62 @@
+#ifndef KATD_AGGREGATE_HANDLER_H_
+#define KATD_AGGREGATE_HANDLER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "event.h"
+#include "handler.h"
+#include "pid_table.h"
+
+namespace katd {
+
+// Passes only the first event for each (path, type) to the handlers
+// added to this, and counts how many times each was seen. Compilers
+// stat and open the same headers over and over, so most events are
+// repeats.
+class AggregateHandler : public Handler {
+public:
+  // With |per_pid|, each process gets its own first events. A process
+  // which execs starts over, since it runs another program.
+  explicit AggregateHandler(bool per_pid);
+
+  void addHandler(Handler* handler);
+
+  virtual void handleEvent(const Event& event);
+  virtual void handleFork(int parent_pid, int pid);
+  virtual void handleExec(int pid, const std::vector<std::string>& args);
+  virtual void handleProcessTimes(int pid, const ProcessTimes& times);
+  virtual void handleExit(int pid);
+  virtual void flush();
+
+  // How many times the tracer sent the key of |event|.
+  uint32_t getCount(const Event& event) const;
+  // The number of events received and the number passed on.
+  size_t total() const { return total_; }
+  size_t unique() const { return size_; }
+
+private:
+  uint64_t getKey(const Event& event, uint32_t serial) const;
+  size_t findBucket(uint64_t key) const;
+  void grow();
+
+  bool per_pid_;
+  std::vector<Handler*> handlers_;
+  size_t total_;
+  // The serial number of the program each pid runs, which keys its
+  // events with |per_pid|.
+  PidTable<uint32_t> serials_;
+  uint32_t next_serial_;
+
+  // Open addressing with linear probing. Keys are never removed.
+  std::vector<uint64_t> keys_;
+  std::vector<uint32_t> counts_;
+  size_t size_;
+};
+
+}  // namespace katd
+
+#endif  // KATD_AGGREGATE_HANDLER_H_
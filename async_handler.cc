@@ -0,0 +1,182 @@
+#include "async_handler.h"
+
+#include "log.h"
+
+using namespace std;
+
+namespace katd {
+
+// How many times a side polls the ring before it sleeps.
+static const int kSpinCount = 1000;
+
+AsyncHandler::AsyncHandler(size_t capacity, FullPolicy policy)
+  : ring_(capacity),
+    policy_(policy),
+    dropped_(0),
+    producer_waiting_(false),
+    consumer_waiting_(false),
+    done_(false) {
+  CHECK(capacity && !(capacity & (capacity - 1)));
+}
+
+AsyncHandler::~AsyncHandler() {
+  if (!worker_.joinable())
+    return;
+  done_ = true;
+  {
+    lock_guard<mutex> lock(mu_);
+    consumer_cond_.notify_one();
+  }
+  worker_.join();
+}
+
+void AsyncHandler::addHandler(Handler* handler) {
+  handlers_.push_back(handler);
+}
+
+void AsyncHandler::handleEvent(const Event& event) {
+  Item* item = getSlot(false);
+  if (!item) {
+    dropped_++;
+    return;
+  }
+  item->kind = Item::EVENT;
+  item->event = event;
+  push();
+}
+
+void AsyncHandler::handleFork(int parent_pid, int pid) {
+  Item* item = getSlot(true);
+  item->kind = Item::FORK;
+  item->parent_pid = parent_pid;
+  item->pid = pid;
+  push();
+}
+
+void AsyncHandler::handleExec(int pid, const vector<string>& args) {
+  Item* item = getSlot(true);
+  item->kind = Item::EXEC;
+  item->pid = pid;
+  item->args = args;
+  push();
+}
+
+void AsyncHandler::handleProcessTimes(int pid, const ProcessTimes& times) {
+  Item* item = getSlot(true);
+  item->kind = Item::TIMES;
+  item->pid = pid;
+  item->times = times;
+  push();
+}
+
+void AsyncHandler::handleExit(int pid) {
+  Item* item = getSlot(true);
+  item->kind = Item::EXIT;
+  item->pid = pid;
+  push();
+}
+
+// Returns a free slot. Returns NULL if the ring is full and events may
+// be dropped. Forks, execs, times and exits are never dropped, since
+// handlers would mix up processes without them.
+AsyncHandler::Item* AsyncHandler::getSlot(bool must_queue) {
+  if (!worker_.joinable())
+    worker_ = thread(&AsyncHandler::run, this);
+
+  Item* slot = ring_.back();
+  if (!slot) {
+    if (policy_ == DROP_WHEN_FULL && !must_queue)
+      return NULL;
+    waitProducer(false);
+    slot = ring_.back();
+  }
+  return slot;
+}
+
+void AsyncHandler::push() {
+  ring_.push();
+  notifyConsumer();
+}
+
+void AsyncHandler::flush() {
+  waitProducer(true);
+  for (size_t i = 0; i < handlers_.size(); i++)
+    handlers_[i]->flush();
+}
+
+void AsyncHandler::run() {
+  for (;;) {
+    Item* item = ring_.front();
+    for (int i = 0; !item && i < kSpinCount; i++) {
+      if (done_)
+        return;
+      this_thread::yield();
+      item = ring_.front();
+    }
+    if (!item) {
+      unique_lock<mutex> lock(mu_);
+      consumer_waiting_ = true;
+      atomic_thread_fence(memory_order_seq_cst);
+      while (!(item = ring_.front()) && !done_)
+        consumer_cond_.wait(lock);
+      consumer_waiting_ = false;
+      if (!item)
+        return;
+    }
+
+    for (size_t i = 0; i < handlers_.size(); i++) {
+      switch (item->kind) {
+      case Item::EVENT:
+        handlers_[i]->handleEvent(item->event);
+        break;
+      case Item::FORK:
+        handlers_[i]->handleFork(item->parent_pid, item->pid);
+        break;
+      case Item::EXEC:
+        handlers_[i]->handleExec(item->pid, item->args);
+        break;
+      case Item::TIMES:
+        handlers_[i]->handleProcessTimes(item->pid, item->times);
+        break;
+      case Item::EXIT:
+        handlers_[i]->handleExit(item->pid);
+        break;
+      }
+    }
+    // Pop after handling so an empty ring means all events are handled.
+    ring_.pop();
+
+    atomic_thread_fence(memory_order_seq_cst);
+    if (producer_waiting_) {
+      lock_guard<mutex> lock(mu_);
+      producer_cond_.notify_one();
+    }
+  }
+}
+
+// Waits until the ring has a free slot, or until it is empty.
+void AsyncHandler::waitProducer(bool until_empty) {
+  for (int i = 0; i < kSpinCount; i++) {
+    if (until_empty ? ring_.empty() : ring_.back() != NULL)
+      return;
+    this_thread::yield();
+  }
+  unique_lock<mutex> lock(mu_);
+  producer_waiting_ = true;
+  atomic_thread_fence(memory_order_seq_cst);
+  while (!(until_empty ? ring_.empty() : ring_.back() != NULL))
+    producer_cond_.wait(lock);
+  producer_waiting_ = false;
+}
+
+void AsyncHandler::notifyConsumer() {
+  // The consumer sets the flag and checks the ring again with the lock
+  // held, so checking the flag after the push does not lose a wakeup.
+  atomic_thread_fence(memory_order_seq_cst);
+  if (consumer_waiting_) {
+    lock_guard<mutex> lock(mu_);
+    consumer_cond_.notify_one();
+  }
+}
+
+}  // namespace katd
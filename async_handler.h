@@ -0,0 +1,83 @@
+#ifndef KATD_ASYNC_HANDLER_H_
+#define KATD_ASYNC_HANDLER_H_
+
+#include <stddef.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "event.h"
+#include "handler.h"
+#include "spsc_ring.h"
+
+namespace katd {
+
+// Queues events to a worker thread which runs the handlers added to
+// this, so the tracer can resume the tracee without waiting for them.
+class AsyncHandler : public Handler {
+public:
+  enum FullPolicy {
+    // Wait until the worker makes room.
+    BLOCK_WHEN_FULL,
+    // Drop the event and count it.
+    DROP_WHEN_FULL,
+  };
+
+  // |capacity| must be a power of two.
+  AsyncHandler(size_t capacity, FullPolicy policy);
+  virtual ~AsyncHandler();
+
+  void addHandler(Handler* handler);
+
+  virtual void handleEvent(const Event& event);
+  virtual void handleFork(int parent_pid, int pid);
+  virtual void handleExec(int pid, const std::vector<std::string>& args);
+  virtual void handleProcessTimes(int pid, const ProcessTimes& times);
+  virtual void handleExit(int pid);
+  // Waits until the worker handles all queued events, then flushes the
+  // handlers.
+  virtual void flush();
+
+  size_t dropped() const { return dropped_; }
+
+private:
+  // What the tracer passed to this, in order.
+  struct Item {
+    enum Kind { EVENT, FORK, EXEC, TIMES, EXIT };
+    Kind kind;
+    union {
+      Event event;
+      ProcessTimes times;
+    };
+    int parent_pid;
+    int pid;
+    std::vector<std::string> args;
+  };
+
+  void run();
+  Item* getSlot(bool must_queue);
+  void push();
+  void waitProducer(bool until_empty);
+  void notifyConsumer();
+
+  SpscRing<Item> ring_;
+  FullPolicy policy_;
+  std::vector<Handler*> handlers_;
+  size_t dropped_;
+
+  std::mutex mu_;
+  std::condition_variable producer_cond_;
+  std::condition_variable consumer_cond_;
+  std::atomic<bool> producer_waiting_;
+  std::atomic<bool> consumer_waiting_;
+  std::atomic<bool> done_;
+  std::thread worker_;
+};
+
+}  // namespace katd
+
+#endif  // KATD_ASYNC_HANDLER_H_
@@ -0,0 +1,354 @@
+// Runs the synthetic workloads bare and under katd with each backend
+// and option, and reports the slowdown, events per second and peak RSS
+// of each run.
+//
+// The events of a run are the lines katd writes to stderr. Runs which
+// write no text, e.g. with -o or a filter which passes nothing, are
+// credited with the events of the first traced run of the same
+// workload.
+
+#include <fcntl.h>
+#include <ftw.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "log.h"
+#include "tracer_stats.h"
+
+using namespace std;
+
+struct Workload {
+  const char* name;
+  const char* mode;
+  // Iterations at scale 1.
+  int n;
+};
+
+static const Workload kWorkloads[] = {
+  { "stat-storm", "stat", 5 },
+  { "fork-exec", "fork", 1000 },
+  { "threads", "threads", 20000 },
+  { "long-paths", "long", 5000 },
+  { "at-calls", "at", 5000 },
+};
+
+enum Binary {
+  BARE,
+  KATD,
+  // katd built without USE_SECCOMP, which stops at every syscall.
+  KATD_NO_SECCOMP,
+};
+
+struct Config {
+  const char* name;
+  Binary binary;
+  // Options for katd, separated by spaces. "@" is replaced with a file
+  // in the work directory, and "%" with the directory of the data.
+  const char* options;
+};
+
+static const Config kConfigs[] = {
+  { "bare", BARE, "" },
+  { "ptrace", KATD, "-f" },
+  { "ptrace-noseccomp", KATD_NO_SECCOMP, "-f" },
+  { "ptrace-peekdata", KATD, "-f --peekdata" },
+  { "ptrace-async", KATD, "-f -a" },
+  { "ptrace-sharded", KATD, "-f -j 4" },
+  { "ptrace-filtered", KATD, "-f --filter type=write,remove" },
+  { "ptrace-unique", KATD, "-f -u" },
+  { "ptrace-binary", KATD, "-f -o @" },
+  { "ptrace-binary-mmap", KATD, "-f -o @ -m" },
+  { "preload", KATD, "-P" },
+  { "preload-async", KATD, "-P -a" },
+  // Needs CAP_SYS_ADMIN.
+  { "fanotify", KATD, "--fanotify %" },
+};
+
+struct Result {
+  bool ok;
+  uint64_t wall_ns;
+  uint64_t events;
+  long max_rss_kb;
+};
+
+static int g_timeout_sec = 120;
+
+// Runs |args| with stderr into a pipe, counting the lines it writes.
+static Result runOnce(const vector<string>& args) {
+  Result result;
+  result.ok = false;
+  result.wall_ns = 0;
+  result.events = 0;
+  result.max_rss_kb = 0;
+
+  vector<char*> argv;
+  for (size_t i = 0; i < args.size(); i++)
+    argv.push_back(const_cast<char*>(args[i].c_str()));
+  argv.push_back(NULL);
+
+  int fds[2];
+  PCHECK(pipe2(fds, O_CLOEXEC) == 0);
+  uint64_t start = katd::getNanoTime();
+  pid_t pid = fork();
+  PCHECK(pid >= 0);
+  if (pid == 0) {
+    // In its own group, so a timeout kills the whole tree.
+    setpgid(0, 0);
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, 1);
+    dup2(fds[1], 2);
+    execv(argv[0], &argv[0]);
+    _exit(127);
+  }
+  setpgid(pid, pid);
+  close(fds[1]);
+
+  char buf[65536];
+  uint64_t deadline = start + g_timeout_sec * 1000000000ULL;
+  bool timed_out = false;
+  for (;;) {
+    uint64_t now = katd::getNanoTime();
+    if (now >= deadline) {
+      timed_out = true;
+      break;
+    }
+    pollfd pfd = { fds[0], POLLIN, 0 };
+    int r = poll(&pfd, 1, (deadline - now) / 1000000 + 1);
+    if (r < 0 && errno == EINTR)
+      continue;
+    PCHECK(r >= 0);
+    if (r == 0)
+      continue;
+    ssize_t size = read(fds[0], buf, sizeof(buf));
+    if (size < 0 && errno == EINTR)
+      continue;
+    PCHECK(size >= 0);
+    if (size == 0)
+      break;
+    for (ssize_t i = 0; i < size; i++)
+      result.events += buf[i] == '\n';
+  }
+  close(fds[0]);
+  if (timed_out)
+    kill(-pid, SIGKILL);
+
+  int status;
+  rusage usage;
+  PCHECK(wait4(pid, &status, 0, &usage) == pid);
+  result.wall_ns = katd::getNanoTime() - start;
+  // The maximum of katd and the tracees it reaped.
+  result.max_rss_kb = usage.ru_maxrss;
+  result.ok = !timed_out && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+  return result;
+}
+
+static string getDirName(const char* path) {
+  const char* slash = strrchr(path, '/');
+  return slash ? string(path, slash - path) : ".";
+}
+
+static vector<string> splitOptions(const char* options, const string& file,
+                                   const string& dir) {
+  vector<string> r;
+  string opt;
+  for (const char* p = options;; p++) {
+    if (*p && *p != ' ') {
+      opt += *p;
+      continue;
+    }
+    if (opt == "@")
+      opt = file;
+    else if (opt == "%")
+      opt = dir;
+    if (!opt.empty())
+      r.push_back(opt);
+    opt.clear();
+    if (!*p)
+      return r;
+  }
+}
+
+static bool matches(const char* name, const vector<string>& filters) {
+  if (filters.empty())
+    return true;
+  for (size_t i = 0; i < filters.size(); i++) {
+    if (filters[i] == name)
+      return true;
+  }
+  return false;
+}
+
+static void splitList(const char* list, vector<string>* r) {
+  vector<string> names = splitOptions(list, "", "");
+  for (size_t i = 0; i < names.size(); i++) {
+    string name = names[i];
+    size_t start = 0;
+    for (;;) {
+      size_t comma = name.find(',', start);
+      r->push_back(name.substr(start, comma - start));
+      if (comma == string::npos)
+        break;
+      start = comma + 1;
+    }
+  }
+}
+
+static int removeEntry(const char* path, const struct stat*, int,
+                       struct FTW*) {
+  remove(path);
+  return 0;
+}
+
+int main(int argc, char* argv[]) {
+  const char* arg0 = argv[0];
+  double scale = 1;
+  int repeats = 3;
+  vector<string> workload_filters;
+  vector<string> config_filters;
+  while (argc >= 3 && argv[1][0] == '-') {
+    if (!strcmp(argv[1], "-s")) {
+      scale = atof(argv[2]);
+    } else if (!strcmp(argv[1], "-r")) {
+      repeats = atoi(argv[2]);
+    } else if (!strcmp(argv[1], "-t")) {
+      g_timeout_sec = atoi(argv[2]);
+    } else if (!strcmp(argv[1], "-w")) {
+      splitList(argv[2], &workload_filters);
+    } else if (!strcmp(argv[1], "-c")) {
+      splitList(argv[2], &config_filters);
+    } else {
+      break;
+    }
+    argc -= 2;
+    argv += 2;
+  }
+  if (argc != 1 || scale <= 0 || repeats <= 0 || g_timeout_sec <= 0) {
+    fprintf(stderr,
+            "Usage: %s [-s scale] [-r repeats] [-t timeout] "
+            "[-w workload,...] [-c config,...]\n"
+            " -s: multiply the iterations of each workload (default 1)\n"
+            " -r: run each pair this many times and keep the fastest "
+            "(default 3)\n"
+            " -t: kill runs after this many seconds (default 120)\n"
+            " -w: run only these workloads\n"
+            " -c: run only these configs. bare always runs\n"
+            "Workloads:",
+            arg0);
+    for (size_t i = 0; i < sizeof(kWorkloads) / sizeof(kWorkloads[0]); i++)
+      fprintf(stderr, " %s", kWorkloads[i].name);
+    fprintf(stderr, "\nConfigs:");
+    for (size_t i = 0; i < sizeof(kConfigs) / sizeof(kConfigs[0]); i++)
+      fprintf(stderr, " %s", kConfigs[i].name);
+    fprintf(stderr, "\n");
+    return 1;
+  }
+
+  // katd_bench lives in bench/ next to the workload, and katd is in the
+  // parent directory.
+  string bench_dir = getDirName(arg0);
+  string workload = bench_dir + "/workload";
+  string binaries[] = {
+    "", bench_dir + "/../katd", bench_dir + "/katd-noseccomp",
+  };
+
+  char tmpl[] = "/tmp/katd-bench.XXXXXX";
+  PCHECK(mkdtemp(tmpl));
+  string work_dir = tmpl;
+  string data_dir = work_dir + "/data";
+  string trace_file = work_dir + "/trace";
+  vector<string> setup_args;
+  setup_args.push_back(workload);
+  setup_args.push_back("setup");
+  setup_args.push_back(data_dir);
+  CHECK(runOnce(setup_args).ok);
+
+  printf("%-12s %-19s %10s %9s %9s %11s %9s\n",
+         "workload", "config", "ms", "slowdown", "events", "events/s",
+         "rss_kb");
+  fflush(stdout);
+  bool failed = false;
+  for (size_t w = 0; w < sizeof(kWorkloads) / sizeof(kWorkloads[0]); w++) {
+    const Workload& wl = kWorkloads[w];
+    if (!matches(wl.name, workload_filters))
+      continue;
+    char n[32];
+    snprintf(n, sizeof(n), "%d",
+             max(1, static_cast<int>(wl.n * scale + 0.5)));
+
+    uint64_t bare_ns = 0;
+    uint64_t traced_events = 0;
+    for (size_t c = 0; c < sizeof(kConfigs) / sizeof(kConfigs[0]); c++) {
+      const Config& config = kConfigs[c];
+      if (config.binary != BARE && !matches(config.name, config_filters))
+        continue;
+      vector<string> args;
+      if (config.binary != BARE) {
+        if (access(binaries[config.binary].c_str(), X_OK) != 0) {
+          printf("%-12s %-19s %10s\n", wl.name, config.name, "missing");
+          continue;
+        }
+        if (strstr(config.options, "--fanotify") && geteuid() != 0) {
+          printf("%-12s %-19s %10s\n", wl.name, config.name, "skipped");
+          continue;
+        }
+        args.push_back(binaries[config.binary]);
+        vector<string> options =
+            splitOptions(config.options, trace_file, data_dir);
+        args.insert(args.end(), options.begin(), options.end());
+      }
+      args.push_back(workload);
+      args.push_back(wl.mode);
+      args.push_back(data_dir);
+      args.push_back(n);
+
+      Result best = Result();
+      for (int i = 0; i < repeats; i++) {
+        Result r = runOnce(args);
+        if (!r.ok) {
+          best = r;
+          break;
+        }
+        if (i == 0 || r.wall_ns < best.wall_ns)
+          best = r;
+        if (best.max_rss_kb < r.max_rss_kb)
+          best.max_rss_kb = r.max_rss_kb;
+      }
+      if (!best.ok) {
+        printf("%-12s %-19s %10s\n", wl.name, config.name,
+               best.wall_ns >= g_timeout_sec * 1000000000ULL ?
+               "timeout" : "failed");
+        fflush(stdout);
+        failed = true;
+        continue;
+      }
+
+      if (config.binary == BARE)
+        bare_ns = best.wall_ns;
+      else if (!traced_events)
+        traced_events = best.events;
+      uint64_t events = config.binary == BARE ? 0 :
+          best.events ? best.events : traced_events;
+      printf("%-12s %-19s %10.1f %8.2fx %9llu %11.0f %9ld\n",
+             wl.name, config.name, best.wall_ns / 1e6,
+             bare_ns ? static_cast<double>(best.wall_ns) / bare_ns : 0.0,
+             static_cast<unsigned long long>(events),
+             events * 1e9 / best.wall_ns, best.max_rss_kb);
+      fflush(stdout);
+    }
+  }
+
+  nftw(work_dir.c_str(), removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+  return failed ? 1 : 0;
+}
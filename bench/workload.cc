@@ -0,0 +1,254 @@
+// Synthetic programs for katd_bench to trace. Each mode makes many
+// syscalls katd reports, with little other work, so the time under
+// katd is dominated by tracing.
+//
+// Usage: workload setup dir
+//        workload mode dir n
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "log.h"
+
+using namespace std;
+
+// The tree for the stat storm has kFanout^kDepth leaf directories, each
+// with kFilesPerDir files.
+static const int kDepth = 4;
+static const int kFanout = 4;
+static const int kFilesPerDir = 8;
+// Long enough that reading the path crosses several pages, but within
+// PATH_MAX.
+static const int kLongPathSize = 3800;
+static const int kNumThreads = 4;
+// Children of the fan-out which run at the same time.
+static const int kMaxRunning = 16;
+
+static void makeFile(const string& path) {
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  PCHECK(fd >= 0);
+  PCHECK(write(fd, "x\n", 2) == 2);
+  close(fd);
+}
+
+static void makeDir(const string& path) {
+  PCHECK(mkdir(path.c_str(), 0755) == 0 || errno == EEXIST);
+}
+
+static void makeTree(const string& dir, int depth) {
+  makeDir(dir);
+  if (depth == kDepth) {
+    for (int i = 0; i < kFilesPerDir; i++) {
+      char name[32];
+      snprintf(name, sizeof(name), "/file%d.h", i);
+      makeFile(dir + name);
+    }
+    return;
+  }
+  for (int i = 0; i < kFanout; i++) {
+    char name[32];
+    snprintf(name, sizeof(name), "/d%d", i);
+    makeTree(dir + name, depth + 1);
+  }
+}
+
+// Returns a directory under |dir| whose path is about kLongPathSize
+// bytes long.
+static string getLongDir(const string& dir) {
+  string path = dir + "/long";
+  while (path.size() < kLongPathSize)
+    path += "/a_directory_with_a_rather_long_name";
+  return path;
+}
+
+static void setup(const string& dir) {
+  makeDir(dir);
+  makeTree(dir + "/tree", 0);
+  makeDir(dir + "/at");
+  makeDir(dir + "/scratch");
+  for (int i = 0; i < kFilesPerDir; i++) {
+    char name[32];
+    snprintf(name, sizeof(name), "/at/file%d", i);
+    makeFile(dir + name);
+  }
+  PCHECK(symlink("file0", (dir + "/at/link").c_str()) == 0 ||
+         errno == EEXIST);
+
+  // Each component is created relative to the previous one, since the
+  // whole path may be too long for mkdir.
+  string long_dir = getLongDir(dir);
+  int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  PCHECK(fd >= 0);
+  size_t start = dir.size() + 1;
+  while (start < long_dir.size()) {
+    size_t end = long_dir.find('/', start);
+    if (end == string::npos)
+      end = long_dir.size();
+    string name = long_dir.substr(start, end - start);
+    PCHECK(mkdirat(fd, name.c_str(), 0755) == 0 || errno == EEXIST);
+    int next = openat(fd, name.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    PCHECK(next >= 0);
+    close(fd);
+    fd = next;
+    start = end + 1;
+  }
+  PCHECK(close(fd) == 0);
+  makeFile(long_dir + "/file.h");
+}
+
+// Walks the tree, stats every entry and opens every file, like a build
+// system checking its inputs.
+static void walk(const string& dir) {
+  DIR* d = opendir(dir.c_str());
+  PCHECK(d);
+  while (dirent* ent = readdir(d)) {
+    if (ent->d_name[0] == '.')
+      continue;
+    string path = dir + "/" + ent->d_name;
+    struct stat st;
+    PCHECK(stat(path.c_str(), &st) == 0);
+    if (S_ISDIR(st.st_mode)) {
+      walk(path);
+      continue;
+    }
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    PCHECK(fd >= 0);
+    close(fd);
+    // A probe for a file which does not exist, like a header search.
+    PCHECK(access((path + ".gch").c_str(), F_OK) < 0);
+  }
+  closedir(d);
+}
+
+static void statStorm(const string& dir, int n) {
+  for (int i = 0; i < n; i++)
+    walk(dir + "/tree");
+}
+
+// Forks and execs |n| children which exit at once.
+static void forkExec(const char* self, int n) {
+  int running = 0;
+  for (int i = 0; i < n; i++) {
+    if (running == kMaxRunning) {
+      PCHECK(wait(NULL) > 0);
+      running--;
+    }
+    pid_t pid = fork();
+    PCHECK(pid >= 0);
+    if (pid == 0) {
+      execl(self, self, "noop", NULL);
+      _exit(127);
+    }
+    running++;
+  }
+  int status;
+  while (wait(&status) > 0)
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+static void openFiles(const string& dir, int n) {
+  char path[64];
+  for (int i = 0; i < n; i++) {
+    snprintf(path, sizeof(path), "/at/file%d", i % kFilesPerDir);
+    int fd = open((dir + path).c_str(), O_RDONLY | O_CLOEXEC);
+    PCHECK(fd >= 0);
+    close(fd);
+  }
+}
+
+static void threads(const string& dir, int n) {
+  vector<thread> workers;
+  for (int i = 0; i < kNumThreads; i++)
+    workers.push_back(thread(openFiles, dir, n / kNumThreads));
+  for (size_t i = 0; i < workers.size(); i++)
+    workers[i].join();
+}
+
+static void longPaths(const string& dir, int n) {
+  string file = getLongDir(dir) + "/file.h";
+  string missing = getLongDir(dir) + "/missing.h";
+  for (int i = 0; i < n; i++) {
+    struct stat st;
+    PCHECK(stat(file.c_str(), &st) == 0);
+    int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+    PCHECK(fd >= 0);
+    close(fd);
+    PCHECK(access(missing.c_str(), F_OK) < 0);
+  }
+}
+
+// Reads and writes relative to directory fds, which katd resolves with
+// its fd table.
+static void atCalls(const string& dir, int n) {
+  int at = open((dir + "/at").c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  PCHECK(at >= 0);
+  int scratch = open((dir + "/scratch").c_str(),
+                     O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  PCHECK(scratch >= 0);
+  char buf[64];
+  for (int i = 0; i < n; i++) {
+    snprintf(buf, sizeof(buf), "file%d", i % kFilesPerDir);
+    struct stat st;
+    PCHECK(fstatat(at, buf, &st, 0) == 0);
+    PCHECK(faccessat(at, buf, R_OK, 0) == 0);
+    int fd = openat(at, buf, O_RDONLY | O_CLOEXEC);
+    PCHECK(fd >= 0);
+    close(fd);
+    PCHECK(readlinkat(at, "link", buf, sizeof(buf)) > 0);
+
+    fd = openat(scratch, "tmp", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                0644);
+    PCHECK(fd >= 0);
+    close(fd);
+    PCHECK(renameat(scratch, "tmp", scratch, "out") == 0);
+    PCHECK(unlinkat(scratch, "out", 0) == 0);
+  }
+  close(scratch);
+  close(at);
+}
+
+int main(int argc, char* argv[]) {
+  if (argc == 2 && !strcmp(argv[1], "noop"))
+    return 0;
+  if (argc == 3 && !strcmp(argv[1], "setup")) {
+    setup(argv[2]);
+    return 0;
+  }
+  if (argc != 4) {
+    fprintf(stderr,
+            "Usage: %s setup dir\n"
+            "       %s stat|fork|threads|long|at dir n\n",
+            argv[0], argv[0]);
+    return 1;
+  }
+
+  const char* mode = argv[1];
+  string dir = argv[2];
+  int n = atoi(argv[3]);
+  if (!strcmp(mode, "stat")) {
+    statStorm(dir, n);
+  } else if (!strcmp(mode, "fork")) {
+    forkExec(argv[0], n);
+  } else if (!strcmp(mode, "threads")) {
+    threads(dir, n);
+  } else if (!strcmp(mode, "long")) {
+    longPaths(dir, n);
+  } else if (!strcmp(mode, "at")) {
+    atCalls(dir, n);
+  } else {
+    fprintf(stderr, "%s: unknown mode %s\n", argv[0], mode);
+    return 1;
+  }
+}
@@ -0,0 +1,156 @@
+#include "binary_trace.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "event.h"
+#include "handler.h"
+
+using namespace std;
+
+namespace katd {
+
+const char kBinaryTraceMagic[8] = { 'K', 'A', 'T', 'D', 'T', 'R', 'C', '1' };
+
+BinaryTraceReader::BinaryTraceReader()
+  : data_(NULL),
+    size_(0),
+    pos_(0),
+    truncated_(false),
+    handler_(NULL) {
+}
+
+BinaryTraceReader::~BinaryTraceReader() {
+  if (data_)
+    munmap(const_cast<char*>(data_), size_);
+}
+
+bool BinaryTraceReader::open(const char* filename) {
+  int fd = ::open(filename, O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    return false;
+  }
+  size_ = st.st_size;
+  if (size_ < sizeof(kBinaryTraceMagic)) {
+    close(fd);
+    errno = EINVAL;
+    return false;
+  }
+  void* p = mmap(NULL, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED)
+    return false;
+  data_ = static_cast<const char*>(p);
+  madvise(p, size_, MADV_SEQUENTIAL);
+  if (memcmp(data_, kBinaryTraceMagic, sizeof(kBinaryTraceMagic))) {
+    errno = EINVAL;
+    return false;
+  }
+  pos_ = sizeof(kBinaryTraceMagic);
+  return true;
+}
+
+// Stops at the record at |pos|, which is cut off or malformed.
+bool BinaryTraceReader::stop(size_t pos) {
+  pos_ = pos;
+  truncated_ = true;
+  return false;
+}
+
+bool BinaryTraceReader::next(Event* ev) {
+  while (!truncated_ && pos_ < size_) {
+    size_t start = pos_;
+    BinaryRecordHeader header;
+    if (pos_ + sizeof(header) > size_)
+      return stop(start);
+    memcpy(&header, data_ + pos_, sizeof(header));
+    const char* payload = data_ + pos_ + sizeof(header);
+    if (header.size > size_ - pos_ - sizeof(header))
+      return stop(start);
+    pos_ += sizeof(header) + header.size;
+
+    switch (header.kind) {
+    case BINARY_RECORD_PATH: {
+      uint32_t id;
+      if (header.size < sizeof(id))
+        return stop(start);
+      memcpy(&id, payload, sizeof(id));
+      if (id != path_ids_.size())
+        return stop(start);
+      path_ids_.push_back(PathTable::global()->intern(
+          payload + sizeof(id), header.size - sizeof(id)));
+      break;
+    }
+
+    case BINARY_RECORD_EVENT: {
+      BinaryEventRecord rec;
+      if (header.size != sizeof(rec))
+        return stop(start);
+      memcpy(&rec, payload, sizeof(rec));
+      if (rec.path_id >= path_ids_.size())
+        return stop(start);
+      ev->path_id = path_ids_[rec.path_id];
+      ev->syscall = static_cast<Syscall>(rec.syscall);
+      ev->type = static_cast<EventType>(rec.type);
+      ev->error = rec.error;
+      ev->pid = rec.pid;
+      return true;
+    }
+
+    case BINARY_RECORD_FORK: {
+      BinaryForkRecord rec;
+      if (header.size != sizeof(rec))
+        return stop(start);
+      memcpy(&rec, payload, sizeof(rec));
+      if (handler_)
+        handler_->handleFork(rec.parent_pid, rec.pid);
+      break;
+    }
+
+    case BINARY_RECORD_EXEC: {
+      int32_t pid;
+      if (header.size < sizeof(pid))
+        return stop(start);
+      memcpy(&pid, payload, sizeof(pid));
+      if (!handler_)
+        break;
+      vector<string> args;
+      const char* p = payload + sizeof(pid);
+      const char* end = payload + header.size;
+      while (p < end) {
+        const char* nul = static_cast<const char*>(memchr(p, '\0', end - p));
+        if (!nul)
+          return stop(start);
+        args.push_back(string(p, nul - p));
+        p = nul + 1;
+      }
+      handler_->handleExec(pid, args);
+      break;
+    }
+
+    case BINARY_RECORD_EXIT: {
+      int32_t pid;
+      if (header.size != sizeof(pid))
+        return stop(start);
+      memcpy(&pid, payload, sizeof(pid));
+      if (handler_)
+        handler_->handleExit(pid);
+      break;
+    }
+
+    default:
+      // Skip records written by newer versions.
+      break;
+    }
+  }
+  return false;
+}
+
+}  // namespace katd
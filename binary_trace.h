@@ -0,0 +1,94 @@
+#ifndef KATD_BINARY_TRACE_H_
+#define KATD_BINARY_TRACE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "path_table.h"
+
+namespace katd {
+
+struct Event;
+class Handler;
+
+// A binary trace starts with kBinaryTraceMagic and is followed by
+// records. Each record is a BinaryRecordHeader and |size| bytes of
+// payload. Integers are in the host byte order.
+//
+// A BINARY_RECORD_PATH record appears before the first event which
+// refers to the path. Its payload is the uint32 id of the path followed
+// by the path without NUL. Ids are assigned from zero in the order of
+// appearance.
+//
+// Process records follow Handler: BINARY_RECORD_FORK comes before the
+// first event of the new process, BINARY_RECORD_EXEC has the pid and
+// the arguments, each terminated by NUL, and BINARY_RECORD_EXIT has the
+// pid. Traces written before these were added have none of them.
+extern const char kBinaryTraceMagic[8];
+
+enum BinaryRecordKind {
+  BINARY_RECORD_PATH = 1,
+  BINARY_RECORD_EVENT = 2,
+  BINARY_RECORD_FORK = 3,
+  BINARY_RECORD_EXEC = 4,
+  BINARY_RECORD_EXIT = 5,
+};
+
+struct BinaryRecordHeader {
+  uint32_t size;
+  uint8_t kind;
+} __attribute__((packed));
+
+struct BinaryEventRecord {
+  int8_t type;
+  uint16_t syscall;
+  uint16_t error;
+  int32_t pid;
+  uint32_t path_id;
+} __attribute__((packed));
+
+struct BinaryForkRecord {
+  int32_t parent_pid;
+  int32_t pid;
+} __attribute__((packed));
+
+// Reads a binary trace written by BinaryTraceHandler. The file is mapped
+// to memory and paths are interned to PathTable::global() while reading.
+class BinaryTraceReader {
+public:
+  BinaryTraceReader();
+  ~BinaryTraceReader();
+
+  // Returns false and sets errno if |filename| cannot be mapped.
+  bool open(const char* filename);
+
+  // Reads the next event. Returns false at the end of the trace, or at a
+  // record which is cut off or malformed.
+  bool next(Event* ev);
+  // Whether |next| stopped at such a record, e.g. since katd was killed
+  // while writing the trace. |offset| is where the record starts.
+  bool truncated() const { return truncated_; }
+
+  // Passes the process records to |handler| as |next| reads past them.
+  void set_handler(Handler* handler) { handler_ = handler; }
+
+  // The offset of the record which will be read by the next |next|.
+  size_t offset() const { return pos_; }
+
+private:
+  bool stop(size_t pos);
+
+  const char* data_;
+  size_t size_;
+  size_t pos_;
+  bool truncated_;
+  Handler* handler_;
+  // Indexed by the path ids in the trace.
+  std::vector<PathId> path_ids_;
+};
+
+}  // namespace katd
+
+#endif  // KATD_BINARY_TRACE_H_
@@ -0,0 +1,144 @@
+#include "binary_trace_handler.h"
+
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "binary_trace.h"
+#include "event.h"
+#include "log.h"
+
+using namespace std;
+
+namespace katd {
+
+static const size_t kBufferSize = 1 << 20;
+static const size_t kMapSize = 64 << 20;
+static const uint32_t kNoFileId = ~0u;
+
+BinaryTraceHandler::BinaryTraceHandler(int fd, bool use_mmap)
+  : fd_(fd),
+    use_mmap_(use_mmap),
+    map_(NULL),
+    map_offset_(0),
+    map_size_(0),
+    written_(0),
+    paths_(PathTable::global()),
+    num_file_ids_(0) {
+  if (!use_mmap_)
+    buf_.reserve(kBufferSize);
+  write(kBinaryTraceMagic, sizeof(kBinaryTraceMagic));
+}
+
+BinaryTraceHandler::~BinaryTraceHandler() {
+  flush();
+  if (map_) {
+    PCHECK(munmap(map_, map_size_) == 0);
+    // Drop the unused tail of the last window.
+    PCHECK(ftruncate(fd_, written_) == 0);
+  }
+}
+
+void BinaryTraceHandler::handleEvent(const Event& event) {
+  BinaryEventRecord rec;
+  rec.path_id = getFileId(event.path_id);
+  rec.type = event.type;
+  rec.syscall = event.syscall;
+  rec.error = event.error;
+  rec.pid = event.pid;
+  writeRecord(BINARY_RECORD_EVENT, &rec, sizeof(rec), NULL, 0);
+}
+
+void BinaryTraceHandler::handleFork(int parent_pid, int pid) {
+  BinaryForkRecord rec;
+  rec.parent_pid = parent_pid;
+  rec.pid = pid;
+  writeRecord(BINARY_RECORD_FORK, &rec, sizeof(rec), NULL, 0);
+}
+
+void BinaryTraceHandler::handleExec(int pid, const vector<string>& args) {
+  exec_buf_.clear();
+  for (size_t i = 0; i < args.size(); i++) {
+    exec_buf_ += args[i];
+    exec_buf_ += '\0';
+  }
+  int32_t pid32 = pid;
+  writeRecord(BINARY_RECORD_EXEC, &pid32, sizeof(pid32),
+              exec_buf_.data(), exec_buf_.size());
+}
+
+void BinaryTraceHandler::handleExit(int pid) {
+  int32_t pid32 = pid;
+  writeRecord(BINARY_RECORD_EXIT, &pid32, sizeof(pid32), NULL, 0);
+}
+
+void BinaryTraceHandler::flush() {
+  if (use_mmap_)
+    return;
+  const char* p = buf_.data();
+  size_t size = buf_.size();
+  while (size) {
+    ssize_t r = ::write(fd_, p, size);
+    if (r < 0 && errno == EINTR)
+      continue;
+    PCHECK(r > 0);
+    p += r;
+    size -= r;
+  }
+  buf_.clear();
+}
+
+uint32_t BinaryTraceHandler::getFileId(PathId path_id) {
+  if (path_id >= file_ids_.size())
+    file_ids_.resize(path_id + 1, kNoFileId);
+  uint32_t* id = &file_ids_[path_id];
+  if (*id == kNoFileId) {
+    *id = num_file_ids_++;
+    writeRecord(BINARY_RECORD_PATH, id, sizeof(*id),
+                paths_->str(path_id), paths_->size(path_id));
+  }
+  return *id;
+}
+
+void BinaryTraceHandler::writeRecord(uint8_t kind,
+                                     const void* data, size_t size,
+                                     const void* data2, size_t size2) {
+  BinaryRecordHeader header;
+  header.size = size + size2;
+  header.kind = kind;
+  write(&header, sizeof(header));
+  write(data, size);
+  if (size2)
+    write(data2, size2);
+}
+
+void BinaryTraceHandler::write(const void* data, size_t size) {
+  if (use_mmap_) {
+    if (written_ + size > map_offset_ + map_size_)
+      remap(size);
+    memcpy(map_ + (written_ - map_offset_), data, size);
+  } else {
+    if (buf_.size() + size > kBufferSize)
+      flush();
+    buf_.append(static_cast<const char*>(data), size);
+  }
+  written_ += size;
+}
+
+void BinaryTraceHandler::remap(size_t size) {
+  if (map_)
+    PCHECK(munmap(map_, map_size_) == 0);
+  static const size_t kPageSize = sysconf(_SC_PAGESIZE);
+  map_offset_ = written_ & ~(kPageSize - 1);
+  map_size_ = max(kMapSize, written_ - map_offset_ + size);
+  map_size_ = (map_size_ + kPageSize - 1) & ~(kPageSize - 1);
+  PCHECK(ftruncate(fd_, map_offset_ + map_size_) == 0);
+  void* p = mmap(NULL, map_size_, PROT_READ | PROT_WRITE, MAP_SHARED,
+                 fd_, map_offset_);
+  PCHECK(p != MAP_FAILED);
+  map_ = static_cast<char*>(p);
+}
+
+}  // namespace katd
@@ -0,0 +1,56 @@
+#ifndef KATD_BINARY_TRACE_HANDLER_H_
+#define KATD_BINARY_TRACE_HANDLER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <string>
+#include <vector>
+
+#include "handler.h"
+#include "path_table.h"
+
+namespace katd {
+
+// Writes events in the format described in binary_trace.h. Output is
+// buffered and written when the buffer is full or the handler is
+// destroyed. With |use_mmap|, |fd| must be a regular file, which is
+// extended and mapped in large windows instead.
+class BinaryTraceHandler : public Handler {
+public:
+  BinaryTraceHandler(int fd, bool use_mmap);
+  virtual ~BinaryTraceHandler();
+
+  virtual void handleEvent(const Event& event);
+  virtual void handleFork(int parent_pid, int pid);
+  virtual void handleExec(int pid, const std::vector<std::string>& args);
+  virtual void handleExit(int pid);
+  virtual void flush();
+
+private:
+  uint32_t getFileId(PathId path_id);
+  void writeRecord(uint8_t kind, const void* data, size_t size,
+                   const void* data2, size_t size2);
+  void write(const void* data, size_t size);
+  void remap(size_t size);
+
+  int fd_;
+  bool use_mmap_;
+  std::string buf_;
+  // The payload of an exec record.
+  std::string exec_buf_;
+  char* map_;
+  off_t map_offset_;
+  size_t map_size_;
+  off_t written_;
+  PathTable* paths_;
+  // Path ids in the trace, indexed by PathId. Paths not written yet are
+  // kNoFileId.
+  std::vector<uint32_t> file_ids_;
+  uint32_t num_file_ids_;
+};
+
+}  // namespace katd
+
+#endif  // KATD_BINARY_TRACE_HANDLER_H_
@@ -0,0 +1,563 @@
+#include "command_cache.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "content_hash.h"
+#include "event.h"
+#include "log.h"
+
+extern char** environ;
+
+using namespace std;
+
+namespace katd {
+
+static const char kManifestMagic[] = "katd-cache 1";
+// Files modified this recently may change again within the same mtime
+// tick, so matching size and mtime are not trusted for them.
+static const int kRacySeconds = 2;
+
+// Variables which differ between otherwise identical runs.
+static const char* const kIgnoredEnv[] = {
+  "_", "OLDPWD", "SHLVL",
+};
+
+static bool isIgnoredPath(const char* path) {
+  return !strncmp(path, "/proc/", 6) || !strncmp(path, "/sys/", 5) ||
+      !strncmp(path, "/dev/", 5);
+}
+
+static bool readFile(const char* path, string* data) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+  data->clear();
+  char buf[1 << 16];
+  ssize_t r;
+  while ((r = read(fd, buf, sizeof(buf))) > 0)
+    data->append(buf, r);
+  close(fd);
+  return r == 0;
+}
+
+// Writes |data| to a temporary file next to |path| and renames it, so
+// readers never see a partial file.
+static bool writeFileAtomically(const string& path, const string& data,
+                                mode_t mode) {
+  char tmp[PATH_MAX];
+  snprintf(tmp, sizeof(tmp), "%s.katd-tmp-%d", path.c_str(), getpid());
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode);
+  if (fd < 0)
+    return false;
+  const char* p = data.data();
+  size_t size = data.size();
+  while (size) {
+    ssize_t r = write(fd, p, size);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      break;
+    p += r;
+    size -= r;
+  }
+  // The umask may have dropped bits.
+  bool ok = !size && fchmod(fd, mode) == 0;
+  ok = close(fd) == 0 && ok;
+  if (!ok || rename(tmp, path.c_str()) != 0) {
+    unlink(tmp);
+    return false;
+  }
+  return true;
+}
+
+static void makeDirs(const string& path) {
+  for (size_t i = 1; i < path.size(); i++) {
+    if (path[i] == '/')
+      mkdir(path.substr(0, i).c_str(), 0777);
+  }
+  mkdir(path.c_str(), 0777);
+}
+
+static string getDir(const string& path) {
+  return path.substr(0, path.rfind('/'));
+}
+
+static string hashData(const string& data) {
+  ContentHash hash(HASH_SHA256);
+  hash.update(data.data(), data.size());
+  return hash.finish();
+}
+
+// Returns the digest of the file or directory at |path|, or an empty
+// string if it is neither. A directory is hashed by its entry names.
+static string hashPath(const char* path, struct stat* st) {
+  if (stat(path, st) < 0)
+    return "";
+  if (S_ISDIR(st->st_mode)) {
+    DIR* dir = opendir(path);
+    if (!dir)
+      return "";
+    vector<string> names;
+    while (struct dirent* ent = readdir(dir))
+      names.push_back(ent->d_name);
+    closedir(dir);
+    sort(names.begin(), names.end());
+    string listing = "dir";
+    for (size_t i = 0; i < names.size(); i++) {
+      listing += '\0';
+      listing += names[i];
+    }
+    return hashData(listing);
+  }
+  if (!S_ISREG(st->st_mode))
+    return "";
+  string data;
+  if (!readFile(path, &data))
+    return "";
+  return hashData(data);
+}
+
+static bool fromHex(const char* hex, size_t size, string* digest) {
+  digest->clear();
+  for (size_t i = 0; i + 1 < size; i += 2) {
+    char byte[3] = { hex[i], hex[i + 1], 0 };
+    char* end;
+    unsigned long v = strtoul(byte, &end, 16);
+    if (*end)
+      return false;
+    *digest += static_cast<char>(v);
+  }
+  return size % 2 == 0 && size;
+}
+
+CommandCache::Capture::Capture()
+  : fd(-1),
+    saved_fd(-1),
+    pipe_fd(-1) {
+}
+
+CommandCache::CommandCache(const string& dir, char** argv)
+  : dir_(dir) {
+  string key = kManifestMagic;
+  key += '\0';
+  for (char** arg = argv; *arg; arg++) {
+    key += *arg;
+    key += '\0';
+  }
+  char cwd[PATH_MAX + 1];
+  PCHECK(getcwd(cwd, sizeof(cwd)));
+  key += '\n';
+  key += cwd;
+  key += '\0';
+
+  vector<string> env;
+  for (char** e = environ; *e; e++) {
+    const char* eq = strchr(*e, '=');
+    string name(*e, eq ? eq - *e : strlen(*e));
+    bool ignored = false;
+    for (const char* ignored_name : kIgnoredEnv)
+      ignored |= name == ignored_name;
+    if (!ignored)
+      env.push_back(*e);
+  }
+  sort(env.begin(), env.end());
+  key += '\n';
+  for (size_t i = 0; i < env.size(); i++) {
+    key += env[i];
+    key += '\0';
+  }
+  key_ = toHex(hashData(key));
+}
+
+CommandCache::~CommandCache() {
+  stopCapture(&out_);
+  stopCapture(&err_);
+}
+
+void CommandCache::handleEvent(const Event& event) {
+  // Placeholders such as "<bad fd>/" cannot be checked or restored.
+  if (PathTable::global()->str(event.path_id)[0] != '/')
+    return;
+  uint8_t* flags = &paths_[event.path_id];
+  switch (event.type) {
+  case READ_CONTENT:
+    if (!(*flags & (OUTPUT | REMOVED)))
+      *flags |= INPUT;
+    break;
+  case READ_METADATA:
+    if (!(*flags & (OUTPUT | REMOVED)))
+      *flags |= EXISTS;
+    break;
+  case WRITE_CONTENT:
+  case WRITE_METADATA:
+    *flags = (*flags & ~REMOVED) | OUTPUT;
+    break;
+  case REMOVE_CONTENT:
+    // Temporary files the command created are not outputs.
+    if (*flags & OUTPUT)
+      *flags &= ~OUTPUT;
+    else
+      *flags |= REMOVED;
+    break;
+  case READ_FAILURE:
+    // Other errors, e.g. EINVAL from readlink of a regular file, do not
+    // tell the path is missing.
+    if ((event.error == ENOENT || event.error == ENOTDIR) &&
+        !(*flags & (INPUT | EXISTS | OUTPUT | REMOVED))) {
+      *flags |= FAILED;
+    }
+    break;
+  default:
+    break;
+  }
+}
+
+string CommandCache::getManifestPath() const {
+  return dir_ + "/" + key_.substr(0, 2) + "/" + key_.substr(2);
+}
+
+string CommandCache::getObjectPath(const string& digest) const {
+  string hex = toHex(digest);
+  return dir_ + "/objects/" + hex.substr(0, 2) + "/" + hex.substr(2);
+}
+
+bool CommandCache::storeObject(const string& data, string* digest) {
+  *digest = hashData(data);
+  string path = getObjectPath(*digest);
+  if (access(path.c_str(), F_OK) == 0)
+    return true;
+  makeDirs(getDir(path));
+  return writeFileAtomically(path, data, 0444);
+}
+
+bool CommandCache::readObject(const string& digest, string* data) const {
+  return readFile(getObjectPath(digest).c_str(), data);
+}
+
+// The manifest has a line per record:
+//
+//   T time                            when it was written
+//   I digest size mtime_ns path       an input
+//   E path                            a path which must exist
+//   F path                            a path which must not exist
+//   O digest mode path                a file to restore
+//   D mode path                       a directory to create
+//   L target path                     a symlink to create
+//   R path                            a path to remove
+//   1 digest / 2 digest               stdout and stderr
+//
+// Paths with newlines are not stored.
+bool CommandCache::restore() {
+  FILE* fp = fopen(getManifestPath().c_str(), "re");
+  if (!fp)
+    return false;
+
+  struct Action {
+    char kind;
+    string digest;
+    mode_t mode;
+    string path;
+    string target;
+  };
+  vector<Action> actions;
+  time_t created = 0;
+  bool hit = true;
+  // Cut short by a crash, or written by another version.
+  bool malformed = false;
+  char* line = NULL;
+  size_t line_size = 0;
+  ssize_t len = getline(&line, &line_size, fp);
+  if (len < 0 || strncmp(line, kManifestMagic, strlen(kManifestMagic)))
+    malformed = true;
+  while (hit && !malformed &&
+         (len = getline(&line, &line_size, fp)) > 0) {
+    if (line[len - 1] == '\n')
+      line[--len] = '\0';
+    if (len < 2 || line[1] != ' ') {
+      malformed = true;
+      break;
+    }
+    char* p = line + 2;
+    struct stat st;
+    switch (line[0]) {
+    case 'T':
+      created = strtoll(p, NULL, 10);
+      break;
+    case 'I': {
+      char* sp = strchr(p, ' ');
+      string digest;
+      unsigned long long size;
+      long long mtime_ns;
+      char* path = NULL;
+      if (sp && fromHex(p, sp - p, &digest) &&
+          sscanf(sp, " %llu %lld", &size, &mtime_ns) == 2) {
+        // The path follows the size and the mtime.
+        path = strchr(sp + 1, ' ');
+        if (path)
+          path = strchr(path + 1, ' ');
+      }
+      if (!path) {
+        malformed = true;
+        break;
+      }
+      if (stat(path + 1, &st) < 0 ||
+          static_cast<unsigned long long>(st.st_size) != size) {
+        hit = false;
+        break;
+      }
+      long long st_mtime_ns =
+          st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+      // Unchanged size and mtime are trusted unless the file may have
+      // changed within the same mtime tick as the run.
+      if (st_mtime_ns == mtime_ns &&
+          st.st_mtim.tv_sec + kRacySeconds < created) {
+        break;
+      }
+      hit = hashPath(path + 1, &st) == digest;
+      break;
+    }
+    case 'E':
+      hit = access(p, F_OK) == 0;
+      break;
+    case 'F':
+      hit = access(p, F_OK) < 0 && (errno == ENOENT || errno == ENOTDIR);
+      break;
+    case 'O':
+    case 'D':
+    case 'L':
+    case 'R':
+    case '1':
+    case '2': {
+      Action a;
+      a.kind = line[0];
+      a.mode = 0;
+      if (a.kind == 'O' || a.kind == '1' || a.kind == '2') {
+        char* sp = strchrnul(p, ' ');
+        hit = fromHex(p, sp - p, &a.digest) &&
+            access(getObjectPath(a.digest).c_str(), R_OK) == 0;
+        p = *sp ? sp + 1 : sp;
+      }
+      if (a.kind == 'O' || a.kind == 'D') {
+        a.mode = strtoul(p, &p, 8);
+        if (*p != ' ') {
+          malformed = true;
+          break;
+        }
+        p++;
+      }
+      if (a.kind == 'L') {
+        char* sp = strchrnul(p, ' ');
+        if (!*sp || !fromHex(p, sp - p, &a.target)) {
+          malformed = true;
+          break;
+        }
+        p = sp + 1;
+      }
+      a.path = p;
+      actions.push_back(a);
+      break;
+    }
+    default:
+      malformed = true;
+    }
+  }
+  free(line);
+  fclose(fp);
+  if (malformed) {
+    // Never a hit, so drop it for the run to record a new one.
+    unlink(getManifestPath().c_str());
+    return false;
+  }
+  if (!hit)
+    return false;
+
+  for (size_t i = 0; i < actions.size(); i++) {
+    const Action& a = actions[i];
+    string data;
+    switch (a.kind) {
+    case 'O':
+      makeDirs(getDir(a.path));
+      if (!readObject(a.digest, &data) ||
+          !writeFileAtomically(a.path, data, a.mode)) {
+        perror(a.path.c_str());
+        return false;
+      }
+      break;
+    case 'D':
+      makeDirs(a.path);
+      chmod(a.path.c_str(), a.mode);
+      break;
+    case 'L':
+      makeDirs(getDir(a.path));
+      unlink(a.path.c_str());
+      if (symlink(a.target.c_str(), a.path.c_str()) < 0) {
+        perror(a.path.c_str());
+        return false;
+      }
+      break;
+    case 'R':
+      if (unlink(a.path.c_str()) < 0 && errno == EISDIR)
+        rmdir(a.path.c_str());
+      break;
+    case '1':
+    case '2':
+      if (readObject(a.digest, &data)) {
+        FILE* out = a.kind == '1' ? stdout : stderr;
+        fwrite(data.data(), 1, data.size(), out);
+        fflush(out);
+      }
+      break;
+    }
+  }
+  return true;
+}
+
+void CommandCache::startCapture() {
+  fflush(stdout);
+  fflush(stderr);
+  Capture* captures[] = { &out_, &err_ };
+  for (int i = 0; i < 2; i++) {
+    Capture* c = captures[i];
+    int fds[2];
+    PCHECK(pipe2(fds, O_CLOEXEC) == 0);
+    c->fd = i + 1;
+    c->saved_fd = fcntl(c->fd, F_DUPFD_CLOEXEC, 3);
+    PCHECK(c->saved_fd >= 0);
+    // The command inherits the write end as its stdout or stderr.
+    PCHECK(dup2(fds[1], c->fd) == c->fd);
+    close(fds[1]);
+    c->pipe_fd = fds[0];
+    c->reader = thread(&CommandCache::copyOutput, c);
+  }
+}
+
+void CommandCache::copyOutput(Capture* capture) {
+  char buf[1 << 16];
+  for (;;) {
+    ssize_t r = read(capture->pipe_fd, buf, sizeof(buf));
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      break;
+    capture->data.append(buf, r);
+    for (ssize_t done = 0; done < r;) {
+      ssize_t w = write(capture->saved_fd, buf + done, r - done);
+      if (w < 0 && errno == EINTR)
+        continue;
+      if (w <= 0)
+        break;
+      done += w;
+    }
+  }
+}
+
+void CommandCache::stopCapture(Capture* capture) {
+  if (capture->pipe_fd < 0)
+    return;
+  fflush(capture->fd == 1 ? stdout : stderr);
+  // The reader sees EOF once descendants which outlived the command
+  // close their copies too.
+  dup2(capture->saved_fd, capture->fd);
+  close(capture->saved_fd);
+  capture->reader.join();
+  close(capture->pipe_fd);
+  capture->pipe_fd = -1;
+}
+
+int CommandCache::finish(int exit_status) {
+  stopCapture(&out_);
+  stopCapture(&err_);
+  if (exit_status == 0)
+    store();
+  if (exit_status < 0)
+    return 1;
+  if (WIFSIGNALED(exit_status))
+    return 128 + WTERMSIG(exit_status);
+  return WEXITSTATUS(exit_status);
+}
+
+void CommandCache::store() {
+  string manifest = kManifestMagic;
+  char buf[64];
+  snprintf(buf, sizeof(buf), "\nT %lld\n", static_cast<long long>(time(NULL)));
+  manifest += buf;
+
+  PathTable* paths = PathTable::global();
+  for (unordered_map<PathId, uint8_t>::const_iterator it = paths_.begin();
+       it != paths_.end(); ++it) {
+    const char* path = paths->str(it->first);
+    uint8_t flags = it->second;
+    if (!*path || strchr(path, '\n') || isIgnoredPath(path))
+      continue;
+    // Its content before the run is gone, so a later run could not
+    // tell whether the input changed.
+    if ((flags & INPUT) && (flags & (OUTPUT | REMOVED)))
+      return;
+    struct stat st;
+    if (flags & OUTPUT) {
+      if (lstat(path, &st) < 0)
+        continue;
+      if (S_ISREG(st.st_mode)) {
+        string data, digest;
+        if (!readFile(path, &data) || !storeObject(data, &digest)) {
+          perror(path);
+          return;
+        }
+        snprintf(buf, sizeof(buf), " %o ", st.st_mode & 07777);
+        manifest += "O " + toHex(digest) + buf + path + "\n";
+      } else if (S_ISDIR(st.st_mode)) {
+        snprintf(buf, sizeof(buf), "D %o ", st.st_mode & 07777);
+        manifest += buf + string(path) + "\n";
+      } else if (S_ISLNK(st.st_mode)) {
+        char target[PATH_MAX + 1];
+        ssize_t size = readlink(path, target, PATH_MAX);
+        if (size < 0)
+          continue;
+        manifest += "L " + toHex(string(target, size)) + " " + path + "\n";
+      }
+    } else if (flags & REMOVED) {
+      if (lstat(path, &st) < 0)
+        manifest += "R " + string(path) + "\n";
+    } else if (flags & INPUT) {
+      string digest = hashPath(path, &st);
+      if (digest.empty())
+        continue;
+      snprintf(buf, sizeof(buf), " %llu %lld ",
+               static_cast<unsigned long long>(st.st_size),
+               st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec);
+      manifest += "I " + toHex(digest) + buf + path + "\n";
+    } else if (flags & EXISTS) {
+      manifest += "E " + string(path) + "\n";
+    } else if (flags & FAILED) {
+      manifest += "F " + string(path) + "\n";
+    }
+  }
+
+  Capture* captures[] = { &out_, &err_ };
+  for (int i = 0; i < 2; i++) {
+    string digest;
+    if (captures[i]->data.empty())
+      continue;
+    if (!storeObject(captures[i]->data, &digest))
+      return;
+    manifest += string(1, '1' + i) + " " + toHex(digest) + "\n";
+  }
+
+  string path = getManifestPath();
+  makeDirs(getDir(path));
+  if (!writeFileAtomically(path, manifest, 0644))
+    perror(path.c_str());
+}
+
+}  // namespace katd
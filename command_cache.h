@@ -0,0 +1,95 @@
+#ifndef KATD_COMMAND_CACHE_H_
+#define KATD_COMMAND_CACHE_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "handler.h"
+#include "path_table.h"
+
+namespace katd {
+
+// Memoizes a command by what it read. The key is a digest of argv, the
+// cwd and the environment. The entry for a key is a manifest of
+//
+//  - the files the command read and their digests,
+//  - the paths it failed to find, which must still not exist, since a
+//    new file there, e.g. a header earlier in the include path, could
+//    change the result,
+//  - the files it wrote, whose content is stored in the cache, and the
+//    files it removed,
+//  - its stdout and stderr.
+//
+// On a hit, the outputs are restored instead of running the command.
+// Only successful runs are stored, and not ones which changed or removed
+// a file they had read. A key has a single entry, which the latest run
+// replaces.
+//
+// As a Handler, this collects the inputs and outputs of the whole
+// process tree of a run.
+class CommandCache : public Handler {
+public:
+  CommandCache(const std::string& dir, char** argv);
+  virtual ~CommandCache();
+
+  virtual void handleEvent(const Event& event);
+
+  // Restores the outputs and replays stdout and stderr if the inputs
+  // in the manifest are unchanged. Returns false on a miss.
+  bool restore();
+
+  // Copies stdout and stderr of katd, and so of the command, to the
+  // terminal and to buffers until |finish|.
+  void startCapture();
+  // Stores the run if the command succeeded. Returns the exit code for
+  // katd.
+  int finish(int exit_status);
+
+private:
+  enum {
+    // Read before the command wrote it.
+    INPUT = 1,
+    // Written and not removed afterwards.
+    OUTPUT = 2,
+    // Removed and not written afterwards.
+    REMOVED = 4,
+    // Probed, but it did not exist.
+    FAILED = 8,
+    // Its metadata was read, so it existed.
+    EXISTS = 16,
+  };
+
+  struct Capture {
+    Capture();
+
+    int fd;
+    int saved_fd;
+    int pipe_fd;
+    std::string data;
+    std::thread reader;
+  };
+
+  static void copyOutput(Capture* capture);
+  void stopCapture(Capture* capture);
+  void store();
+
+  std::string getManifestPath() const;
+  std::string getObjectPath(const std::string& digest) const;
+  bool storeObject(const std::string& data, std::string* digest);
+  bool readObject(const std::string& digest, std::string* data) const;
+
+  std::string dir_;
+  std::string key_;
+  std::unordered_map<PathId, uint8_t> paths_;
+  Capture out_;
+  Capture err_;
+};
+
+}  // namespace katd
+
+#endif  // KATD_COMMAND_CACHE_H_
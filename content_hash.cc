@@ -0,0 +1,226 @@
+#include "content_hash.h"
+
+#include <string.h>
+
+#include "log.h"
+
+using namespace std;
+
+namespace katd {
+
+static const uint64_t kPrime1 = 0x9e3779b185ebca87ULL;
+static const uint64_t kPrime2 = 0xc2b2ae3d27d4eb4fULL;
+static const uint64_t kPrime3 = 0x165667b19e3779f9ULL;
+static const uint64_t kPrime4 = 0x85ebca77c2b2ae63ULL;
+static const uint64_t kPrime5 = 0x27d4eb2f165667c5ULL;
+
+static const uint32_t kSha256K[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+  0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+  0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+  0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+  0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+  0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+  0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+  0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+  0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static const uint32_t kSha256Init[8] = {
+  0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+  0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+const char* getHashAlgorithmName(HashAlgorithm algorithm) {
+  return algorithm == HASH_SHA256 ? "sha256" : "xxh64";
+}
+
+static size_t getBlockSize(HashAlgorithm algorithm) {
+  return algorithm == HASH_SHA256 ? 64 : 32;
+}
+
+static uint64_t rotl64(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+static uint32_t rotr32(uint32_t x, int r) {
+  return (x >> r) | (x << (32 - r));
+}
+
+static uint64_t read64(const uint8_t* p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static uint32_t read32(const uint8_t* p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static uint32_t readBigEndian32(const uint8_t* p) {
+  return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) |
+      (uint32_t(p[2]) << 8) | p[3];
+}
+
+static uint64_t xxh64Round(uint64_t acc, uint64_t input) {
+  acc += input * kPrime2;
+  acc = rotl64(acc, 31);
+  return acc * kPrime1;
+}
+
+static uint64_t xxh64Merge(uint64_t acc, uint64_t v) {
+  acc ^= xxh64Round(0, v);
+  return acc * kPrime1 + kPrime4;
+}
+
+ContentHash::ContentHash(HashAlgorithm algorithm)
+  : algorithm_(algorithm),
+    total_(0),
+    buf_size_(0) {
+  if (algorithm_ == HASH_SHA256) {
+    for (int i = 0; i < 8; i++)
+      state_[i] = kSha256Init[i];
+  } else {
+    state_[0] = kPrime1 + kPrime2;
+    state_[1] = kPrime2;
+    state_[2] = 0;
+    state_[3] = -kPrime1;
+  }
+}
+
+void ContentHash::update(const void* data, size_t size) {
+  const uint8_t* p = static_cast<const uint8_t*>(data);
+  size_t block_size = getBlockSize(algorithm_);
+  total_ += size;
+  if (buf_size_) {
+    size_t n = min(size, block_size - buf_size_);
+    memcpy(buf_ + buf_size_, p, n);
+    buf_size_ += n;
+    p += n;
+    size -= n;
+    if (buf_size_ < block_size)
+      return;
+    if (algorithm_ == HASH_SHA256)
+      processSha256(buf_);
+    else
+      processXxh64(buf_);
+    buf_size_ = 0;
+  }
+  for (; size >= block_size; p += block_size, size -= block_size) {
+    if (algorithm_ == HASH_SHA256)
+      processSha256(p);
+    else
+      processXxh64(p);
+  }
+  memcpy(buf_, p, size);
+  buf_size_ = size;
+}
+
+void ContentHash::processXxh64(const uint8_t* block) {
+  for (int i = 0; i < 4; i++)
+    state_[i] = xxh64Round(state_[i], read64(block + i * 8));
+}
+
+void ContentHash::processSha256(const uint8_t* block) {
+  uint32_t w[64];
+  for (int i = 0; i < 16; i++)
+    w[i] = readBigEndian32(block + i * 4);
+  for (int i = 16; i < 64; i++) {
+    uint32_t s0 = rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^
+        (w[i - 15] >> 3);
+    uint32_t s1 = rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19) ^
+        (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+
+  uint32_t v[8];
+  for (int i = 0; i < 8; i++)
+    v[i] = state_[i];
+  for (int i = 0; i < 64; i++) {
+    uint32_t s1 = rotr32(v[4], 6) ^ rotr32(v[4], 11) ^ rotr32(v[4], 25);
+    uint32_t ch = (v[4] & v[5]) ^ (~v[4] & v[6]);
+    uint32_t t1 = v[7] + s1 + ch + kSha256K[i] + w[i];
+    uint32_t s0 = rotr32(v[0], 2) ^ rotr32(v[0], 13) ^ rotr32(v[0], 22);
+    uint32_t maj = (v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]);
+    uint32_t t2 = s0 + maj;
+    v[7] = v[6];
+    v[6] = v[5];
+    v[5] = v[4];
+    v[4] = v[3] + t1;
+    v[3] = v[2];
+    v[2] = v[1];
+    v[1] = v[0];
+    v[0] = t1 + t2;
+  }
+  for (int i = 0; i < 8; i++)
+    state_[i] = static_cast<uint32_t>(state_[i] + v[i]);
+}
+
+string ContentHash::finish() {
+  string digest;
+  if (algorithm_ == HASH_SHA256) {
+    uint64_t bits = total_ * 8;
+    uint8_t pad[72] = { 0x80 };
+    size_t pad_size = (buf_size_ < 56 ? 56 : 120) - buf_size_;
+    for (int i = 0; i < 8; i++)
+      pad[pad_size + i] = bits >> (56 - i * 8);
+    update(pad, pad_size + 8);
+    CHECK(buf_size_ == 0);
+    for (int i = 0; i < 8; i++) {
+      for (int j = 24; j >= 0; j -= 8)
+        digest += static_cast<char>(state_[i] >> j);
+    }
+    return digest;
+  }
+
+  uint64_t h;
+  if (total_ >= 32) {
+    h = rotl64(state_[0], 1) + rotl64(state_[1], 7) +
+        rotl64(state_[2], 12) + rotl64(state_[3], 18);
+    for (int i = 0; i < 4; i++)
+      h = xxh64Merge(h, state_[i]);
+  } else {
+    h = kPrime5;
+  }
+  h += total_;
+  const uint8_t* p = buf_;
+  const uint8_t* end = buf_ + buf_size_;
+  for (; p + 8 <= end; p += 8) {
+    h ^= xxh64Round(0, read64(p));
+    h = rotl64(h, 27) * kPrime1 + kPrime4;
+  }
+  if (p + 4 <= end) {
+    h ^= read32(p) * kPrime1;
+    h = rotl64(h, 23) * kPrime2 + kPrime3;
+    p += 4;
+  }
+  for (; p < end; p++) {
+    h ^= *p * kPrime5;
+    h = rotl64(h, 11) * kPrime1;
+  }
+  h ^= h >> 33;
+  h *= kPrime2;
+  h ^= h >> 29;
+  h *= kPrime3;
+  h ^= h >> 32;
+  for (int i = 56; i >= 0; i -= 8)
+    digest += static_cast<char>(h >> i);
+  return digest;
+}
+
+string toHex(const string& digest) {
+  static const char kHex[] = "0123456789abcdef";
+  string hex;
+  for (size_t i = 0; i < digest.size(); i++) {
+    unsigned char c = digest[i];
+    hex += kHex[c >> 4];
+    hex += kHex[c & 15];
+  }
+  return hex;
+}
+
+}  // namespace katd
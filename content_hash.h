@@ -0,0 +1,46 @@
+#ifndef KATD_CONTENT_HASH_H_
+#define KATD_CONTENT_HASH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+
+namespace katd {
+
+enum HashAlgorithm {
+  // XXH64. Fast, but not collision resistant.
+  HASH_XXH64,
+  HASH_SHA256,
+};
+
+const char* getHashAlgorithmName(HashAlgorithm algorithm);
+
+// Computes a digest of data passed in any number of chunks.
+class ContentHash {
+public:
+  explicit ContentHash(HashAlgorithm algorithm);
+
+  void update(const void* data, size_t size);
+  // Returns the raw digest. The object must not be used afterwards.
+  std::string finish();
+
+private:
+  void processXxh64(const uint8_t* block);
+  void processSha256(const uint8_t* block);
+
+  HashAlgorithm algorithm_;
+  uint64_t total_;
+  // XXH64 uses the first four as accumulators, SHA-256 all eight.
+  uint64_t state_[8];
+  // A partial block. XXH64 takes 32 bytes at a time, SHA-256 64.
+  uint8_t buf_[64];
+  size_t buf_size_;
+};
+
+// Returns |digest| in lower case hex.
+std::string toHex(const std::string& digest);
+
+}  // namespace katd
+
+#endif  // KATD_CONTENT_HASH_H_
@@ -0,0 +1,265 @@
+#include "deps_handler.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "event.h"
+
+using namespace std;
+
+namespace katd {
+
+DepsHandler::DepsHandler(Format format)
+  : format_(format),
+    fp_(stdout),
+    wrote_ninja_rule_(false),
+    written_(0) {
+}
+
+void DepsHandler::handleEvent(const Event& event) {
+  bool inserted;
+  Process* proc = procs_.insert(event.pid, &inserted);
+  if (proc->has_exec_path) {
+    // No handleExec followed, as with fanotify, which does not see execs.
+    uint8_t* flags = &proc->paths[proc->exec_path];
+    if (!(*flags & OUTPUT))
+      *flags |= INPUT;
+    proc->has_exec_path = false;
+  }
+  if (event.type == READ_CONTENT && (event.syscall == SYSCALL_EXECVE ||
+                                     event.syscall == SYSCALL_EXECVEAT)) {
+    proc->has_exec_path = true;
+    proc->exec_path = event.path_id;
+    return;
+  }
+  uint8_t* flags = &proc->paths[event.path_id];
+  switch (event.type) {
+  case READ_CONTENT:
+    if (!(*flags & OUTPUT))
+      *flags |= INPUT;
+    break;
+  case WRITE_CONTENT:
+    *flags |= OUTPUT;
+    break;
+  case REMOVE_CONTENT:
+    // A temporary file, or an output of a previous run.
+    *flags &= ~OUTPUT;
+    break;
+  case READ_FAILURE:
+    *flags |= FAILED;
+    break;
+  default:
+    break;
+  }
+}
+
+void DepsHandler::handleExec(int pid, const vector<string>& args) {
+  bool inserted;
+  Process* proc = procs_.insert(pid, &inserted);
+  bool has_exec_path = proc->has_exec_path;
+  PathId exec_path = proc->exec_path;
+  proc->has_exec_path = false;
+  if (proc->has_args) {
+    write(pid, *proc);
+    *proc = Process();
+  }
+  proc->has_args = true;
+  proc->args = args;
+  if (has_exec_path)
+    proc->paths[exec_path] |= INPUT;
+}
+
+void DepsHandler::handleExit(int pid) {
+  Process* proc = procs_.find(pid);
+  if (!proc)
+    return;
+  write(pid, *proc);
+  procs_.erase(pid);
+}
+
+void DepsHandler::flush() {
+  vector<int> pids;
+  procs_.getPids(&pids);
+  sort(pids.begin(), pids.end());
+  for (size_t i = 0; i < pids.size(); i++)
+    write(pids[i], *procs_.find(pids[i]));
+  procs_.clear();
+  fflush(fp_);
+}
+
+static bool comparePaths(const char* a, const char* b) {
+  return strcmp(a, b) < 0;
+}
+
+void DepsHandler::write(int pid, const Process& proc) {
+  // Forked children which exit without exec and touch nothing.
+  if (!proc.has_args && proc.paths.empty() && !proc.has_exec_path)
+    return;
+
+  PathTable* paths = PathTable::global();
+  vector<const char*> inputs, outputs, failed;
+  for (unordered_map<PathId, uint8_t>::const_iterator it = proc.paths.begin();
+       it != proc.paths.end(); ++it) {
+    const char* path = paths->str(it->first);
+    // Files updated in place are only outputs, so make sees no cycle.
+    if (it->second & OUTPUT)
+      outputs.push_back(path);
+    else if (it->second & INPUT)
+      inputs.push_back(path);
+    else if (it->second & FAILED)
+      failed.push_back(path);
+  }
+  if (proc.has_exec_path && !proc.paths.count(proc.exec_path))
+    inputs.push_back(paths->str(proc.exec_path));
+  sort(inputs.begin(), inputs.end(), comparePaths);
+  sort(outputs.begin(), outputs.end(), comparePaths);
+  sort(failed.begin(), failed.end(), comparePaths);
+
+  switch (format_) {
+  case MAKE_FORMAT:
+    if (outputs.empty())
+      return;
+    writeMake(inputs, outputs);
+    break;
+  case NINJA_FORMAT:
+    if (outputs.empty())
+      return;
+    writeNinja(proc, inputs, outputs);
+    break;
+  case JSON_FORMAT:
+    writeJson(pid, proc, inputs, outputs, failed);
+    break;
+  }
+  written_++;
+}
+
+static void writeMakePath(FILE* fp, const char* path) {
+  for (const char* p = path; *p; p++) {
+    switch (*p) {
+    case ' ':
+    case '#':
+    case ':':
+      fputc('\\', fp);
+      break;
+    case '$':
+      fputc('$', fp);
+      break;
+    }
+    fputc(*p, fp);
+  }
+}
+
+void DepsHandler::writeMake(const vector<const char*>& inputs,
+                            const vector<const char*>& outputs) {
+  for (size_t i = 0; i < outputs.size(); i++) {
+    if (i)
+      fputc(' ', fp_);
+    writeMakePath(fp_, outputs[i]);
+  }
+  fputc(':', fp_);
+  for (size_t i = 0; i < inputs.size(); i++) {
+    fputs(" \\\n  ", fp_);
+    writeMakePath(fp_, inputs[i]);
+  }
+  fputc('\n', fp_);
+}
+
+static void writeNinjaPath(FILE* fp, const char* path) {
+  for (const char* p = path; *p; p++) {
+    if (*p == ' ' || *p == ':' || *p == '$')
+      fputc('$', fp);
+    fputc(*p, fp);
+  }
+}
+
+// Quotes |arg| for sh, then escapes '$' for ninja.
+static void writeShellArg(FILE* fp, const string& arg) {
+  if (!arg.empty() &&
+      arg.find_first_not_of("abcdefghijklmnopqrstuvwxyz"
+                            "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                            "0123456789_-+=./,:@%") == string::npos) {
+    fputs(arg.c_str(), fp);
+    return;
+  }
+  fputc('\'', fp);
+  for (size_t i = 0; i < arg.size(); i++) {
+    if (arg[i] == '\'')
+      fputs("'\\''", fp);
+    else if (arg[i] == '$')
+      fputs("$$", fp);
+    else
+      fputc(arg[i], fp);
+  }
+  fputc('\'', fp);
+}
+
+void DepsHandler::writeNinja(const Process& proc,
+                             const vector<const char*>& inputs,
+                             const vector<const char*>& outputs) {
+  if (!wrote_ninja_rule_) {
+    fputs("rule katd\n  command = $command\n\n", fp_);
+    wrote_ninja_rule_ = true;
+  }
+  fputs("build", fp_);
+  for (size_t i = 0; i < outputs.size(); i++) {
+    fputc(' ', fp_);
+    writeNinjaPath(fp_, outputs[i]);
+  }
+  fputs(": katd", fp_);
+  for (size_t i = 0; i < inputs.size(); i++) {
+    fputc(' ', fp_);
+    writeNinjaPath(fp_, inputs[i]);
+  }
+  fputs("\n  command =", fp_);
+  for (size_t i = 0; i < proc.args.size(); i++) {
+    fputc(' ', fp_);
+    writeShellArg(fp_, proc.args[i]);
+  }
+  fputs("\n\n", fp_);
+}
+
+static void writeJsonString(FILE* fp, const char* s, size_t size) {
+  fputc('"', fp);
+  for (size_t i = 0; i < size; i++) {
+    unsigned char c = s[i];
+    if (c == '"' || c == '\\')
+      fprintf(fp, "\\%c", c);
+    else if (c < 0x20)
+      fprintf(fp, "\\u%04x", c);
+    else
+      fputc(c, fp);
+  }
+  fputc('"', fp);
+}
+
+static void writeJsonPaths(FILE* fp, const char* name,
+                           const vector<const char*>& paths) {
+  fprintf(fp, ",\"%s\":[", name);
+  for (size_t i = 0; i < paths.size(); i++) {
+    if (i)
+      fputc(',', fp);
+    writeJsonString(fp, paths[i], strlen(paths[i]));
+  }
+  fputc(']', fp);
+}
+
+void DepsHandler::writeJson(int pid, const Process& proc,
+                            const vector<const char*>& inputs,
+                            const vector<const char*>& outputs,
+                            const vector<const char*>& failed) {
+  fprintf(fp_, "{\"pid\":%d,\"argv\":[", pid);
+  for (size_t i = 0; i < proc.args.size(); i++) {
+    if (i)
+      fputc(',', fp_);
+    writeJsonString(fp_, proc.args[i].data(), proc.args[i].size());
+  }
+  fputc(']', fp_);
+  writeJsonPaths(fp_, "inputs", inputs);
+  writeJsonPaths(fp_, "outputs", outputs);
+  writeJsonPaths(fp_, "failed", failed);
+  fputs("}\n", fp_);
+}
+
+}  // namespace katd
@@ -0,0 +1,89 @@
+#ifndef KATD_DEPS_HANDLER_H_
+#define KATD_DEPS_HANDLER_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "handler.h"
+#include "path_table.h"
+#include "pid_table.h"
+
+namespace katd {
+
+// Collects the files each program reads, writes and fails to find, and
+// writes them as a manifest when the program exits or execs another
+// one. Events of a forked child before its exec, e.g. redirections of a
+// shell, belong to the program it execs.
+class DepsHandler : public Handler {
+public:
+  enum Format {
+    // A Makefile rule like a .d file from gcc -MD. Programs which write
+    // nothing are skipped.
+    MAKE_FORMAT,
+    // A ninja build statement with the command line.
+    NINJA_FORMAT,
+    // A JSON object per line.
+    JSON_FORMAT,
+  };
+
+  explicit DepsHandler(Format format);
+
+  virtual void handleEvent(const Event& event);
+  virtual void handleExec(int pid, const std::vector<std::string>& args);
+  virtual void handleExit(int pid);
+  // Writes the programs which have not exited, e.g. ones which called
+  // _exit under LD_PRELOAD.
+  virtual void flush();
+
+  void set_output(FILE* fp) { fp_ = fp; }
+  // The number of manifests written.
+  size_t written() const { return written_; }
+
+private:
+  enum {
+    // Read before the program wrote it.
+    INPUT = 1,
+    // Written and not removed afterwards.
+    OUTPUT = 2,
+    // Probed, but it did not exist.
+    FAILED = 4,
+  };
+
+  struct Process {
+    bool has_args;
+    std::vector<std::string> args;
+    std::unordered_map<PathId, uint8_t> paths;
+    // The binary of a successful exec, which is an input of the program
+    // it starts rather than of this one. The tracers send its event just
+    // before handleExec.
+    bool has_exec_path;
+    PathId exec_path;
+
+    Process() : has_args(false), has_exec_path(false), exec_path(0) {}
+  };
+
+  void write(int pid, const Process& proc);
+  void writeMake(const std::vector<const char*>& inputs,
+                 const std::vector<const char*>& outputs);
+  void writeNinja(const Process& proc,
+                  const std::vector<const char*>& inputs,
+                  const std::vector<const char*>& outputs);
+  void writeJson(int pid, const Process& proc,
+                 const std::vector<const char*>& inputs,
+                 const std::vector<const char*>& outputs,
+                 const std::vector<const char*>& failed);
+
+  Format format_;
+  FILE* fp_;
+  PidTable<Process> procs_;
+  bool wrote_ninja_rule_;
+  size_t written_;
+};
+
+}  // namespace katd
+
+#endif  // KATD_DEPS_HANDLER_H_
@@ -13,6 +13,11 @@ using namespace std;
 
 namespace katd {
 
+DumpHandler::DumpHandler()
+  : show_pid_(false),
+    fp_(stderr) {
+}
+
 void DumpHandler::handleEvent(const Event& event) {
   ostringstream oss;
   if (show_pid_)
@@ -21,8 +26,8 @@ void DumpHandler::handleEvent(const Event& event) {
   oss << ' ';
   oss << getSyscallName(event.syscall);
   oss << ' ';
-  oss << event.path;
-  fprintf(stderr, "%s\n", oss.str().c_str());
+  oss << event.path();
+  fprintf(fp_, "%s\n", oss.str().c_str());
 }
 
 }  // namespace katd
@@ -1,18 +1,24 @@
 #ifndef KATD_DUMP_HANDLER_H_
 #define KATD_DUMP_HANDLER_H_
 
+#include <stdio.h>
+
 #include "handler.h"
 
 namespace katd {
 
 class DumpHandler : public Handler {
 public:
+  DumpHandler();
+
   virtual void handleEvent(const Event& event);
 
   void set_show_pid(bool s) { show_pid_ = s; }
+  void set_output(FILE* fp) { fp_ = fp; }
 
 private:
   bool show_pid_;
+  FILE* fp_;
 };
 
 }  // namespace katd
@@ -1,9 +1,10 @@
 #ifndef KATD_EVENT_H_
 #define KATD_EVENT_H_
 
-#include "syscalls.h"
+#include <stdint.h>
 
-#include <string>
+#include "path_table.h"
+#include "syscalls.h"
 
 namespace katd {
 
@@ -18,14 +19,63 @@ enum EventType {
   WRITE_FAILURE,
 };
 
+// Returns the type of a failed event whose successful type is |type|.
+inline EventType getFailureType(EventType type) {
+  switch (type) {
+  case READ_CONTENT:
+  case READ_METADATA:
+  case REMOVE_CONTENT:
+    return READ_FAILURE;
+  case WRITE_CONTENT:
+  case WRITE_METADATA:
+    return WRITE_FAILURE;
+  default:
+    return type;
+  }
+}
+
+// How Tracer decodes a syscall, from syscalls.tab. Argument indexes are
+// -1 if there is none.
+struct SyscallTraits {
+  int8_t path_arg;
+  // The fd |path_arg| is relative to. The cwd if -1.
+  int8_t at_fd_arg;
+  // The AT_ flags. With AT_EMPTY_PATH, an empty path names the fd.
+  int8_t flags_arg;
+  // The second path of rename and link, which is written.
+  int8_t path2_arg;
+  int8_t at_fd2_arg;
+  // The type of the event of a successful call.
+  EventType type;
+};
+
+const SyscallTraits& getSyscallTraits(Syscall s);
+
 struct Event {
-  std::string path;
+  // The path in PathTable::global().
+  const char* path() const { return PathTable::global()->str(path_id); }
+
+  PathId path_id;
   Syscall syscall;
   EventType type;
   int error;
   int pid;
 };
 
+// How a process ran, as Tracer saw it. Times are from getNanoTime.
+struct ProcessTimes {
+  // When the process was forked, or first traced.
+  uint64_t start_ns;
+  // When the tracer reaped it.
+  uint64_t exit_ns;
+  // From wait4, of the process and the children it waited for.
+  uint64_t user_ns;
+  uint64_t sys_ns;
+  int64_t max_rss_kb;
+  // The wait status.
+  int status;
+};
+
 }  // namespace katd
 
 #endif  // KATD_EVENT_H_
@@ -0,0 +1,217 @@
+#include "event_filter.h"
+
+#include <fnmatch.h>
+#include <strings.h>
+
+using namespace std;
+
+namespace katd {
+
+static const char* const kTypeNames[] = {
+  "read", "write", "remove", "read_metadata", "write_metadata",
+  "read_failure", "write_failure",
+};
+
+static uint8_t getTypeBit(EventType type) {
+  return 1 << type;
+}
+
+// Returns the types of the events Tracer and PreloadTracer report for
+// |syscall|, including failures. Most are the type in syscalls.tab and
+// its failure type. Keep the exceptions in sync with
+// Tracer::handleSyscall.
+static uint8_t getSyscallTypes(Syscall syscall) {
+  const SyscallTraits& traits = getSyscallTraits(syscall);
+  EventType type = traits.type;
+  // Reported by Tracer::handleExecve rather than by the table.
+  if (syscall == SYSCALL_EXECVE || syscall == SYSCALL_EXECVEAT)
+    type = READ_CONTENT;
+  if (type == INVALID_EVENT_TYPE)
+    return 0;
+  uint8_t types = getTypeBit(type) | getTypeBit(getFailureType(type));
+  // Open writes by its flags, and rename and link write their second
+  // path. RENAME_EXCHANGE writes the first one too.
+  if (syscall == SYSCALL_OPEN || syscall == SYSCALL_OPENAT ||
+      syscall == SYSCALL_OPENAT2 || traits.path2_arg >= 0) {
+    types |= getTypeBit(WRITE_CONTENT) | getTypeBit(WRITE_FAILURE);
+  }
+  return types;
+}
+
+static bool hasWildcard(const string& pattern) {
+  return pattern.find_first_of("*?[") != string::npos;
+}
+
+static vector<string> split(const string& s, char sep) {
+  vector<string> r;
+  size_t start = 0;
+  for (;;) {
+    size_t end = s.find(sep, start);
+    r.push_back(s.substr(start, end - start));
+    if (end == string::npos)
+      return r;
+    start = end + 1;
+  }
+}
+
+EventFilter::TrieNode::TrieNode()
+  : is_end(false) {
+}
+
+EventFilter::EventFilter()
+  : types_(0xff),
+    syscalls_(NUM_SYSCALLS, true),
+    has_paths_(false),
+    trie_(1) {
+  compile();
+}
+
+bool EventFilter::parse(const char* spec, string* err) {
+  vector<string> clauses = split(spec, ';');
+  for (size_t i = 0; i < clauses.size(); i++) {
+    const string& clause = clauses[i];
+    if (clause.empty())
+      continue;
+    size_t eq = clause.find('=');
+    if (eq == string::npos) {
+      *err = "no '=' in " + clause;
+      return false;
+    }
+    string key = clause.substr(0, eq);
+    vector<string> values = split(clause.substr(eq + 1), ',');
+    if (key == "type") {
+      if (!parseTypes(values, err))
+        return false;
+    } else if (key == "syscall") {
+      if (!parseSyscalls(values, err))
+        return false;
+    } else if (key == "path") {
+      for (size_t j = 0; j < values.size(); j++) {
+        if (values[j].empty()) {
+          *err = "empty path";
+          return false;
+        }
+        addPath(values[j]);
+      }
+    } else {
+      *err = "unknown key " + key;
+      return false;
+    }
+  }
+  compile();
+  return true;
+}
+
+bool EventFilter::parseTypes(const vector<string>& names, string* err) {
+  uint8_t types = 0;
+  for (size_t i = 0; i < names.size(); i++) {
+    size_t t = 0;
+    while (t < sizeof(kTypeNames) / sizeof(kTypeNames[0]) &&
+           names[i] != kTypeNames[t]) {
+      t++;
+    }
+    if (t == sizeof(kTypeNames) / sizeof(kTypeNames[0])) {
+      *err = "unknown type " + names[i];
+      return false;
+    }
+    types |= getTypeBit(static_cast<EventType>(t));
+  }
+  // Clauses narrow what passes.
+  types_ &= types;
+  return true;
+}
+
+bool EventFilter::parseSyscalls(const vector<string>& names, string* err) {
+  vector<bool> syscalls(NUM_SYSCALLS, false);
+  for (size_t i = 0; i < names.size(); i++) {
+    int s = 1;
+    while (s < NUM_SYSCALLS &&
+           strcasecmp(names[i].c_str(),
+                      getSyscallName(static_cast<Syscall>(s)))) {
+      s++;
+    }
+    if (s == NUM_SYSCALLS) {
+      *err = "unknown syscall " + names[i];
+      return false;
+    }
+    syscalls[s] = true;
+  }
+  for (int s = 0; s < NUM_SYSCALLS; s++)
+    syscalls_[s] = syscalls_[s] && syscalls[s];
+  return true;
+}
+
+void EventFilter::addPath(const string& pattern) {
+  has_paths_ = true;
+  if (hasWildcard(pattern)) {
+    globs_.push_back(pattern);
+    return;
+  }
+  // "/a/b/" is the same prefix as "/a/b", and "/" is the empty one,
+  // which matches every absolute path.
+  size_t size = pattern.size();
+  while (size && pattern[size - 1] == '/')
+    size--;
+  uint32_t node = 0;
+  for (size_t i = 0; i < size; i++) {
+    vector<pair<char, uint32_t> >* children = &trie_[node].children;
+    size_t j = 0;
+    while (j < children->size() && (*children)[j].first < pattern[i])
+      j++;
+    if (j == children->size() || (*children)[j].first != pattern[i]) {
+      children->insert(children->begin() + j,
+                       make_pair(pattern[i],
+                                 static_cast<uint32_t>(trie_.size())));
+      // |children| is invalidated by the push_back.
+      trie_.push_back(TrieNode());
+    }
+    node = trie_[node].children[j].second;
+  }
+  trie_[node].is_end = true;
+}
+
+void EventFilter::compile() {
+  for (int s = 0; s < NUM_SYSCALLS; s++) {
+    masks_[s] = syscalls_[s] ?
+        getSyscallTypes(static_cast<Syscall>(s)) & types_ : 0;
+  }
+  path_matches_.clear();
+}
+
+bool EventFilter::matchesPrefix(const char* path, size_t size) const {
+  uint32_t node = 0;
+  for (size_t i = 0;; i++) {
+    // A prefix matches only at a component boundary, so "/a" does not
+    // match "/ab".
+    if (trie_[node].is_end && (i == size || path[i] == '/'))
+      return true;
+    if (i == size)
+      return false;
+    const vector<pair<char, uint32_t> >& children = trie_[node].children;
+    size_t j = 0;
+    while (j < children.size() && children[j].first < path[i])
+      j++;
+    if (j == children.size() || children[j].first != path[i])
+      return false;
+    node = children[j].second;
+  }
+}
+
+bool EventFilter::matchesPath(PathId path_id) {
+  if (!has_paths_)
+    return true;
+  if (path_id >= path_matches_.size())
+    path_matches_.resize(path_id + 1);
+  uint8_t* memo = &path_matches_[path_id];
+  if (!*memo) {
+    const PathTable* paths = PathTable::global();
+    const char* path = paths->str(path_id);
+    bool matched = matchesPrefix(path, paths->size(path_id));
+    for (size_t i = 0; !matched && i < globs_.size(); i++)
+      matched = fnmatch(globs_[i].c_str(), path, 0) == 0;
+    *memo = matched ? 2 : 1;
+  }
+  return *memo == 2;
+}
+
+}  // namespace katd
@@ -0,0 +1,89 @@
+#ifndef KATD_EVENT_FILTER_H_
+#define KATD_EVENT_FILTER_H_
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "event.h"
+#include "path_table.h"
+#include "syscalls.h"
+
+namespace katd {
+
+// Selects events by type, syscall and path. A spec is clauses separated
+// by semicolons, each a key and a list separated by commas, e.g.
+//
+//   type=write,remove;syscall=open,openat;path=/src/gen,*.o
+//
+// Types are read, write, remove, read_metadata, write_metadata,
+// read_failure and write_failure. Syscalls are named as in the text
+// output, in either case. A path without wildcards is a prefix which
+// matches itself and everything under it. Otherwise it is a glob for
+// fnmatch(3), where "*" matches slashes too. An event passes if it
+// matches every key given. A key given twice narrows further for types
+// and syscalls, and adds patterns for paths.
+//
+// The tables are compiled up front, so Tracer can drop syscalls which
+// cannot pass from the seccomp filter and check the type of the rest
+// before it reads their paths. Path matches are memoized by PathId,
+// which makes a copy of this cheap to keep per tracer thread but not
+// safe to share between them.
+class EventFilter {
+public:
+  EventFilter();
+
+  // Adds the clauses of |spec|. Returns false with a message in |err| if
+  // it is malformed.
+  bool parse(const char* spec, std::string* err);
+
+  // Whether an event of |syscall| may pass.
+  bool mayMatch(Syscall syscall) const { return masks_[syscall] != 0; }
+  // Same, for a call which did or did not fail.
+  bool mayMatch(Syscall syscall, bool failed) const {
+    return masks_[syscall] & (failed ? kFailureMask : ~kFailureMask);
+  }
+  bool matchesType(Syscall syscall, EventType type) const {
+    return masks_[syscall] & (1 << type);
+  }
+  bool matchesPath(PathId path_id);
+  bool matches(const Event& event) {
+    return matchesType(event.syscall, event.type) &&
+        matchesPath(event.path_id);
+  }
+
+private:
+  static const int kFailureMask =
+      (1 << READ_FAILURE) | (1 << WRITE_FAILURE);
+
+  // A byte-wise trie of the prefixes. Children are sorted by byte.
+  struct TrieNode {
+    TrieNode();
+    std::vector<std::pair<char, uint32_t> > children;
+    // A prefix ends here.
+    bool is_end;
+  };
+
+  bool parseTypes(const std::vector<std::string>& names, std::string* err);
+  bool parseSyscalls(const std::vector<std::string>& names,
+                     std::string* err);
+  void addPath(const std::string& pattern);
+  void compile();
+  bool matchesPrefix(const char* path, size_t size) const;
+
+  uint8_t types_;
+  std::vector<bool> syscalls_;
+  bool has_paths_;
+  std::vector<TrieNode> trie_;
+  std::vector<std::string> globs_;
+
+  // Types of each syscall which may pass.
+  uint8_t masks_[NUM_SYSCALLS];
+  // By PathId: 0 if unknown, 1 if it does not match and 2 if it does.
+  std::vector<uint8_t> path_matches_;
+};
+
+}  // namespace katd
+
+#endif  // KATD_EVENT_FILTER_H_
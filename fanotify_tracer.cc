@@ -0,0 +1,319 @@
+#include "fanotify_tracer.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/fanotify.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "event_filter.h"
+#include "handler.h"
+#include "log.h"
+#include "path_table.h"
+
+using namespace std;
+
+namespace katd {
+
+// katd checks if the command exited at least this often.
+static const int kWaitTimeoutMs = 100;
+static const size_t kBufferSize = 64 * 1024;
+
+static const uint64_t kEventMask =
+    FAN_OPEN | FAN_OPEN_EXEC | FAN_ACCESS | FAN_MODIFY | FAN_CLOSE |
+    FAN_ATTRIB | FAN_CREATE | FAN_DELETE | FAN_MOVE | FAN_ONDIR;
+
+static void handleChild(int) {
+}
+
+// Returns the parent of |pid|, or -1 if it is gone.
+static int getParentPid(int pid) {
+  char buf[512];
+  snprintf(buf, sizeof(buf), "/proc/%d/stat", pid);
+  int fd = open(buf, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  ssize_t size = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (size <= 0)
+    return -1;
+  buf[size] = '\0';
+  // The command name may have spaces and parentheses, so look after the
+  // last parenthesis: "pid (comm) state ppid ...".
+  const char* p = strrchr(buf, ')');
+  int ppid;
+  if (!p || sscanf(p + 1, " %*c %d", &ppid) != 1)
+    return -1;
+  return ppid;
+}
+
+FanotifyTracer::FanotifyTracer(char** argv, const char* root)
+  : argv_(argv),
+    fanotify_fd_(-1),
+    mount_fd_(-1),
+    root_pid_(-1),
+    self_pid_(getpid()),
+    filter_(NULL),
+    overflowed_(false) {
+  char buf[PATH_MAX];
+  root_ = realpath(root, buf) ? buf : root;
+  if (root_.size() > 1 && root_[root_.size() - 1] == '/')
+    root_.resize(root_.size() - 1);
+}
+
+FanotifyTracer::~FanotifyTracer() {
+  if (fanotify_fd_ >= 0)
+    close(fanotify_fd_);
+  if (mount_fd_ >= 0)
+    close(mount_fd_);
+  delete filter_;
+}
+
+void FanotifyTracer::addHandler(Handler* handler) {
+  handlers_.push_back(handler);
+}
+
+void FanotifyTracer::set_filter(const EventFilter& filter) {
+  delete filter_;
+  filter_ = new EventFilter(filter);
+}
+
+bool FanotifyTracer::run() {
+  // Directory events, e.g. creates and moves, need file handles, which
+  // also spare us an fd per event.
+  fanotify_fd_ = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_NONBLOCK |
+                               FAN_UNLIMITED_QUEUE | FAN_REPORT_FID |
+                               FAN_REPORT_DFID_NAME,
+                               O_RDONLY | O_CLOEXEC | O_LARGEFILE);
+  if (fanotify_fd_ < 0)
+    return false;
+  mount_fd_ = open(root_.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (mount_fd_ < 0)
+    return false;
+  // Mount marks do not report directory events, so watch the whole
+  // filesystem and keep the events under the root.
+  if (fanotify_mark(fanotify_fd_, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+                    kEventMask, mount_fd_, NULL) < 0) {
+    return false;
+  }
+  // Orphans are reparented to katd instead of init, so their ancestry
+  // still leads to the command.
+  PCHECK(prctl(PR_SET_CHILD_SUBREAPER, 1, 0, 0, 0) == 0);
+  // Without SA_RESTART, SIGCHLD wakes up the poll.
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = &handleChild;
+  PCHECK(sigaction(SIGCHLD, &sa, NULL) == 0);
+
+  root_pid_ = fork();
+  PCHECK(root_pid_ >= 0);
+  if (root_pid_ == 0) {
+    execvp(argv_[0], argv_);
+    fprintf(stderr, "failed to start %s: %s\n", argv_[0], strerror(errno));
+    _exit(127);
+  }
+  bool inserted;
+  *in_tree_.insert(root_pid_, &inserted) = true;
+  pids_.push_back(root_pid_);
+  vector<string> args;
+  for (char** p = argv_; *p; p++)
+    args.push_back(*p);
+  for (size_t i = 0; i < handlers_.size(); i++)
+    handlers_[i]->handleExec(root_pid_, args);
+
+  vector<char> buf(kBufferSize);
+  bool exited = false;
+  for (;;) {
+    ssize_t size = read(fanotify_fd_, &buf[0], buf.size());
+    PCHECK(size >= 0 || errno == EAGAIN || errno == EINTR);
+    if (size > 0) {
+      const fanotify_event_metadata* meta =
+          reinterpret_cast<const fanotify_event_metadata*>(&buf[0]);
+      for (; FAN_EVENT_OK(meta, size); meta = FAN_EVENT_NEXT(meta, size))
+        handleRecord(reinterpret_cast<const char*>(meta), meta->event_len);
+      continue;
+    }
+    // The events of the command are queued before its syscalls return,
+    // so the queue has them all once it exited.
+    if (exited)
+      break;
+    // Descendants which outlive the command are not waited for, but
+    // reparented orphans are reaped.
+    int status;
+    int pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+      if (pid == root_pid_)
+        exited = true;
+    }
+    if (exited)
+      continue;
+    pollfd pfd = { fanotify_fd_, POLLIN, 0 };
+    poll(&pfd, 1, kWaitTimeoutMs);
+  }
+
+  if (overflowed_)
+    fprintf(stderr, "fanotify queue overflowed, events were lost\n");
+  for (size_t i = 0; i < pids_.size(); i++) {
+    for (size_t j = 0; j < handlers_.size(); j++)
+      handlers_[j]->handleExit(pids_[i]);
+  }
+  for (size_t i = 0; i < handlers_.size(); i++)
+    handlers_[i]->flush();
+  return true;
+}
+
+void FanotifyTracer::handleRecord(const char* record, size_t size) {
+  const fanotify_event_metadata* meta =
+      reinterpret_cast<const fanotify_event_metadata*>(record);
+  if (meta->vers != FANOTIFY_METADATA_VERSION)
+    return;
+  if (meta->mask & FAN_Q_OVERFLOW) {
+    overflowed_ = true;
+    return;
+  }
+  int pid = meta->pid;
+  if (!isInTree(pid))
+    return;
+
+  uint64_t mask = meta->mask;
+  bool is_dir = mask & FAN_ONDIR;
+  string path;
+  if (!getPath(record + meta->metadata_len, size - meta->metadata_len,
+               &path)) {
+    return;
+  }
+  // Directories the handles name may have moved.
+  if (is_dir && (mask & (FAN_MOVE | FAN_DELETE)))
+    dirs_.clear();
+  if (path.compare(0, root_.size(), root_) ||
+      (path.size() > root_.size() && path[root_.size()] != '/' &&
+       root_ != "/")) {
+    return;
+  }
+
+  PathId path_id = PathTable::global()->intern(path);
+  // One record may merge several events of the same process on the same
+  // file.
+  if (mask & FAN_OPEN_EXEC)
+    sendEvent(pid, SYSCALL_EXECVE, READ_CONTENT, path_id);
+  else if (!is_dir && (mask & (FAN_ACCESS | FAN_CLOSE_NOWRITE)))
+    sendEvent(pid, SYSCALL_OPEN, READ_CONTENT, path_id);
+  else if (is_dir && (mask & FAN_OPEN))
+    sendEvent(pid, SYSCALL_OPEN, READ_METADATA, path_id);
+  if (mask & FAN_CREATE)
+    sendEvent(pid, is_dir ? SYSCALL_MKDIR : SYSCALL_CREAT, WRITE_CONTENT,
+              path_id);
+  else if (mask & (FAN_MODIFY | FAN_CLOSE_WRITE))
+    sendEvent(pid, SYSCALL_OPEN, WRITE_CONTENT, path_id);
+  if (mask & FAN_ATTRIB)
+    sendEvent(pid, SYSCALL_CHMOD, WRITE_METADATA, path_id);
+  if (mask & FAN_MOVED_FROM)
+    sendEvent(pid, SYSCALL_RENAME, REMOVE_CONTENT, path_id);
+  if (mask & FAN_MOVED_TO)
+    sendEvent(pid, SYSCALL_RENAME, WRITE_CONTENT, path_id);
+  if (mask & FAN_DELETE)
+    sendEvent(pid, is_dir ? SYSCALL_RMDIR : SYSCALL_UNLINK, REMOVE_CONTENT,
+              path_id);
+}
+
+// Builds the path of an event from its info records. The record with
+// the directory and the name is preferred. Directories are looked up by
+// their handles, which is a syscall and a readlink for each new one.
+bool FanotifyTracer::getPath(const char* info, size_t size, string* path) {
+  const fanotify_event_info_fid* fid = NULL;
+  const char* name = NULL;
+  size_t offset = 0;
+  while (offset + sizeof(fanotify_event_info_header) <= size) {
+    const fanotify_event_info_header* hdr =
+        reinterpret_cast<const fanotify_event_info_header*>(info + offset);
+    if (!hdr->len)
+      break;
+    if (hdr->info_type == FAN_EVENT_INFO_TYPE_DFID_NAME) {
+      fid = reinterpret_cast<const fanotify_event_info_fid*>(hdr);
+      const file_handle* handle =
+          reinterpret_cast<const file_handle*>(fid->handle);
+      name = reinterpret_cast<const char*>(handle->f_handle) +
+          handle->handle_bytes;
+      break;
+    }
+    if (hdr->info_type == FAN_EVENT_INFO_TYPE_FID ||
+        hdr->info_type == FAN_EVENT_INFO_TYPE_DFID) {
+      fid = reinterpret_cast<const fanotify_event_info_fid*>(hdr);
+    }
+    offset += hdr->len;
+  }
+  if (!fid)
+    return false;
+
+  const file_handle* handle =
+      reinterpret_cast<const file_handle*>(fid->handle);
+  string key(reinterpret_cast<const char*>(handle),
+             sizeof(*handle) + handle->handle_bytes);
+  unordered_map<string, string>::iterator found = dirs_.find(key);
+  if (found == dirs_.end()) {
+    int fd = open_by_handle_at(mount_fd_, const_cast<file_handle*>(handle),
+                               O_PATH | O_CLOEXEC);
+    // Removed already.
+    if (fd < 0)
+      return false;
+    char link[64];
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+    char buf[PATH_MAX];
+    ssize_t len = readlink(link, buf, sizeof(buf));
+    close(fd);
+    if (len <= 0 || len == sizeof(buf))
+      return false;
+    found = dirs_.insert(make_pair(key, string(buf, len))).first;
+  }
+  *path = found->second;
+  if (name && *name && strcmp(name, ".")) {
+    if (*path != "/")
+      path->push_back('/');
+    *path += name;
+  }
+  return true;
+}
+
+bool FanotifyTracer::isInTree(int pid) {
+  if (pid == self_pid_ || pid <= 1)
+    return false;
+  bool* known = in_tree_.find(pid);
+  if (known)
+    return *known;
+  int ppid = getParentPid(pid);
+  bool in_tree = ppid < 0 || ppid == self_pid_ || isInTree(ppid);
+  bool inserted;
+  *in_tree_.insert(pid, &inserted) = in_tree;
+  if (!in_tree)
+    return false;
+  pids_.push_back(pid);
+  // Parents which exited are not known, and orphans are the children of
+  // katd.
+  if (ppid > 0 && ppid != self_pid_) {
+    for (size_t i = 0; i < handlers_.size(); i++)
+      handlers_[i]->handleFork(ppid, pid);
+  }
+  return true;
+}
+
+void FanotifyTracer::sendEvent(int pid, Syscall syscall, EventType type,
+                               PathId path_id) {
+  Event ev;
+  ev.pid = pid;
+  ev.syscall = syscall;
+  ev.type = type;
+  ev.error = 0;
+  ev.path_id = path_id;
+  if (filter_ && !filter_->matches(ev))
+    return;
+  for (size_t i = 0; i < handlers_.size(); i++)
+    handlers_[i]->handleEvent(ev);
+}
+
+}  // namespace katd
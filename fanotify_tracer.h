@@ -0,0 +1,74 @@
+#ifndef KATD_FANOTIFY_TRACER_H_
+#define KATD_FANOTIFY_TRACER_H_
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "event.h"
+#include "pid_table.h"
+
+namespace katd {
+
+class EventFilter;
+class Handler;
+
+// Runs a command at full speed and watches the filesystem which has a
+// root directory with fanotify, instead of tracing the command. Files
+// under the root which the command and its descendants open, read,
+// modify, create, delete or move are reported as events. Needs
+// CAP_SYS_ADMIN.
+//
+// fanotify does not tell syscalls, so each event has the nearest one,
+// e.g. SYSCALL_OPEN for reads and writes and SYSCALL_RENAME for moves.
+// Reads are reported when a file opened for reading is read or closed,
+// so files opened only for writing are not inputs. Metadata reads,
+// failures and files elsewhere are not seen.
+//
+// Events carry the pid of the process which caused them. A process
+// belongs to the command if its ancestry in /proc leads to the command,
+// and the answer is cached by pid. A process which exited before its
+// events were read is assumed to belong to the command, since the root
+// is usually a build tree nobody else writes to. Exits are reported
+// when the command exits.
+class FanotifyTracer {
+public:
+  FanotifyTracer(char** argv, const char* root);
+  ~FanotifyTracer();
+
+  void addHandler(Handler* handler);
+  // Reports only the events which pass |filter|.
+  void set_filter(const EventFilter& filter);
+  // Runs the command until it exits. Returns false with errno if the
+  // filesystem could not be watched.
+  bool run();
+
+private:
+  void handleRecord(const char* record, size_t size);
+  bool getPath(const char* info, size_t size, std::string* path);
+  bool isInTree(int pid);
+  void sendEvent(int pid, Syscall syscall, EventType type, PathId path_id);
+
+  char** argv_;
+  // Canonical, without a trailing slash.
+  std::string root_;
+  int fanotify_fd_;
+  // An fd on the watched filesystem for open_by_handle_at.
+  int mount_fd_;
+  int root_pid_;
+  int self_pid_;
+  std::vector<Handler*> handlers_;
+  EventFilter* filter_;
+  // Whether each pid seen belongs to the command.
+  PidTable<bool> in_tree_;
+  // Pids of the command which had events, to report their exits.
+  std::vector<int> pids_;
+  // Directory paths by file handle. Cleared when a directory moves or
+  // is removed.
+  std::unordered_map<std::string, std::string> dirs_;
+  bool overflowed_;
+};
+
+}  // namespace katd
+
+#endif  // KATD_FANOTIFY_TRACER_H_
@@ -1,49 +1,77 @@
 #!/usr/bin/env ruby
+#
+# Generates the syscall numbers of an architecture for tracee_linux.cc
+# from its unistd.h, e.g.
+#
+#   ./gen_syscall_map.rb /usr/include/x86_64-linux-gnu/asm/unistd_64.h \
+#       > syscalls_x86_64.tab
+#   ./gen_syscall_map.rb /usr/include/x86_64-linux-gnu/asm/unistd_32.h \
+#       > syscalls_i386.tab
+#   ./gen_syscall_map.rb /usr/include/asm-generic/unistd.h \
+#       > syscalls_aarch64.tab
+#
+# Syscalls of syscalls.tab the architecture does not have, e.g. open on
+# aarch64, are left out.
 
-def maybe_add(syscalls, nums, s)
-  if syscalls[s]
-    nums << [syscalls[s], s]
+unistd = ARGV[0] || '/usr/include/asm/unistd_64.h'
+
+# asm-generic/unistd.h defines some numbers by other macros, e.g.
+# __NR_newfstatat is __NR3264_fstatat. Its blocks for 32bit ABIs are
+# skipped, since we use it for aarch64.
+macros = {}
+skip_depth = 0
+File.readlines(unistd).each do |line|
+  if line =~ /^#if/
+    skip_depth += 1 if skip_depth > 0 || line =~ /__BITS_PER_LONG == 32/
+  elsif line =~ /^#endif/
+    skip_depth -= 1 if skip_depth > 0
+  elsif skip_depth == 0 && line =~ /^#define (__NR\w*_\w+)\s+(\S+)/
+    macros[$1] = $2
   end
 end
 
-unistd = '/usr/include/asm/unistd_64.h'
-#unistd = '/usr/include/asm/unistd_32.h'
+def resolve(macros, value)
+  while value && value !~ /^\d+$/
+    value = macros[value]
+  end
+  value && value.to_i
+end
 
 syscalls = {}
-File.readlines(unistd).each do |line|
-  if line =~ /#define __NR_(\S+) (\d+)/
-    syscalls[$1] = $2.to_i
+macros.each_key do |name|
+  if name =~ /^__NR_(\w+)$/
+    nr = resolve(macros, macros[name])
+    syscalls[$1] = nr if nr
   end
 end
 
-syscall_names = []
-File.readlines('syscalls.tab').each do |line|
+def maybe_add(syscalls, nums, s)
+  if syscalls[s] && !nums.any? { |n, _| n == syscalls[s] }
+    nums << [syscalls[s], s]
+  end
+end
+
+puts "// Generated by gen_syscall_map.rb from #{unistd.sub(/.*include\//, '')}."
+File.readlines(File.join(File.dirname(__FILE__), 'syscalls.tab')).each do |line|
   if line =~ /^DEFINE_SYSCALL\((\w+),/
     s = $1.downcase
     nums = []
     if s == 'fstatat'
       maybe_add(syscalls, nums, 'newfstatat')
     else
-      if !syscalls[s]
-        raise s
-      end
-      nums << [syscalls[s], s]
+      maybe_add(syscalls, nums, s)
     end
 
     maybe_add(syscalls, nums, "#{s}64")
     maybe_add(syscalls, nums, "#{s}32")
+    # 32bit architectures have these for times after 2038.
+    maybe_add(syscalls, nums, "#{s}_time64")
     if s == 'utime'
       maybe_add(syscalls, nums, "utimes")
     end
 
-    nums.each do |n, ss|
-      puts "case #{n}:  // #{ss}"
-      syscall_names << ss
+    nums.sort.each do |n, ss|
+      puts "DEFINE_SYSCALL_NUMBER(#{n}, #{s.upcase})  // #{ss}"
     end
-    puts "  return SYSCALL_#{s.upcase};"
   end
 end
-
-syscall_names.each do |n|
-  puts %Q(  "#{n}",)
-end
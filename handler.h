@@ -1,15 +1,35 @@
 #ifndef KATD_HANDLER_H_
 #define KATD_HANDLER_H_
 
+#include <string>
+#include <vector>
+
 namespace katd {
 
 struct Event;
+struct ProcessTimes;
 
 class Handler {
 public:
   virtual ~Handler() {}
 
   virtual void handleEvent(const Event& event) = 0;
+  // Called when |parent_pid| starts |pid| as a new process, before any
+  // event of |pid|. Not called for the processes katd starts or attaches
+  // to.
+  virtual void handleFork(int /*parent_pid*/, int /*pid*/) {}
+  // Called when |pid| starts running a new program with |args|, after
+  // the event for the execve, or when the tracer attaches to |pid|.
+  virtual void handleExec(int /*pid*/,
+                          const std::vector<std::string>& /*args*/) {}
+  // Called before handleExit of |pid|, if the tracer records the times
+  // of processes.
+  virtual void handleProcessTimes(int /*pid*/,
+                                  const ProcessTimes& /*times*/) {}
+  // Called when |pid| exits. The pid may be reused after this.
+  virtual void handleExit(int /*pid*/) {}
+  // Called when the tracer finishes.
+  virtual void flush() {}
 };
 
 }  // namespace katd
@@ -0,0 +1,315 @@
+#include "hash_handler.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "event.h"
+#include "log.h"
+
+using namespace std;
+
+namespace katd {
+
+static const size_t kReadChunkSize = 1 << 20;
+// Files modified this recently may change again within the same mtime
+// tick, so their digests are not memoized.
+static const int kRacySeconds = 2;
+
+HashHandler::HashHandler(HashAlgorithm algorithm, int num_threads)
+  : algorithm_(algorithm),
+    fp_(stdout),
+    next_seq_(0),
+    busy_(0),
+    done_(false),
+    hashed_(0),
+    memo_hits_(0) {
+  CHECK(num_threads > 0);
+  for (int i = 0; i < num_threads; i++)
+    workers_.push_back(thread(&HashHandler::run, this));
+}
+
+HashHandler::~HashHandler() {
+  {
+    lock_guard<mutex> lock(mu_);
+    done_ = true;
+    work_cond_.notify_all();
+  }
+  for (size_t i = 0; i < workers_.size(); i++)
+    workers_[i].join();
+}
+
+void HashHandler::set_memo_path(const string& path) {
+  memo_path_ = path;
+  loadMemo();
+}
+
+void HashHandler::handleEvent(const Event& event) {
+  switch (event.type) {
+  case READ_CONTENT:
+    if (queued_inputs_.insert(event.path_id).second)
+      enqueue(event.path_id);
+    break;
+  case WRITE_CONTENT:
+  case REMOVE_CONTENT: {
+    // The next read sees new content.
+    queued_inputs_.erase(event.path_id);
+    bool inserted;
+    vector<PathId>* outputs = outputs_.insert(event.pid, &inserted);
+    if (outputs->empty() || outputs->back() != event.path_id)
+      outputs->push_back(event.path_id);
+    break;
+  }
+  default:
+    break;
+  }
+}
+
+void HashHandler::handleExit(int pid) {
+  vector<PathId>* outputs = outputs_.find(pid);
+  if (!outputs)
+    return;
+  enqueueOutputs(outputs);
+  outputs_.erase(pid);
+}
+
+void HashHandler::enqueueOutputs(vector<PathId>* outputs) {
+  sort(outputs->begin(), outputs->end());
+  outputs->erase(unique(outputs->begin(), outputs->end()), outputs->end());
+  for (size_t i = 0; i < outputs->size(); i++)
+    enqueue((*outputs)[i]);
+}
+
+void HashHandler::enqueue(PathId path_id) {
+  Job job;
+  job.path_id = path_id;
+  job.seq = next_seq_++;
+  lock_guard<mutex> lock(mu_);
+  jobs_.push_back(job);
+  work_cond_.notify_one();
+}
+
+static bool comparePaths(const pair<const char*, const string*>& a,
+                         const pair<const char*, const string*>& b) {
+  return strcmp(a.first, b.first) < 0;
+}
+
+void HashHandler::flush() {
+  vector<int> pids;
+  outputs_.getPids(&pids);
+  for (size_t i = 0; i < pids.size(); i++)
+    enqueueOutputs(outputs_.find(pids[i]));
+  outputs_.clear();
+
+  unique_lock<mutex> lock(mu_);
+  while (!jobs_.empty() || busy_)
+    idle_cond_.wait(lock);
+
+  if (fp_) {
+    vector<pair<const char*, const string*> > digests;
+    PathTable* paths = PathTable::global();
+    for (unordered_map<PathId, Result>::const_iterator it = results_.begin();
+         it != results_.end(); ++it) {
+      if (!it->second.digest.empty()) {
+        digests.push_back(
+            make_pair(paths->str(it->first), &it->second.digest));
+      }
+    }
+    sort(digests.begin(), digests.end(), comparePaths);
+    for (size_t i = 0; i < digests.size(); i++) {
+      fprintf(fp_, "%s  %s\n",
+              toHex(*digests[i].second).c_str(), digests[i].first);
+    }
+    fflush(fp_);
+  }
+  lock.unlock();
+
+  if (!memo_path_.empty())
+    saveMemo();
+}
+
+bool HashHandler::getDigest(PathId path_id, string* digest) const {
+  unordered_map<PathId, Result>::const_iterator it = results_.find(path_id);
+  if (it == results_.end() || it->second.digest.empty())
+    return false;
+  *digest = it->second.digest;
+  return true;
+}
+
+void HashHandler::run() {
+  PathTable* paths = PathTable::global();
+  unique_lock<mutex> lock(mu_);
+  for (;;) {
+    while (jobs_.empty() && !done_)
+      work_cond_.wait(lock);
+    if (jobs_.empty())
+      return;
+    Job job = jobs_.front();
+    jobs_.pop_front();
+    busy_++;
+    lock.unlock();
+
+    string digest;
+    if (!hashFile(paths->str(job.path_id), &digest))
+      digest.clear();
+
+    lock.lock();
+    pair<unordered_map<PathId, Result>::iterator, bool> p =
+        results_.insert(make_pair(job.path_id, Result()));
+    Result* result = &p.first->second;
+    if (p.second || result->seq < job.seq) {
+      result->seq = job.seq;
+      result->digest.swap(digest);
+    }
+    busy_--;
+    if (jobs_.empty() && !busy_)
+      idle_cond_.notify_all();
+  }
+}
+
+HashHandler::FileKey HashHandler::getFileKey(const struct stat& st) {
+  FileKey key;
+  key.dev = st.st_dev;
+  key.ino = st.st_ino;
+  key.mtime_sec = st.st_mtim.tv_sec;
+  key.mtime_nsec = st.st_mtim.tv_nsec;
+  key.size = st.st_size;
+  return key;
+}
+
+bool HashHandler::findMemo(const FileKey& key, string* digest) {
+  lock_guard<mutex> lock(memo_mu_);
+  unordered_map<FileKey, string, FileKeyHash>::const_iterator it =
+      memo_.find(key);
+  if (it == memo_.end())
+    return false;
+  *digest = it->second;
+  return true;
+}
+
+bool HashHandler::hashFile(const char* path, string* digest) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC | O_NOCTTY | O_NONBLOCK);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+    close(fd);
+    return false;
+  }
+  FileKey key = getFileKey(st);
+  if (findMemo(key, digest)) {
+    close(fd);
+    memo_hits_++;
+    return true;
+  }
+
+  time_t start = time(NULL);
+  bool racy = st.st_mtim.tv_sec + kRacySeconds >= start;
+  ContentHash hash(algorithm_);
+  bool ok = true;
+  // Read rather than map the file, since a traced process may truncate
+  // it meanwhile, which raises SIGBUS on a mapping. Files in /proc
+  // report no size, so read until EOF.
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  static thread_local string buf;
+  buf.resize(kReadChunkSize);
+  for (off_t off = 0;;) {
+    ssize_t r = pread(fd, &buf[0], buf.size(), off);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r < 0)
+      ok = false;
+    if (r <= 0)
+      break;
+    hash.update(buf.data(), r);
+    off += r;
+  }
+
+  // Do not memoize a file which a process is still writing.
+  struct stat st2;
+  bool stable = !racy && fstat(fd, &st2) == 0 && getFileKey(st2) == key;
+  close(fd);
+  if (!ok)
+    return false;
+  *digest = hash.finish();
+  hashed_++;
+  if (stable) {
+    lock_guard<mutex> lock(memo_mu_);
+    memo_[key] = *digest;
+  }
+  return true;
+}
+
+// The memo is a text file. The first line names the hash algorithm,
+// and each following line is "dev ino mtime_sec mtime_nsec size hex".
+void HashHandler::loadMemo() {
+  FILE* fp = fopen(memo_path_.c_str(), "re");
+  if (!fp)
+    return;
+  char buf[256];
+  if (!fgets(buf, sizeof(buf), fp) ||
+      strcmp(buf, (string("katd-hash-memo ") +
+                   getHashAlgorithmName(algorithm_) + "\n").c_str())) {
+    fclose(fp);
+    return;
+  }
+  lock_guard<mutex> lock(memo_mu_);
+  while (fgets(buf, sizeof(buf), fp)) {
+    FileKey key;
+    unsigned long long dev, ino, size;
+    long long mtime_sec, mtime_nsec;
+    char hex[65];
+    if (sscanf(buf, "%llu %llu %lld %lld %llu %64s",
+               &dev, &ino, &mtime_sec, &mtime_nsec, &size, hex) != 6 ||
+        strlen(hex) % 2) {
+      continue;
+    }
+    key.dev = dev;
+    key.ino = ino;
+    key.mtime_sec = mtime_sec;
+    key.mtime_nsec = mtime_nsec;
+    key.size = size;
+    string digest;
+    for (size_t i = 0; hex[i]; i += 2) {
+      char byte[3] = { hex[i], hex[i + 1], 0 };
+      digest += static_cast<char>(strtoul(byte, NULL, 16));
+    }
+    memo_[key] = digest;
+  }
+  fclose(fp);
+}
+
+void HashHandler::saveMemo() {
+  string tmp = memo_path_ + ".tmp";
+  FILE* fp = fopen(tmp.c_str(), "we");
+  if (!fp) {
+    perror(tmp.c_str());
+    return;
+  }
+  fprintf(fp, "katd-hash-memo %s\n", getHashAlgorithmName(algorithm_));
+  lock_guard<mutex> lock(memo_mu_);
+  for (unordered_map<FileKey, string, FileKeyHash>::const_iterator it =
+           memo_.begin();
+       it != memo_.end(); ++it) {
+    const FileKey& key = it->first;
+    fprintf(fp, "%llu %llu %lld %lld %llu %s\n",
+            static_cast<unsigned long long>(key.dev),
+            static_cast<unsigned long long>(key.ino),
+            static_cast<long long>(key.mtime_sec),
+            static_cast<long long>(key.mtime_nsec),
+            static_cast<unsigned long long>(key.size),
+            toHex(it->second).c_str());
+  }
+  // Replace the old memo only with a complete one.
+  if (fclose(fp) != 0 || rename(tmp.c_str(), memo_path_.c_str()) != 0) {
+    perror(memo_path_.c_str());
+    unlink(tmp.c_str());
+  }
+}
+
+}  // namespace katd
@@ -0,0 +1,127 @@
+#ifndef KATD_HASH_HANDLER_H_
+#define KATD_HASH_HANDLER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "content_hash.h"
+#include "handler.h"
+#include "path_table.h"
+#include "pid_table.h"
+
+namespace katd {
+
+// Hashes the content of files the traced processes read and write on a
+// pool of worker threads. Inputs are hashed when they are read, and
+// outputs when the process which wrote them exits, so they are
+// complete. Digests are memoized by (dev, ino, mtime, size), and the
+// memo can be kept in a file across runs.
+class HashHandler : public Handler {
+public:
+  HashHandler(HashAlgorithm algorithm, int num_threads);
+  virtual ~HashHandler();
+
+  virtual void handleEvent(const Event& event);
+  virtual void handleExit(int pid);
+  // Hashes outputs of processes which have not exited, waits for the
+  // workers, then writes the digests and the memo.
+  virtual void flush();
+
+  // Writes "digest  path" lines like sha256sum on flush.
+  void set_output(FILE* fp) { fp_ = fp; }
+  // Loads the memo from |path| and saves it there on flush.
+  void set_memo_path(const std::string& path);
+
+  // Returns false if |path_id| was not hashed or is not a regular file.
+  // Only valid after flush.
+  bool getDigest(PathId path_id, std::string* digest) const;
+
+  size_t hashed() const { return hashed_; }
+  size_t memo_hits() const { return memo_hits_; }
+
+private:
+  struct FileKey {
+    bool operator==(const FileKey& o) const {
+      return dev == o.dev && ino == o.ino && mtime_sec == o.mtime_sec &&
+          mtime_nsec == o.mtime_nsec && size == o.size;
+    }
+
+    uint64_t dev;
+    uint64_t ino;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t size;
+  };
+
+  struct FileKeyHash {
+    size_t operator()(const FileKey& k) const {
+      return (k.ino * 0x9e3779b97f4a7c15ULL) ^ k.dev ^ k.mtime_nsec ^
+          (k.size << 17);
+    }
+  };
+
+  struct Job {
+    PathId path_id;
+    // Later jobs for a path win over earlier ones which finish late.
+    uint64_t seq;
+  };
+
+  struct Result {
+    uint64_t seq;
+    // Empty if the file was not a regular file.
+    std::string digest;
+  };
+
+  static FileKey getFileKey(const struct stat& st);
+
+  void enqueue(PathId path_id);
+  void enqueueOutputs(std::vector<PathId>* outputs);
+  void run();
+  bool hashFile(const char* path, std::string* digest);
+  bool findMemo(const FileKey& key, std::string* digest);
+  void loadMemo();
+  void saveMemo();
+
+  HashAlgorithm algorithm_;
+  FILE* fp_;
+  std::string memo_path_;
+
+  // Only used by the tracer thread.
+  // Inputs queued since they were last written.
+  std::unordered_set<PathId> queued_inputs_;
+  // Paths each live process wrote or removed.
+  PidTable<std::vector<PathId> > outputs_;
+  uint64_t next_seq_;
+
+  std::mutex mu_;
+  std::condition_variable work_cond_;
+  std::condition_variable idle_cond_;
+  std::deque<Job> jobs_;
+  size_t busy_;
+  bool done_;
+  std::unordered_map<PathId, Result> results_;
+  std::vector<std::thread> workers_;
+
+  std::mutex memo_mu_;
+  std::unordered_map<FileKey, std::string, FileKeyHash> memo_;
+
+  std::atomic<size_t> hashed_;
+  std::atomic<size_t> memo_hits_;
+};
+
+}  // namespace katd
+
+#endif  // KATD_HASH_HANDLER_H_
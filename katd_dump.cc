@@ -0,0 +1,37 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "binary_trace.h"
+#include "dump_handler.h"
+#include "event.h"
+
+int main(int argc, char* argv[]) {
+  const char* arg0 = argv[0];
+  bool show_pid = false;
+  if (argc >= 2 && !strcmp(argv[1], "-p")) {
+    show_pid = true;
+    argc--;
+    argv++;
+  }
+  if (argc != 2) {
+    fprintf(stderr, "Usage: %s [-p] trace\n", arg0);
+    return 1;
+  }
+
+  katd::BinaryTraceReader reader;
+  if (!reader.open(argv[1])) {
+    perror(argv[1]);
+    return 1;
+  }
+
+  katd::DumpHandler dump_handler;
+  dump_handler.set_show_pid(show_pid);
+  dump_handler.set_output(stdout);
+  katd::Event ev;
+  while (reader.next(&ev))
+    dump_handler.handleEvent(ev);
+  if (reader.truncated()) {
+    fprintf(stderr, "%s: truncated at offset %zu\n",
+            argv[1], reader.offset());
+  }
+}
@@ -0,0 +1,20 @@
+#include <stdio.h>
+
+#include <string>
+
+#include "trace_index.h"
+
+int main(int argc, char* argv[]) {
+  if (argc != 3) {
+    fprintf(stderr, "Usage: %s trace index\n"
+            "Writes the index of a trace written by katd -o for katd-query\n",
+            argv[0]);
+    return 1;
+  }
+
+  std::string err;
+  if (!katd::writeTraceIndex(argv[1], argv[2], &err)) {
+    fprintf(stderr, "%s: %s\n", argv[0], err.c_str());
+    return 1;
+  }
+}
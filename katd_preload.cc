@@ -0,0 +1,741 @@
+// libkatd_preload.so, which is loaded into traced programs by
+// PreloadTracer. It wraps the libc functions for the syscalls in
+// syscalls.tab and writes events to the ring created by katd.
+
+#include <alloca.h>
+#include <dirent.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <spawn.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <utime.h>
+
+#include "event.h"
+#include "preload_ring.h"
+#include "syscalls.h"
+
+using namespace katd;
+
+extern "C" {
+int __open_2(const char* path, int flags);
+int __open64_2(const char* path, int flags);
+int __openat_2(int dirfd, const char* path, int flags);
+int __openat64_2(int dirfd, const char* path, int flags);
+int __xstat(int ver, const char* path, struct stat* buf);
+int __lxstat(int ver, const char* path, struct stat* buf);
+int __fxstatat(int ver, int dirfd, const char* path, struct stat* buf,
+               int flags);
+int __xstat64(int ver, const char* path, struct stat64* buf);
+int __lxstat64(int ver, const char* path, struct stat64* buf);
+int __fxstatat64(int ver, int dirfd, const char* path, struct stat64* buf,
+                 int flags);
+}
+
+extern char** environ;
+
+// Looks up the libc function |name| once. A function-local static with
+// an initializer would need libstdc++ for its guard.
+template <typename F>
+static F getReal(F* cache, const char* name) {
+  F f = __atomic_load_n(cache, __ATOMIC_RELAXED);
+  if (!f) {
+    f = reinterpret_cast<F>(dlsym(RTLD_NEXT, name));
+    __atomic_store_n(cache, f, __ATOMIC_RELAXED);
+  }
+  return f;
+}
+
+// Declares |real|, the libc function we are wrapping.
+#define REAL(name)                                                     \
+  static __typeof__(&name) real_cache;                                 \
+  __typeof__(&name) real = getReal(&real_cache, #name)
+
+static PreloadRing g_ring_storage;
+// NULL unless katd is reading the ring.
+static PreloadRing* g_ring;
+// "LD_PRELOAD=..." and "KATD_PRELOAD_RING=...", to put back in the
+// environment of exec'd programs which dropped them.
+static char* g_preload_env;
+static char* g_ring_env;
+
+static int getErrno(int r) {
+  return r < 0 ? errno : 0;
+}
+
+// Writes the directory |path| is relative to, with a trailing slash, to
+// |dir| and returns its size.
+static size_t getBaseDir(int dirfd, char* dir) {
+  ssize_t size;
+  if (dirfd == AT_FDCWD) {
+    size = syscall(SYS_getcwd, dir, PATH_MAX);
+    // The kernel counts the NUL.
+    if (size > 0)
+      size--;
+  } else {
+    char proc[64];
+    snprintf(proc, sizeof(proc), "/proc/self/fd/%d", dirfd);
+    size = syscall(SYS_readlinkat, AT_FDCWD, proc, dir, PATH_MAX);
+  }
+  if (size <= 0 || dir[0] != '/') {
+    strcpy(dir, "<bad fd>/");
+    return strlen(dir);
+  }
+  dir[size++] = '/';
+  return size;
+}
+
+// Appends a record whose path is |dir| followed by |path|.
+static void sendRecord(PreloadRecordKind kind, Syscall syscall,
+                       EventType type, const char* dir, size_t dir_size,
+                       const char* path, size_t path_size, int error,
+                       int pid) {
+  PreloadRing* ring = g_ring;
+  PreloadRecord* record = ring->reserve(dir_size + path_size);
+  if (!record) {
+    // Dropped since the ring was full, or katd has gone.
+    if (!ring->hasReader())
+      g_ring = NULL;
+    return;
+  }
+  record->kind = kind;
+  record->type = type;
+  record->syscall = syscall;
+  record->pid = pid ? pid : record->owner;
+  record->error = error;
+  memcpy(record->path(), dir, dir_size);
+  memcpy(record->path() + dir_size, path, path_size);
+  ring->commit(record, dir_size + path_size);
+}
+
+static void sendRecord(PreloadRecordKind kind, Syscall syscall,
+                       EventType type, int dirfd, const char* path,
+                       int error, int pid) {
+  if (!g_ring || !path)
+    return;
+  int saved_errno = errno;
+  char dir[PATH_MAX + 1];
+  size_t dir_size = 0;
+  if (path[0] != '/')
+    dir_size = getBaseDir(dirfd, dir);
+  sendRecord(kind, syscall, type, dir, dir_size, path, strlen(path) + 1,
+             error, pid);
+  errno = saved_errno;
+}
+
+static void sendEvent(Syscall syscall, EventType type, int dirfd,
+                      const char* path, int error) {
+  sendRecord(PRELOAD_EVENT, syscall, type, dirfd, path, error, 0);
+}
+
+static void sendOpenEvent(Syscall syscall, int dirfd, const char* path,
+                          int flags, int error) {
+  switch (flags & O_ACCMODE) {
+  case O_WRONLY:
+    sendEvent(syscall, WRITE_CONTENT, dirfd, path, error);
+    break;
+  case O_RDWR:
+    sendEvent(syscall, READ_CONTENT, dirfd, path, error);
+    sendEvent(syscall, WRITE_CONTENT, dirfd, path, error);
+    break;
+  default:
+    sendEvent(syscall, READ_CONTENT, dirfd, path, error);
+  }
+}
+
+// Reads the arguments of this process, each terminated by a NUL.
+static char* readCommandLine(size_t* size) {
+  int fd = syscall(SYS_openat, AT_FDCWD, "/proc/self/cmdline",
+                   O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return NULL;
+  size_t capacity = 4096;
+  char* buf = static_cast<char*>(malloc(capacity));
+  *size = 0;
+  for (;;) {
+    if (*size == capacity) {
+      capacity *= 2;
+      buf = static_cast<char*>(realloc(buf, capacity));
+    }
+    ssize_t r = syscall(SYS_read, fd, buf + *size, capacity - *size);
+    if (r <= 0)
+      break;
+    *size += r;
+  }
+  syscall(SYS_close, fd);
+  return buf;
+}
+
+static void sendFork() {
+  sendRecord(PRELOAD_FORK, UNINTERESTING_SYSCALL, INVALID_EVENT_TYPE,
+             NULL, 0, "", 1, getppid(), 0);
+}
+
+__attribute__((constructor))
+static void initPreload() {
+  const char* ring_path = getenv(KATD_PRELOAD_RING_ENV);
+  const char* preload = getenv("LD_PRELOAD");
+  if (!ring_path || !preload)
+    return;
+  if (!g_ring_storage.open(ring_path) ||
+      asprintf(&g_ring_env, "%s=%s", KATD_PRELOAD_RING_ENV, ring_path) < 0 ||
+      asprintf(&g_preload_env, "LD_PRELOAD=%s", preload) < 0) {
+    return;
+  }
+  g_ring = &g_ring_storage;
+
+  sendFork();
+  pthread_atfork(NULL, NULL, &sendFork);
+  size_t size;
+  char* args = readCommandLine(&size);
+  if (args) {
+    sendRecord(PRELOAD_EXEC_DONE, SYSCALL_EXECVE, READ_CONTENT, NULL, 0,
+               args, size, size, 0);
+    free(args);
+  }
+}
+
+__attribute__((destructor))
+static void finishPreload() {
+  if (g_ring) {
+    sendRecord(PRELOAD_EXIT, UNINTERESTING_SYSCALL, INVALID_EVENT_TYPE,
+               NULL, 0, "", 1, 0, 0);
+  }
+}
+
+// O_TMPFILE includes O_DIRECTORY, which alone has no mode.
+static int getModeArg(int flags, va_list ap) {
+  if ((flags & O_CREAT) || (flags & O_TMPFILE) == O_TMPFILE)
+    return va_arg(ap, int);
+  return 0;
+}
+
+#define DEFINE_OPEN(name, syscall)                                     \
+  extern "C" int name(const char* path, int flags, ...) {              \
+    REAL(name);                                                        \
+    va_list ap;                                                        \
+    va_start(ap, flags);                                               \
+    int mode = getModeArg(flags, ap);                                  \
+    va_end(ap);                                                        \
+    int r = real(path, flags, mode);                                   \
+    sendOpenEvent(syscall, AT_FDCWD, path, flags, getErrno(r));        \
+    return r;                                                          \
+  }
+
+#define DEFINE_OPENAT(name, syscall)                                   \
+  extern "C" int name(int dirfd, const char* path, int flags, ...) {   \
+    REAL(name);                                                        \
+    va_list ap;                                                        \
+    va_start(ap, flags);                                               \
+    int mode = getModeArg(flags, ap);                                  \
+    va_end(ap);                                                        \
+    int r = real(dirfd, path, flags, mode);                            \
+    sendOpenEvent(syscall, dirfd, path, flags, getErrno(r));           \
+    return r;                                                          \
+  }
+
+DEFINE_OPEN(open, SYSCALL_OPEN)
+DEFINE_OPEN(open64, SYSCALL_OPEN)
+DEFINE_OPENAT(openat, SYSCALL_OPENAT)
+DEFINE_OPENAT(openat64, SYSCALL_OPENAT)
+
+#define DEFINE_OPEN_2(name)                                            \
+  extern "C" int name(const char* path, int flags) {                   \
+    REAL(name);                                                        \
+    int r = real(path, flags);                                         \
+    sendOpenEvent(SYSCALL_OPEN, AT_FDCWD, path, flags, getErrno(r));   \
+    return r;                                                          \
+  }
+
+#define DEFINE_OPENAT_2(name)                                          \
+  extern "C" int name(int dirfd, const char* path, int flags) {        \
+    REAL(name);                                                        \
+    int r = real(dirfd, path, flags);                                  \
+    sendOpenEvent(SYSCALL_OPENAT, dirfd, path, flags, getErrno(r));    \
+    return r;                                                          \
+  }
+
+DEFINE_OPEN_2(__open_2)
+DEFINE_OPEN_2(__open64_2)
+DEFINE_OPENAT_2(__openat_2)
+DEFINE_OPENAT_2(__openat64_2)
+
+#define DEFINE_CREAT(name)                                             \
+  extern "C" int name(const char* path, mode_t mode) {                 \
+    REAL(name);                                                        \
+    int r = real(path, mode);                                          \
+    sendEvent(SYSCALL_CREAT, WRITE_CONTENT, AT_FDCWD, path, getErrno(r)); \
+    return r;                                                          \
+  }
+
+DEFINE_CREAT(creat)
+DEFINE_CREAT(creat64)
+
+// libc opens files internally without calling the functions above.
+static int getFopenFlags(const char* mode) {
+  if (strchr(mode, '+'))
+    return O_RDWR;
+  return mode[0] == 'r' ? O_RDONLY : O_WRONLY;
+}
+
+#define DEFINE_FOPEN(name)                                             \
+  extern "C" FILE* name(const char* path, const char* mode) {          \
+    REAL(name);                                                        \
+    FILE* fp = real(path, mode);                                       \
+    sendOpenEvent(SYSCALL_OPEN, AT_FDCWD, path, getFopenFlags(mode),   \
+                  fp ? 0 : errno);                                     \
+    return fp;                                                         \
+  }
+
+#define DEFINE_FREOPEN(name)                                           \
+  extern "C" FILE* name(const char* path, const char* mode, FILE* stream) { \
+    REAL(name);                                                        \
+    FILE* fp = real(path, mode, stream);                               \
+    sendOpenEvent(SYSCALL_OPEN, AT_FDCWD, path, getFopenFlags(mode),   \
+                  fp ? 0 : errno);                                     \
+    return fp;                                                         \
+  }
+
+DEFINE_FOPEN(fopen)
+DEFINE_FOPEN(fopen64)
+DEFINE_FREOPEN(freopen)
+DEFINE_FREOPEN(freopen64)
+
+extern "C" DIR* opendir(const char* path) {
+  REAL(opendir);
+  DIR* dir = real(path);
+  sendEvent(SYSCALL_OPENAT, READ_CONTENT, AT_FDCWD, path, dir ? 0 : errno);
+  return dir;
+}
+
+// Functions which take a path and whatever else.
+#define DEFINE_PATH_FUNC(ret, name, syscall, type, params, args)       \
+  extern "C" ret name params {                                         \
+    REAL(name);                                                        \
+    ret r = real args;                                                 \
+    sendEvent(syscall, type, AT_FDCWD, path, getErrno(r));             \
+    return r;                                                          \
+  }
+
+#define DEFINE_PATHAT_FUNC(ret, name, syscall, type, params, args)     \
+  extern "C" ret name params {                                         \
+    REAL(name);                                                        \
+    ret r = real args;                                                 \
+    sendEvent(syscall, type, dirfd, path, getErrno(r));                \
+    return r;                                                          \
+  }
+
+DEFINE_PATH_FUNC(int, access, SYSCALL_ACCESS, READ_METADATA,
+                 (const char* path, int mode), (path, mode))
+DEFINE_PATHAT_FUNC(int, faccessat, SYSCALL_FACCESSAT, READ_METADATA,
+                   (int dirfd, const char* path, int mode, int flags),
+                   (dirfd, path, mode, flags))
+DEFINE_PATH_FUNC(int, acct, SYSCALL_ACCT, WRITE_METADATA,
+                 (const char* path), (path))
+DEFINE_PATH_FUNC(int, chdir, SYSCALL_CHDIR, READ_METADATA,
+                 (const char* path), (path))
+DEFINE_PATH_FUNC(int, chmod, SYSCALL_CHMOD, WRITE_METADATA,
+                 (const char* path, mode_t mode), (path, mode))
+DEFINE_PATHAT_FUNC(int, fchmodat, SYSCALL_FCHMODAT, WRITE_METADATA,
+                   (int dirfd, const char* path, mode_t mode, int flags),
+                   (dirfd, path, mode, flags))
+DEFINE_PATH_FUNC(int, chown, SYSCALL_CHOWN, WRITE_METADATA,
+                 (const char* path, uid_t uid, gid_t gid),
+                 (path, uid, gid))
+DEFINE_PATH_FUNC(int, lchown, SYSCALL_LCHOWN, WRITE_METADATA,
+                 (const char* path, uid_t uid, gid_t gid),
+                 (path, uid, gid))
+DEFINE_PATHAT_FUNC(int, fchownat, SYSCALL_FCHOWNAT, WRITE_METADATA,
+                   (int dirfd, const char* path, uid_t uid, gid_t gid,
+                    int flags),
+                   (dirfd, path, uid, gid, flags))
+DEFINE_PATH_FUNC(int, utime, SYSCALL_UTIME, WRITE_METADATA,
+                 (const char* path, const struct utimbuf* times),
+                 (path, times))
+DEFINE_PATH_FUNC(int, utimes, SYSCALL_UTIME, WRITE_METADATA,
+                 (const char* path, const struct timeval times[2]),
+                 (path, times))
+DEFINE_PATHAT_FUNC(int, futimesat, SYSCALL_FUTIMESAT, WRITE_METADATA,
+                   (int dirfd, const char* path,
+                    const struct timeval times[2]),
+                   (dirfd, path, times))
+// A NULL path is futimens, which sendEvent ignores.
+DEFINE_PATHAT_FUNC(int, utimensat, SYSCALL_UTIMENSAT, WRITE_METADATA,
+                   (int dirfd, const char* path,
+                    const struct timespec times[2], int flags),
+                   (dirfd, path, times, flags))
+DEFINE_PATH_FUNC(int, mkdir, SYSCALL_MKDIR, WRITE_CONTENT,
+                 (const char* path, mode_t mode), (path, mode))
+DEFINE_PATHAT_FUNC(int, mkdirat, SYSCALL_MKDIRAT, WRITE_CONTENT,
+                   (int dirfd, const char* path, mode_t mode),
+                   (dirfd, path, mode))
+DEFINE_PATH_FUNC(int, mknod, SYSCALL_MKNOD, WRITE_CONTENT,
+                 (const char* path, mode_t mode, dev_t dev),
+                 (path, mode, dev))
+DEFINE_PATHAT_FUNC(int, mknodat, SYSCALL_MKNODAT, WRITE_CONTENT,
+                   (int dirfd, const char* path, mode_t mode, dev_t dev),
+                   (dirfd, path, mode, dev))
+DEFINE_PATH_FUNC(ssize_t, readlink, SYSCALL_READLINK, READ_METADATA,
+                 (const char* path, char* buf, size_t size),
+                 (path, buf, size))
+DEFINE_PATHAT_FUNC(ssize_t, readlinkat, SYSCALL_READLINKAT, READ_METADATA,
+                   (int dirfd, const char* path, char* buf, size_t size),
+                   (dirfd, path, buf, size))
+DEFINE_PATH_FUNC(int, rmdir, SYSCALL_RMDIR, REMOVE_CONTENT,
+                 (const char* path), (path))
+DEFINE_PATH_FUNC(int, unlink, SYSCALL_UNLINK, REMOVE_CONTENT,
+                 (const char* path), (path))
+DEFINE_PATHAT_FUNC(int, unlinkat, SYSCALL_UNLINKAT, REMOVE_CONTENT,
+                   (int dirfd, const char* path, int flags),
+                   (dirfd, path, flags))
+DEFINE_PATH_FUNC(int, statfs, SYSCALL_STATFS, READ_METADATA,
+                 (const char* path, struct statfs* buf), (path, buf))
+DEFINE_PATH_FUNC(int, statfs64, SYSCALL_STATFS, READ_METADATA,
+                 (const char* path, struct statfs64* buf), (path, buf))
+DEFINE_PATH_FUNC(int, truncate, SYSCALL_TRUNCATE, WRITE_CONTENT,
+                 (const char* path, off_t size), (path, size))
+DEFINE_PATH_FUNC(int, truncate64, SYSCALL_TRUNCATE, WRITE_CONTENT,
+                 (const char* path, off64_t size), (path, size))
+
+DEFINE_PATH_FUNC(int, stat, SYSCALL_STAT, READ_METADATA,
+                 (const char* path, struct stat* buf), (path, buf))
+DEFINE_PATH_FUNC(int, stat64, SYSCALL_STAT, READ_METADATA,
+                 (const char* path, struct stat64* buf), (path, buf))
+DEFINE_PATH_FUNC(int, lstat, SYSCALL_LSTAT, READ_METADATA,
+                 (const char* path, struct stat* buf), (path, buf))
+DEFINE_PATH_FUNC(int, lstat64, SYSCALL_LSTAT, READ_METADATA,
+                 (const char* path, struct stat64* buf), (path, buf))
+// Programs built with glibc before 2.33 call these instead.
+DEFINE_PATH_FUNC(int, __xstat, SYSCALL_STAT, READ_METADATA,
+                 (int ver, const char* path, struct stat* buf),
+                 (ver, path, buf))
+DEFINE_PATH_FUNC(int, __xstat64, SYSCALL_STAT, READ_METADATA,
+                 (int ver, const char* path, struct stat64* buf),
+                 (ver, path, buf))
+DEFINE_PATH_FUNC(int, __lxstat, SYSCALL_LSTAT, READ_METADATA,
+                 (int ver, const char* path, struct stat* buf),
+                 (ver, path, buf))
+DEFINE_PATH_FUNC(int, __lxstat64, SYSCALL_LSTAT, READ_METADATA,
+                 (int ver, const char* path, struct stat64* buf),
+                 (ver, path, buf))
+
+// Whether |path| names the fd itself, i.e., is empty, or NULL, which
+// Linux 6.11 accepts with AT_EMPTY_PATH. libc declares the paths of the
+// wrappers nonnull, and the compiler drops a plain NULL check of them,
+// so the empty asm hides where |path| comes from.
+static bool isEmptyPath(const char* path) {
+  asm("" : "+r"(path));
+  return !path || !*path;
+}
+
+// An empty path with AT_EMPTY_PATH is fstat.
+#define DEFINE_FSTATAT(name, params, args)                             \
+  extern "C" int name params {                                         \
+    REAL(name);                                                        \
+    int r = real args;                                                 \
+    if (!isEmptyPath(path)) {                                          \
+      sendEvent(SYSCALL_FSTATAT, READ_METADATA, dirfd, path,           \
+                getErrno(r));                                          \
+    }                                                                  \
+    return r;                                                          \
+  }
+
+DEFINE_FSTATAT(fstatat,
+               (int dirfd, const char* path, struct stat* buf, int flags),
+               (dirfd, path, buf, flags))
+DEFINE_FSTATAT(fstatat64,
+               (int dirfd, const char* path, struct stat64* buf, int flags),
+               (dirfd, path, buf, flags))
+DEFINE_FSTATAT(__fxstatat,
+               (int ver, int dirfd, const char* path, struct stat* buf,
+                int flags),
+               (ver, dirfd, path, buf, flags))
+DEFINE_FSTATAT(__fxstatat64,
+               (int ver, int dirfd, const char* path, struct stat64* buf,
+                int flags),
+               (ver, dirfd, path, buf, flags))
+
+extern "C" int statx(int dirfd, const char* path, int flags,
+                     unsigned mask, struct statx* buf) {
+  REAL(statx);
+  int r = real(dirfd, path, flags, mask, buf);
+  if (!isEmptyPath(path))
+    sendEvent(SYSCALL_STATX, READ_METADATA, dirfd, path, getErrno(r));
+  return r;
+}
+
+extern "C" int symlink(const char* target, const char* path) {
+  REAL(symlink);
+  int r = real(target, path);
+  sendEvent(SYSCALL_SYMLINK, WRITE_CONTENT, AT_FDCWD, path, getErrno(r));
+  return r;
+}
+
+extern "C" int symlinkat(const char* target, int dirfd, const char* path) {
+  REAL(symlinkat);
+  int r = real(target, dirfd, path);
+  sendEvent(SYSCALL_SYMLINKAT, WRITE_CONTENT, dirfd, path, getErrno(r));
+  return r;
+}
+
+// Sends events for rename and link, which read or remove |old_path| and
+// write |new_path|.
+static void sendTwoPathEvents(Syscall syscall, EventType old_type,
+                              int old_dirfd, const char* old_path,
+                              int new_dirfd, const char* new_path,
+                              int error) {
+  sendEvent(syscall, old_type, old_dirfd, old_path, error);
+  sendEvent(syscall, WRITE_CONTENT, new_dirfd, new_path, error);
+}
+
+extern "C" int rename(const char* old_path, const char* new_path) {
+  REAL(rename);
+  int r = real(old_path, new_path);
+  sendTwoPathEvents(SYSCALL_RENAME, REMOVE_CONTENT, AT_FDCWD, old_path,
+                    AT_FDCWD, new_path, getErrno(r));
+  return r;
+}
+
+extern "C" int renameat(int old_dirfd, const char* old_path,
+                        int new_dirfd, const char* new_path) {
+  REAL(renameat);
+  int r = real(old_dirfd, old_path, new_dirfd, new_path);
+  sendTwoPathEvents(SYSCALL_RENAMEAT, REMOVE_CONTENT, old_dirfd, old_path,
+                    new_dirfd, new_path, getErrno(r));
+  return r;
+}
+
+// mv uses this. RENAME_EXCHANGE swaps the files, so both are written.
+extern "C" int renameat2(int old_dirfd, const char* old_path,
+                         int new_dirfd, const char* new_path,
+                         unsigned flags) {
+  REAL(renameat2);
+  int r = real(old_dirfd, old_path, new_dirfd, new_path, flags);
+  sendTwoPathEvents(SYSCALL_RENAMEAT2,
+                    flags & RENAME_EXCHANGE ? WRITE_CONTENT : REMOVE_CONTENT,
+                    old_dirfd, old_path, new_dirfd, new_path, getErrno(r));
+  return r;
+}
+
+extern "C" int link(const char* old_path, const char* new_path) {
+  REAL(link);
+  int r = real(old_path, new_path);
+  sendTwoPathEvents(SYSCALL_LINK, READ_METADATA, AT_FDCWD, old_path,
+                    AT_FDCWD, new_path, getErrno(r));
+  return r;
+}
+
+extern "C" int linkat(int old_dirfd, const char* old_path,
+                      int new_dirfd, const char* new_path, int flags) {
+  REAL(linkat);
+  int r = real(old_dirfd, old_path, new_dirfd, new_path, flags);
+  sendTwoPathEvents(SYSCALL_LINKAT, READ_METADATA, old_dirfd, old_path,
+                    new_dirfd, new_path, getErrno(r));
+  return r;
+}
+
+// Returns |envp| with LD_PRELOAD and KATD_PRELOAD_RING added if they are
+// missing, in |buf| which has room for two more entries.
+static char* const* getTracedEnv(char* const* envp, char** buf) {
+  if (!g_ring)
+    return envp;
+  bool has_preload = false;
+  bool has_ring = false;
+  size_t n = 0;
+  for (; envp[n]; n++) {
+    has_preload |= !strncmp(envp[n], "LD_PRELOAD=", 11);
+    has_ring |= !strncmp(envp[n], KATD_PRELOAD_RING_ENV "=",
+                         strlen(KATD_PRELOAD_RING_ENV "="));
+  }
+  if (has_preload && has_ring)
+    return envp;
+  memcpy(buf, envp, n * sizeof(*envp));
+  if (!has_preload)
+    buf[n++] = g_preload_env;
+  if (!has_ring)
+    buf[n++] = g_ring_env;
+  buf[n] = NULL;
+  return buf;
+}
+
+static size_t getEnvSize(char* const* envp) {
+  size_t n = 0;
+  while (envp[n])
+    n++;
+  return n;
+}
+
+// A successful exec is sent by initPreload of the new program as
+// PRELOAD_EXEC_DONE. Static programs do not send it.
+extern "C" int execve(const char* path, char* const argv[],
+                      char* const envp[]) {
+  REAL(execve);
+  char** env_buf =
+      static_cast<char**>(alloca((getEnvSize(envp) + 3) * sizeof(char*)));
+  sendRecord(PRELOAD_EXEC, SYSCALL_EXECVE, READ_CONTENT, AT_FDCWD, path,
+             0, 0);
+  int r = real(path, argv, getTracedEnv(envp, env_buf));
+  sendEvent(SYSCALL_EXECVE, READ_CONTENT, AT_FDCWD, path, errno);
+  return r;
+}
+
+extern "C" int execv(const char* path, char* const argv[]) {
+  return execve(path, argv, environ);
+}
+
+// Searches PATH like glibc, so each candidate is sent as an execve.
+extern "C" int execvpe(const char* file, char* const argv[],
+                       char* const envp[]) {
+  REAL(execvpe);
+  if (!*file) {
+    errno = ENOENT;
+    return -1;
+  }
+  if (strchr(file, '/'))
+    return execve(file, argv, envp);
+
+  const char* dirs = getenv("PATH");
+  if (!dirs)
+    dirs = "/bin:/usr/bin";
+  size_t file_size = strlen(file) + 1;
+  char* buf = static_cast<char*>(alloca(strlen(dirs) + file_size + 2));
+  bool got_eacces = false;
+  for (const char* p = dirs;; p++) {
+    const char* end = strchrnul(p, ':');
+    // An empty entry is the current directory.
+    size_t size = end - p;
+    memcpy(buf, p, size);
+    if (size)
+      buf[size++] = '/';
+    memcpy(buf + size, file, file_size);
+
+    execve(buf, argv, envp);
+    switch (errno) {
+    case EACCES:
+      got_eacces = true;
+      break;
+    case ENOENT:
+    case ENOTDIR:
+    case ENODEV:
+    case ESTALE:
+    case ETIMEDOUT:
+      break;
+    case ENOEXEC:
+      // libc runs it with /bin/sh.
+      return real(file, argv, envp);
+    default:
+      return -1;
+    }
+    if (!*end)
+      break;
+    p = end;
+  }
+  if (got_eacces)
+    errno = EACCES;
+  return -1;
+}
+
+extern "C" int execvp(const char* file, char* const argv[]) {
+  return execvpe(file, argv, environ);
+}
+
+// Collects the arguments of execl and friends to |argv|.
+#define COLLECT_ARGS(arg0, last, argv)                                 \
+  va_list ap;                                                          \
+  size_t argc = 1;                                                     \
+  va_start(ap, last);                                                  \
+  while (va_arg(ap, char*))                                            \
+    argc++;                                                            \
+  va_end(ap);                                                          \
+  char** argv = static_cast<char**>(alloca((argc + 1) * sizeof(char*))); \
+  argv[0] = const_cast<char*>(arg0);                                   \
+  va_start(ap, last);                                                  \
+  for (size_t i = 1; i <= argc; i++)                                   \
+    argv[i] = va_arg(ap, char*);
+
+extern "C" int execl(const char* path, const char* arg, ...) {
+  COLLECT_ARGS(arg, arg, argv);
+  va_end(ap);
+  return execve(path, argv, environ);
+}
+
+extern "C" int execlp(const char* file, const char* arg, ...) {
+  COLLECT_ARGS(arg, arg, argv);
+  va_end(ap);
+  return execvpe(file, argv, environ);
+}
+
+extern "C" int execle(const char* path, const char* arg, ...) {
+  COLLECT_ARGS(arg, arg, argv);
+  char* const* envp = va_arg(ap, char* const*);
+  va_end(ap);
+  return execve(path, argv, envp);
+}
+
+extern "C" int posix_spawn(pid_t* pid, const char* path,
+                           const posix_spawn_file_actions_t* actions,
+                           const posix_spawnattr_t* attr,
+                           char* const argv[], char* const envp[]) {
+  REAL(posix_spawn);
+  char** env_buf =
+      static_cast<char**>(alloca((getEnvSize(envp) + 3) * sizeof(char*)));
+  pid_t child;
+  int r = real(&child, path, actions, attr, argv,
+               getTracedEnv(envp, env_buf));
+  sendRecord(PRELOAD_EVENT, SYSCALL_EXECVE, READ_CONTENT, AT_FDCWD, path, r,
+             r ? 0 : child);
+  if (!r && pid)
+    *pid = child;
+  return r;
+}
+
+extern "C" int posix_spawnp(pid_t* pid, const char* file,
+                            const posix_spawn_file_actions_t* actions,
+                            const posix_spawnattr_t* attr,
+                            char* const argv[], char* const envp[]) {
+  REAL(posix_spawnp);
+  char** env_buf =
+      static_cast<char**>(alloca((getEnvSize(envp) + 3) * sizeof(char*)));
+  pid_t child;
+  int r = real(&child, file, actions, attr, argv,
+               getTracedEnv(envp, env_buf));
+
+  // Find the program libc ran.
+  const char* path = file;
+  char* buf = NULL;
+  const char* dirs = getenv("PATH");
+  if (!strchr(file, '/') && dirs) {
+    buf = static_cast<char*>(malloc(strlen(dirs) + strlen(file) + 2));
+    for (const char* p = dirs;; p++) {
+      const char* end = strchrnul(p, ':');
+      size_t size = end - p;
+      memcpy(buf, p, size);
+      if (size)
+        buf[size++] = '/';
+      strcpy(buf + size, file);
+      if (syscall(SYS_faccessat, AT_FDCWD, buf, X_OK) == 0) {
+        path = buf;
+        break;
+      }
+      if (!*end)
+        break;
+      p = end;
+    }
+  }
+  sendRecord(PRELOAD_EVENT, SYSCALL_EXECVE, READ_CONTENT, AT_FDCWD, path, r,
+             r ? 0 : child);
+  free(buf);
+  if (!r && pid)
+    *pid = child;
+  return r;
+}
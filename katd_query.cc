@@ -0,0 +1,195 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "dump_handler.h"
+#include "event.h"
+#include "event_filter.h"
+#include "trace_index.h"
+
+using namespace std;
+
+static void usage(const char* arg0) {
+  fprintf(stderr,
+          "Usage: %s [-p] [--filter spec] index path path ...\n"
+          "       %s [-p] [--filter spec] index prefix dir\n"
+          "       %s [-p] [--filter spec] index pid pid\n"
+          "       %s [-p] [--filter spec] index all\n"
+          "       %s index tree [pid]\n"
+          "Prints the events of an index written by katd-index in the\n"
+          "order of the trace\n"
+          " path: the events of the paths\n"
+          " prefix: the events of the directory and everything under it\n"
+          " pid: the events of the processes of the pid\n"
+          " all: every event, e.g. with --filter type=write\n"
+          " tree: the processes under each process of the pid, or all\n"
+          "     processes, with their arguments and numbers of events\n"
+          " -p: show pids\n"
+          " --filter: print only the events which match the spec, as\n"
+          "     for katd\n",
+          arg0, arg0, arg0, arg0, arg0);
+}
+
+// Prints the events of the query in the order of the trace.
+class EventPrinter {
+public:
+  EventPrinter(const katd::TraceIndex& index, katd::EventFilter* filter,
+               bool show_pid)
+    : index_(index),
+      filter_(filter) {
+    dump_.set_show_pid(show_pid);
+    dump_.set_output(stdout);
+  }
+
+  void addPath(uint32_t p) {
+    size_t size;
+    const uint32_t* events = index_.pathEvents(p, &size);
+    events_.insert(events_.end(), events, events + size);
+  }
+
+  void addProcess(uint32_t pr) {
+    size_t size;
+    const uint32_t* events = index_.processEvents(pr, &size);
+    events_.insert(events_.end(), events, events + size);
+  }
+
+  void print() {
+    sort(events_.begin(), events_.end());
+    events_.erase(unique(events_.begin(), events_.end()), events_.end());
+    for (size_t i = 0; i < events_.size(); i++)
+      printEvent(events_[i]);
+  }
+
+  void printEvent(uint32_t e) {
+    // Check the columns before the path is interned.
+    if (filter_ &&
+        !filter_->matchesType(index_.eventSyscall(e), index_.eventType(e))) {
+      return;
+    }
+    katd::Event ev;
+    index_.getEvent(e, &ev);
+    if (!filter_ || filter_->matches(ev))
+      dump_.handleEvent(ev);
+  }
+
+private:
+  const katd::TraceIndex& index_;
+  katd::EventFilter* filter_;
+  katd::DumpHandler dump_;
+  vector<uint32_t> events_;
+};
+
+// Prints |root| and the processes under it, indented by depth.
+static void printTree(const katd::TraceIndex& index, uint32_t root) {
+  vector<pair<uint32_t, int> > stack;
+  stack.push_back(make_pair(root, 0));
+  vector<string> args;
+  while (!stack.empty()) {
+    uint32_t pr = stack.back().first;
+    int depth = stack.back().second;
+    stack.pop_back();
+    size_t num_events;
+    index.processEvents(pr, &num_events);
+    index.getProcessArgs(pr, &args);
+    printf("%*s%d", depth * 2, "", index.processPid(pr));
+    for (size_t i = 0; i < args.size(); i++)
+      printf(" %s", args[i].c_str());
+    printf(" (%zu events)\n", num_events);
+
+    size_t num_children;
+    const uint32_t* children = index.processChildren(pr, &num_children);
+    // Pushed in reverse, so they are printed in the order they started.
+    for (size_t i = num_children; i > 0; i--)
+      stack.push_back(make_pair(children[i - 1], depth + 1));
+  }
+}
+
+int main(int argc, char* argv[]) {
+  const char* arg0 = argv[0];
+  bool show_pid = false;
+  katd::EventFilter filter;
+  bool has_filter = false;
+  while (argc >= 2 && argv[1][0] == '-') {
+    if (!strcmp(argv[1], "-p")) {
+      show_pid = true;
+    } else if (!strcmp(argv[1], "--filter") && argc >= 3) {
+      string err;
+      if (!filter.parse(argv[2], &err)) {
+        fprintf(stderr, "%s: bad --filter: %s\n", arg0, err.c_str());
+        return 1;
+      }
+      has_filter = true;
+      argc--;
+      argv++;
+    } else {
+      usage(arg0);
+      return 1;
+    }
+    argc--;
+    argv++;
+  }
+  if (argc < 3) {
+    usage(arg0);
+    return 1;
+  }
+
+  katd::TraceIndex index;
+  if (!index.open(argv[1])) {
+    perror(argv[1]);
+    return 1;
+  }
+  const char* query = argv[2];
+  argc -= 3;
+  argv += 3;
+
+  EventPrinter printer(index, has_filter ? &filter : NULL, show_pid);
+  if (!strcmp(query, "path") && argc >= 1) {
+    for (int i = 0; i < argc; i++) {
+      uint32_t p;
+      if (index.findPath(argv[i], &p))
+        printer.addPath(p);
+    }
+    printer.print();
+  } else if (!strcmp(query, "prefix") && argc == 1) {
+    // Like --filter, "/a" is "/a" and everything under it, but not "/ab".
+    string dir = argv[0];
+    while (!dir.empty() && dir[dir.size() - 1] == '/')
+      dir.resize(dir.size() - 1);
+    uint32_t p;
+    if (index.findPath(dir.empty() ? "/" : dir, &p))
+      printer.addPath(p);
+    uint32_t begin, end;
+    index.findPrefix(dir + '/', &begin, &end);
+    for (p = begin; p < end; p++)
+      printer.addPath(p);
+    printer.print();
+  } else if (!strcmp(query, "pid") && argc == 1) {
+    uint32_t begin, end;
+    index.findPid(atoi(argv[0]), &begin, &end);
+    for (uint32_t pr = begin; pr < end; pr++)
+      printer.addProcess(pr);
+    printer.print();
+  } else if (!strcmp(query, "all") && argc == 0) {
+    for (uint32_t e = 0; e < index.numEvents(); e++)
+      printer.printEvent(e);
+  } else if (!strcmp(query, "tree") && argc <= 1) {
+    if (argc) {
+      uint32_t begin, end;
+      index.findPid(atoi(argv[0]), &begin, &end);
+      for (uint32_t pr = begin; pr < end; pr++)
+        printTree(index, pr);
+    } else {
+      for (uint32_t pr = 0; pr < index.numProcesses(); pr++) {
+        if (index.processParent(pr) == katd::TraceIndex::kNoProcess)
+          printTree(index, pr);
+      }
+    }
+  } else {
+    usage(arg0);
+    return 1;
+  }
+}
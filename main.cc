@@ -1,28 +1,382 @@
+#include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+#include "aggregate_handler.h"
+#include "async_handler.h"
+#include "binary_trace_handler.h"
+#include "command_cache.h"
+#include "deps_handler.h"
 #include "dump_handler.h"
+#include "event_filter.h"
+#include "fanotify_tracer.h"
+#include "hash_handler.h"
+#include "log.h"
+#include "preload_tracer.h"
+#include "timeline_handler.h"
 #include "tracer.h"
+#include "tracer_stats.h"
+
+static void printStats(const katd::TracerStats& stats, const char* format) {
+  if (!strcmp(format, "json"))
+    stats.printJson(stderr);
+  else
+    stats.printTable(stderr);
+}
 
 int main(int argc, char* argv[]) {
   const char* arg0 = argv[0];
   bool follow_children = false;
-  if (!strcmp(argv[1], "-f")) {
-    follow_children = true;
+  bool resolve_symlinks = false;
+  const char* binary_output = NULL;
+  bool use_mmap = false;
+  bool async = false;
+  bool use_process_vm_readv = true;
+  int num_threads = 1;
+  int attach_pid = 0;
+  bool preload = false;
+  const char* fanotify_root = NULL;
+  bool aggregate = false;
+  bool aggregate_per_pid = false;
+  const char* deps_output = NULL;
+  katd::DepsHandler::Format deps_format = katd::DepsHandler::MAKE_FORMAT;
+  const char* hash_output = NULL;
+  const char* hash_memo = NULL;
+  katd::HashAlgorithm hash_algorithm = katd::HASH_XXH64;
+  const char* cache_dir = NULL;
+  const char* stats_format = NULL;
+  const char* timeline_output = NULL;
+  katd::EventFilter filter;
+  bool has_filter = false;
+  std::string filter_error;
+  katd::AsyncHandler::FullPolicy full_policy =
+      katd::AsyncHandler::BLOCK_WHEN_FULL;
+  while (argc >= 2 && argv[1][0] == '-') {
+    if (!strcmp(argv[1], "-f")) {
+      follow_children = true;
+    } else if (!strcmp(argv[1], "-L")) {
+      resolve_symlinks = true;
+    } else if (!strcmp(argv[1], "-o") && argc >= 3) {
+      binary_output = argv[2];
+      argc--;
+      argv++;
+    } else if (!strcmp(argv[1], "-p") && argc >= 3) {
+      attach_pid = atoi(argv[2]);
+      follow_children = true;
+      argc--;
+      argv++;
+    } else if (!strcmp(argv[1], "-j") && argc >= 3) {
+      num_threads = atoi(argv[2]);
+      argc--;
+      argv++;
+    } else if (!strcmp(argv[1], "-P")) {
+      preload = true;
+    } else if (!strcmp(argv[1], "--fanotify") && argc >= 3) {
+      fanotify_root = argv[2];
+      argc--;
+      argv++;
+    } else if (!strcmp(argv[1], "-u")) {
+      aggregate = true;
+    } else if (!strcmp(argv[1], "-U")) {
+      aggregate = true;
+      aggregate_per_pid = true;
+    } else if ((!strcmp(argv[1], "-M") || !strcmp(argv[1], "-N") ||
+                !strcmp(argv[1], "-J")) && argc >= 3) {
+      deps_format = argv[1][1] == 'M' ? katd::DepsHandler::MAKE_FORMAT :
+          argv[1][1] == 'N' ? katd::DepsHandler::NINJA_FORMAT :
+          katd::DepsHandler::JSON_FORMAT;
+      deps_output = argv[2];
+      argc--;
+      argv++;
+    } else if (!strcmp(argv[1], "-H") && argc >= 3) {
+      hash_output = argv[2];
+      argc--;
+      argv++;
+    } else if (!strcmp(argv[1], "-S")) {
+      hash_algorithm = katd::HASH_SHA256;
+    } else if (!strcmp(argv[1], "-k") && argc >= 3) {
+      hash_memo = argv[2];
+      argc--;
+      argv++;
+    } else if (!strcmp(argv[1], "--cache") && argc >= 3) {
+      cache_dir = argv[2];
+      argc--;
+      argv++;
+    } else if (!strcmp(argv[1], "--filter") && argc >= 3) {
+      if (!filter.parse(argv[2], &filter_error))
+        break;
+      has_filter = true;
+      argc--;
+      argv++;
+    } else if (!strcmp(argv[1], "--stats")) {
+      stats_format = "table";
+    } else if (!strncmp(argv[1], "--stats=", 8)) {
+      stats_format = argv[1] + 8;
+    } else if (!strcmp(argv[1], "--timeline") && argc >= 3) {
+      timeline_output = argv[2];
+      argc--;
+      argv++;
+    } else if (!strcmp(argv[1], "--peekdata")) {
+      use_process_vm_readv = false;
+    } else if (!strcmp(argv[1], "-m")) {
+      use_mmap = true;
+    } else if (!strcmp(argv[1], "-a")) {
+      async = true;
+    } else if (!strcmp(argv[1], "-d")) {
+      async = true;
+      full_policy = katd::AsyncHandler::DROP_WHEN_FULL;
+    } else {
+      break;
+    }
     argc--;
     argv++;
   }
-  if (argc < 2) {
-    fprintf(stderr, "Usage: %s command [arg ...]\n", arg0);
+  bool bad_stats_format = stats_format && strcmp(stats_format, "table") &&
+      strcmp(stats_format, "json");
+  if (!filter_error.empty()) {
+    fprintf(stderr, "%s: bad --filter: %s\n", arg0, filter_error.c_str());
+    return 1;
+  }
+  // Only ptrace reaps processes with their times.
+  bool bad_timeline = timeline_output &&
+      (preload || fanotify_root || cache_dir);
+  if ((argc < 2 && (!attach_pid || cache_dir || fanotify_root)) ||
+      bad_stats_format || bad_timeline || num_threads < 1) {
+    fprintf(stderr,
+            "Usage: %s [-f [-j threads]|-P] [-L] [-u|-U] [-a|-d] "
+            "[-o trace [-m]]\n"
+            "       [-M|-N|-J deps] [-H digests [-S] [-k memo]] "
+            "[--filter spec]\n"
+            "       [--stats[=json]] [--timeline json] command [arg ...]\n"
+            "       %s [-L] [-u|-U] [-a|-d] [-o trace [-m]] "
+            "[-M|-N|-J deps]\n"
+            "       [-H digests [-S] [-k memo]] [--filter spec] "
+            "[--stats[=json]]\n"
+            "       [--timeline json] -p pid\n"
+            "       %s [-L] [--stats[=json]] --cache dir command [arg ...]\n"
+            "       %s [-u|-U] [-a|-d] [-o trace [-m]] [-M|-N|-J deps]\n"
+            "       [-H digests [-S] [-k memo]] [--filter spec] "
+            "--fanotify dir\n"
+            "       command [arg ...]\n"
+            " -f: follow children\n"
+            " -j: trace with this many threads, each tracing part of the\n"
+            "     process tree. Processes move between threads only on\n"
+            "     x86_64\n"
+            " -p: trace the running process and its descendants until "
+            "SIGINT\n"
+            " -P: follow children with LD_PRELOAD instead of ptrace, unless\n"
+            "     the command is statically linked\n"
+            " --fanotify: run the command untraced and report the files under\n"
+            "     the directory it and its descendants read and write, as\n"
+            "     fanotify sees them. Needs CAP_SYS_ADMIN\n"
+            " -L: resolve symlinks in directories of paths\n"
+            " -u: output only the first event for each path and type\n"
+            " -U: same as -u, but for each process\n"
+            " -a: run handlers in a separate thread\n"
+            " -d: same as -a, but drop events when the queue is full\n"
+            " -o: write a binary trace to the file instead of text\n"
+            " -m: write the binary trace through mmap\n"
+            " --peekdata: read tracee memory with PTRACE_PEEKDATA instead\n"
+            "     of process_vm_readv\n"
+            " -M: write the inputs and outputs of each program as Makefile\n"
+            "     rules instead of text. -u acts as -U with this\n"
+            " -N: same as -M, but as ninja build statements\n"
+            " -J: same as -M, but as JSON lines with failed probes\n"
+            " -H: write digests of files read and written instead of text.\n"
+            "     -u acts as -U with this\n"
+            " -S: use SHA-256 for -H instead of XXH64\n"
+            " -k: keep digests in the file by (dev, ino, mtime, size)\n"
+            " --cache: restore the outputs of the command from the directory\n"
+            "     if its argv, cwd, environment and inputs match a previous\n"
+            "     successful run. Otherwise run it and store the outputs\n"
+            " --filter: report only the events which match the spec, e.g.\n"
+            "     'type=write,remove;syscall=open,openat;path=/out,*.o'.\n"
+            "     Types are read, write, remove, read_metadata,\n"
+            "     write_metadata, read_failure and write_failure. Paths\n"
+            "     without wildcards match themselves and everything under\n"
+            "     them. Syscalls which cannot match are not traced\n"
+            " --stats: print ptrace stops, time spent in the tracer and\n"
+            "     handlers, and bytes read from tracees to stderr at exit\n"
+            " --timeline: write the processes with their times, resource\n"
+            "     usage and numbers of file events as a Chrome trace event\n"
+            "     file for Perfetto, and print the critical path to stderr\n"
+            "     at exit. Not with -P. -u acts as -U with this\n",
+            arg0, arg0, arg0, arg0);
     return 1;
   }
 
-  katd::Tracer tracer(argv + 1);
-  tracer.set_follow_children(follow_children);
+  katd::TracerStats stats;
+  katd::TracerStats* tracer_stats = stats_format ? &stats : NULL;
+
+  if (cache_dir) {
+    katd::CommandCache cache(cache_dir, argv + 1);
+    if (cache.restore())
+      return 0;
+    cache.startCapture();
+    katd::Tracer tracer(argv + 1);
+    tracer.set_follow_children(true);
+    tracer.set_resolve_symlinks(resolve_symlinks);
+    tracer.set_use_process_vm_readv(use_process_vm_readv);
+    tracer.set_stats(tracer_stats);
+    tracer.addHandler(&cache);
+    tracer.run();
+    int exit_code = cache.finish(tracer.exit_status());
+    if (tracer_stats)
+      printStats(stats, stats_format);
+    return exit_code;
+  }
+
+  if (preload && !attach_pid) {
+    if (katd::PreloadTracer::canTrace(argv[1])) {
+      follow_children = true;
+    } else {
+      fprintf(stderr, "%s: %s is statically linked, using ptrace\n",
+              arg0, argv[1]);
+      preload = false;
+    }
+  }
+
+  if (fanotify_root)
+    follow_children = true;
 
   katd::DumpHandler dump_handler;
   dump_handler.set_show_pid(follow_children);
 
-  tracer.addHandler(&dump_handler);
-  tracer.run();
+  std::vector<katd::Handler*> handlers;
+  katd::BinaryTraceHandler* binary_handler = NULL;
+  if (binary_output) {
+    int fd = open(binary_output, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  0666);
+    PCHECK(fd >= 0);
+    binary_handler = new katd::BinaryTraceHandler(fd, use_mmap);
+    handlers.push_back(binary_handler);
+  }
+
+  katd::DepsHandler* deps_handler = NULL;
+  FILE* deps_fp = NULL;
+  if (deps_output) {
+    deps_fp = fopen(deps_output, "we");
+    PCHECK(deps_fp);
+    deps_handler = new katd::DepsHandler(deps_format);
+    deps_handler->set_output(deps_fp);
+    handlers.push_back(deps_handler);
+    // Each program needs its own first events.
+    aggregate_per_pid = true;
+  }
+
+  katd::HashHandler* hash_handler = NULL;
+  FILE* hash_fp = NULL;
+  if (hash_output) {
+    hash_fp = fopen(hash_output, "we");
+    PCHECK(hash_fp);
+    hash_handler = new katd::HashHandler(
+        hash_algorithm, std::max(1u, std::thread::hardware_concurrency()));
+    hash_handler->set_output(hash_fp);
+    if (hash_memo)
+      hash_handler->set_memo_path(hash_memo);
+    handlers.push_back(hash_handler);
+    // Outputs are hashed when the process which wrote them exits.
+    aggregate_per_pid = true;
+  }
+
+  katd::TimelineHandler* timeline_handler = NULL;
+  FILE* timeline_fp = NULL;
+  if (timeline_output) {
+    timeline_fp = fopen(timeline_output, "we");
+    PCHECK(timeline_fp);
+    timeline_handler = new katd::TimelineHandler();
+    timeline_handler->set_output(timeline_fp);
+    handlers.push_back(timeline_handler);
+    // Events are counted per process.
+    aggregate_per_pid = true;
+  }
+
+  if (handlers.empty())
+    handlers.push_back(&dump_handler);
+
+  katd::AsyncHandler* async_handler = NULL;
+  if (async) {
+    async_handler = new katd::AsyncHandler(1 << 16, full_policy);
+    for (size_t i = 0; i < handlers.size(); i++)
+      async_handler->addHandler(handlers[i]);
+    handlers.assign(1, async_handler);
+  }
+
+  katd::AggregateHandler* aggregate_handler = NULL;
+  if (aggregate) {
+    aggregate_handler = new katd::AggregateHandler(aggregate_per_pid);
+    for (size_t i = 0; i < handlers.size(); i++)
+      aggregate_handler->addHandler(handlers[i]);
+    handlers.assign(1, aggregate_handler);
+  }
+
+  if (fanotify_root) {
+    katd::FanotifyTracer tracer(argv + 1, fanotify_root);
+    if (has_filter)
+      tracer.set_filter(filter);
+    for (size_t i = 0; i < handlers.size(); i++)
+      tracer.addHandler(handlers[i]);
+    if (!tracer.run()) {
+      fprintf(stderr, "%s: cannot watch %s with fanotify: %s\n",
+              arg0, fanotify_root, strerror(errno));
+      return 1;
+    }
+  } else if (preload) {
+    katd::PreloadTracer tracer(argv + 1);
+    tracer.set_resolve_symlinks(resolve_symlinks);
+    if (has_filter)
+      tracer.set_filter(filter);
+    for (size_t i = 0; i < handlers.size(); i++)
+      tracer.addHandler(handlers[i]);
+    tracer.run();
+    if (tracer.dropped()) {
+      fprintf(stderr, "%s: dropped %llu events\n", arg0,
+              static_cast<unsigned long long>(tracer.dropped()));
+    }
+  } else {
+    katd::Tracer tracer(attach_pid ? NULL : argv + 1);
+    tracer.set_attach_pid(attach_pid);
+    tracer.set_follow_children(follow_children);
+    tracer.set_num_threads(num_threads);
+    tracer.set_resolve_symlinks(resolve_symlinks);
+    tracer.set_use_process_vm_readv(use_process_vm_readv);
+    tracer.set_stats(tracer_stats);
+    tracer.set_process_times(timeline_handler != NULL);
+    if (has_filter)
+      tracer.set_filter(filter);
+    for (size_t i = 0; i < handlers.size(); i++)
+      tracer.addHandler(handlers[i]);
+    tracer.run();
+  }
+
+  if (tracer_stats && !preload && !fanotify_root)
+    printStats(stats, stats_format);
+  if (async_handler && async_handler->dropped()) {
+    fprintf(stderr, "%s: dropped %zu events\n",
+            arg0, async_handler->dropped());
+  }
+  if (aggregate_handler) {
+    fprintf(stderr, "%s: %zu events, %zu unique\n",
+            arg0, aggregate_handler->total(), aggregate_handler->unique());
+  }
+  if (timeline_handler)
+    timeline_handler->printCriticalPath(stderr);
+  delete aggregate_handler;
+  delete async_handler;
+  delete binary_handler;
+  delete deps_handler;
+  if (deps_fp)
+    fclose(deps_fp);
+  delete hash_handler;
+  if (hash_fp)
+    fclose(hash_fp);
+  delete timeline_handler;
+  if (timeline_fp)
+    fclose(timeline_fp);
 }
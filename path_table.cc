@@ -0,0 +1,114 @@
+#include "path_table.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+
+using namespace std;
+
+namespace katd {
+
+static const size_t kArenaChunkSize = 1 << 20;
+
+static uint32_t hashPath(const char* path, size_t size) {
+  // FNV-1a.
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < size; i++) {
+    h ^= static_cast<unsigned char>(path[i]);
+    h *= 16777619u;
+  }
+  return h;
+}
+
+PathTable* PathTable::global() {
+  static PathTable* table = new PathTable();
+  return table;
+}
+
+PathTable::PathTable()
+  : blocks_(new Entry*[kMaxBlocks]()),
+    count_(0),
+    buckets_(1024),
+    arena_ptr_(NULL),
+    arena_left_(0) {
+  CHECK(intern("", 0) == kEmptyPathId);
+}
+
+PathTable::~PathTable() {
+  for (size_t i = 0; i < kMaxBlocks && blocks_[i]; i++)
+    delete[] blocks_[i];
+  delete[] blocks_;
+  for (size_t i = 0; i < arena_chunks_.size(); i++)
+    free(arena_chunks_[i]);
+}
+
+PathId PathTable::intern(const char* path, size_t size) {
+  uint32_t hash = hashPath(path, size);
+  lock_guard<mutex> lock(mu_);
+  return internLocked(path, size, hash);
+}
+
+PathId PathTable::internLocked(const char* path, size_t size,
+                               uint32_t hash) {
+  size_t mask = buckets_.size() - 1;
+  for (size_t i = hash & mask;; i = (i + 1) & mask) {
+    uint32_t b = buckets_[i];
+    if (!b) {
+      if (count_ * 2 >= buckets_.size()) {
+        grow();
+        return internLocked(path, size, hash);
+      }
+
+      PathId id = count_;
+      size_t block = id >> kBlockBits;
+      CHECK(block < kMaxBlocks);
+      if (!blocks_[block])
+        blocks_[block] = new Entry[kBlockSize];
+      Entry* e = &blocks_[block][id & (kBlockSize - 1)];
+      e->str = copyToArena(path, size);
+      e->size = size;
+      e->hash = hash;
+      buckets_[i] = id + 1;
+      count_++;
+      return id;
+    }
+
+    const Entry& e = getEntry(b - 1);
+    if (e.hash == hash && e.size == size && !memcmp(e.str, path, size))
+      return b - 1;
+  }
+}
+
+const char* PathTable::copyToArena(const char* path, size_t size) {
+  if (size + 1 > arena_left_) {
+    size_t chunk_size = max(kArenaChunkSize, size + 1);
+    arena_ptr_ = static_cast<char*>(malloc(chunk_size));
+    CHECK(arena_ptr_);
+    arena_chunks_.push_back(arena_ptr_);
+    arena_left_ = chunk_size;
+  }
+  char* r = arena_ptr_;
+  memcpy(r, path, size);
+  r[size] = '\0';
+  arena_ptr_ += size + 1;
+  arena_left_ -= size + 1;
+  return r;
+}
+
+void PathTable::grow() {
+  vector<uint32_t> buckets(buckets_.size() * 2);
+  size_t mask = buckets.size() - 1;
+  for (size_t i = 0; i < buckets_.size(); i++) {
+    uint32_t b = buckets_[i];
+    if (!b)
+      continue;
+    size_t j = getEntry(b - 1).hash & mask;
+    while (buckets[j])
+      j = (j + 1) & mask;
+    buckets[j] = b;
+  }
+  buckets_.swap(buckets);
+}
+
+}  // namespace katd
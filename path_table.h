@@ -0,0 +1,80 @@
+#ifndef KATD_PATH_TABLE_H_
+#define KATD_PATH_TABLE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace katd {
+
+typedef uint32_t PathId;
+
+// Interns paths to stable ids. Strings live in an arena and are never
+// freed, so pointers returned by |str| stay valid. Ids are assigned
+// from zero and the empty path is always kEmptyPathId.
+//
+// |intern| takes a lock, so the tracer threads of a sharded run may all
+// call it. Other threads may look up ids they received from an
+// interning thread through a release/acquire pair, e.g. an event passed
+// through SpscRing.
+class PathTable {
+public:
+  static const PathId kEmptyPathId = 0;
+
+  // The table shared by the tracer and handlers.
+  static PathTable* global();
+
+  PathTable();
+  ~PathTable();
+
+  PathId intern(const char* path, size_t size);
+  PathId intern(const std::string& path) {
+    return intern(path.data(), path.size());
+  }
+
+  // NUL-terminated.
+  const char* str(PathId id) const { return getEntry(id).str; }
+  size_t size(PathId id) const { return getEntry(id).size; }
+  size_t count() const { return count_; }
+
+private:
+  struct Entry {
+    const char* str;
+    uint32_t size;
+    uint32_t hash;
+  };
+
+  static const int kBlockBits = 12;
+  static const size_t kBlockSize = 1 << kBlockBits;
+  static const size_t kMaxBlocks = 1 << 16;
+
+  const Entry& getEntry(PathId id) const {
+    return blocks_[id >> kBlockBits][id & (kBlockSize - 1)];
+  }
+
+  PathId internLocked(const char* path, size_t size, uint32_t hash);
+  const char* copyToArena(const char* path, size_t size);
+  void grow();
+
+  std::mutex mu_;
+
+  // Entries are allocated by blocks which never move, so readers do not
+  // race with |intern| adding entries.
+  Entry** blocks_;
+  size_t count_;
+
+  // Open addressing with linear probing. Each bucket is id + 1, or 0
+  // for an empty bucket.
+  std::vector<uint32_t> buckets_;
+
+  std::vector<char*> arena_chunks_;
+  char* arena_ptr_;
+  size_t arena_left_;
+};
+
+}  // namespace katd
+
+#endif  // KATD_PATH_TABLE_H_
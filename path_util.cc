@@ -0,0 +1,41 @@
+#include "path_util.h"
+
+#include <string.h>
+
+namespace katd {
+
+size_t normalizePath(char* path, size_t size) {
+  if (size == 0 || path[0] != '/')
+    return size;
+
+  // path[0, out) is "/" or "/a/b" without a trailing slash. Since |out|
+  // never passes |i|, we can copy components forward in place.
+  size_t out = 1;
+  size_t i = 1;
+  while (i < size) {
+    while (i < size && path[i] == '/')
+      i++;
+    size_t start = i;
+    while (i < size && path[i] != '/')
+      i++;
+    size_t len = i - start;
+    if (len == 0)
+      break;
+    if (len == 1 && path[start] == '.')
+      continue;
+    if (len == 2 && path[start] == '.' && path[start + 1] == '.') {
+      while (out > 1 && path[out - 1] != '/')
+        out--;
+      if (out > 1)
+        out--;
+      continue;
+    }
+    if (out > 1)
+      path[out++] = '/';
+    memmove(path + out, path + start, len);
+    out += len;
+  }
+  return out;
+}
+
+}  // namespace katd
@@ -0,0 +1,19 @@
+#ifndef KATD_PATH_UTIL_H_
+#define KATD_PATH_UTIL_H_
+
+#include <stddef.h>
+
+namespace katd {
+
+// Collapses ".", ".." and duplicated slashes of an absolute path in
+// place and drops the trailing slash, e.g. "/a//b/../c/./" => "/a/c".
+// ".." of the root is the root. Returns the new size. Paths which do
+// not start with a slash are left as they are.
+//
+// This is lexical, so "a/b/.." is "a" even if "a/b" is a symlink. Use
+// SymlinkResolver to resolve directories.
+size_t normalizePath(char* path, size_t size);
+
+}  // namespace katd
+
+#endif  // KATD_PATH_UTIL_H_
@@ -0,0 +1,145 @@
+#ifndef KATD_PID_TABLE_H_
+#define KATD_PID_TABLE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+namespace katd {
+
+// A hash table from pids to T with open addressing and linear probing.
+// Values are allocated separately, so pointers to them stay valid until
+// the pid is erased. Erased values are kept for reuse, since traced
+// builds start and finish processes all the time.
+template <typename T>
+class PidTable {
+public:
+  PidTable()
+    : buckets_(64),
+      size_(0) {
+  }
+
+  ~PidTable() {
+    for (size_t i = 0; i < buckets_.size(); i++)
+      delete buckets_[i].value;
+    for (size_t i = 0; i < free_.size(); i++)
+      delete free_[i];
+  }
+
+  T* find(int pid) const {
+    size_t mask = buckets_.size() - 1;
+    for (size_t i = hash(pid) & mask;; i = (i + 1) & mask) {
+      const Bucket& b = buckets_[i];
+      if (b.pid == pid)
+        return b.value;
+      if (!b.value)
+        return NULL;
+    }
+  }
+
+  // Returns the value for |pid|, adding a default constructed one if
+  // |pid| is new.
+  T* insert(int pid, bool* inserted) {
+    if ((size_ + 1) * 2 > buckets_.size())
+      grow();
+    size_t mask = buckets_.size() - 1;
+    for (size_t i = hash(pid) & mask;; i = (i + 1) & mask) {
+      Bucket* b = &buckets_[i];
+      if (b->value && b->pid == pid) {
+        *inserted = false;
+        return b->value;
+      }
+      if (!b->value) {
+        if (free_.empty()) {
+          b->value = new T();
+        } else {
+          b->value = free_.back();
+          free_.pop_back();
+          *b->value = T();
+        }
+        b->pid = pid;
+        size_++;
+        *inserted = true;
+        return b->value;
+      }
+    }
+  }
+
+  void erase(int pid) {
+    size_t mask = buckets_.size() - 1;
+    size_t i = hash(pid) & mask;
+    for (;; i = (i + 1) & mask) {
+      if (!buckets_[i].value)
+        return;
+      if (buckets_[i].pid == pid)
+        break;
+    }
+    free_.push_back(buckets_[i].value);
+    size_--;
+
+    // Shift back the following entries so lookups do not stop at the
+    // hole.
+    for (size_t j = (i + 1) & mask; buckets_[j].value; j = (j + 1) & mask) {
+      size_t home = hash(buckets_[j].pid) & mask;
+      bool movable = i <= j ? (home <= i || home > j) : (home <= i && home > j);
+      if (movable) {
+        buckets_[i] = buckets_[j];
+        i = j;
+      }
+    }
+    buckets_[i] = Bucket();
+  }
+
+  void getPids(std::vector<int>* pids) const {
+    for (size_t i = 0; i < buckets_.size(); i++) {
+      if (buckets_[i].value)
+        pids->push_back(buckets_[i].pid);
+    }
+  }
+
+  void clear() {
+    for (size_t i = 0; i < buckets_.size(); i++) {
+      if (buckets_[i].value)
+        free_.push_back(buckets_[i].value);
+      buckets_[i] = Bucket();
+    }
+    size_ = 0;
+  }
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+private:
+  struct Bucket {
+    Bucket() : pid(0), value(NULL) {}
+    int pid;
+    T* value;
+  };
+
+  static size_t hash(int pid) {
+    return static_cast<uint32_t>(pid) * 2654435761u;
+  }
+
+  void grow() {
+    std::vector<Bucket> buckets(buckets_.size() * 2);
+    buckets.swap(buckets_);
+    size_t mask = buckets_.size() - 1;
+    for (size_t i = 0; i < buckets.size(); i++) {
+      if (!buckets[i].value)
+        continue;
+      size_t j = hash(buckets[i].pid) & mask;
+      while (buckets_[j].value)
+        j = (j + 1) & mask;
+      buckets_[j] = buckets[i];
+    }
+  }
+
+  std::vector<Bucket> buckets_;
+  size_t size_;
+  std::vector<T*> free_;
+};
+
+}  // namespace katd
+
+#endif  // KATD_PID_TABLE_H_
@@ -0,0 +1,210 @@
+#include "preload_ring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+
+namespace katd {
+
+static const size_t kControlSize = 4096;
+static const size_t kAlignment = 8;
+// A writer drops its record when the ring stays full this long, e.g.
+// since katd is stopped.
+static const int kFullTimeoutMs = 10000;
+
+void PreloadRing::create(const char* path, size_t capacity) {
+  CHECK(capacity && !(capacity & (capacity - 1)));
+  CHECK(capacity % sysconf(_SC_PAGESIZE) == 0);
+  int fd = ::open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+  if (fd < 0 && errno == EEXIST) {
+    // Left by a katd which had our pid and was killed.
+    PCHECK(unlink(path) == 0);
+    fd = ::open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+  }
+  PCHECK(fd >= 0);
+  PCHECK(ftruncate(fd, kControlSize + capacity) == 0);
+  PCHECK(map(fd, capacity));
+  control_->capacity = capacity;
+  control_->reader_pid = getpid();
+  pthread_mutexattr_t attr;
+  PCHECK(pthread_mutexattr_init(&attr) == 0);
+  PCHECK(pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED) == 0);
+  PCHECK(pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST) == 0);
+  PCHECK(pthread_mutex_init(&control_->writer_mu, &attr) == 0);
+  pthread_mutexattr_destroy(&attr);
+}
+
+bool PreloadRing::open(const char* path) {
+  int fd = ::open(path, O_RDWR | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size <= static_cast<off_t>(kControlSize)) {
+    close(fd);
+    return false;
+  }
+  return map(fd, st.st_size - kControlSize);
+}
+
+// Maps the control page followed by two views of the data.
+bool PreloadRing::map(int fd, size_t capacity) {
+  char* base = static_cast<char*>(
+      mmap(NULL, kControlSize + capacity * 2, PROT_NONE,
+           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+  if (base == MAP_FAILED) {
+    close(fd);
+    return false;
+  }
+  bool ok =
+      mmap(base, kControlSize, PROT_READ | PROT_WRITE,
+           MAP_SHARED | MAP_FIXED, fd, 0) != MAP_FAILED &&
+      mmap(base + kControlSize, capacity, PROT_READ | PROT_WRITE,
+           MAP_SHARED | MAP_FIXED, fd, kControlSize) != MAP_FAILED &&
+      mmap(base + kControlSize + capacity, capacity, PROT_READ | PROT_WRITE,
+           MAP_SHARED | MAP_FIXED, fd, kControlSize) != MAP_FAILED;
+  close(fd);
+  if (!ok) {
+    munmap(base, kControlSize + capacity * 2);
+    return false;
+  }
+  control_ = reinterpret_cast<Control*>(base);
+  data_ = base + kControlSize;
+  mask_ = capacity - 1;
+  return true;
+}
+
+static uint64_t getRecordSize(size_t path_size) {
+  return (sizeof(PreloadRecord) + path_size + kAlignment - 1) &
+      ~(kAlignment - 1);
+}
+
+static uint64_t getMonotonicMs() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+PreloadRecord* PreloadRing::reserve(size_t path_size) {
+  uint64_t size = getRecordSize(path_size);
+  int32_t owner = getpid();
+  uint64_t full_since_ms = 0;
+  for (int i = 0;; i++) {
+    // The previous holder died, but it bumps |tail| last, so the ring is
+    // consistent.
+    if (pthread_mutex_lock(&control_->writer_mu) == EOWNERDEAD)
+      pthread_mutex_consistent(&control_->writer_mu);
+    uint64_t pos = control_->tail.load(std::memory_order_relaxed);
+    if (pos + size - control_->head.load(std::memory_order_acquire) <=
+        mask_ + 1) {
+      PreloadRecord* record =
+          reinterpret_cast<PreloadRecord*>(data_ + (pos & mask_));
+      record->reserved_size = size;
+      record->owner = owner;
+      control_->tail.store(pos + size, std::memory_order_release);
+      pthread_mutex_unlock(&control_->writer_mu);
+      return record;
+    }
+    pthread_mutex_unlock(&control_->writer_mu);
+
+    // Wait until the reader consumes enough records.
+    if (i % 1024 == 1023) {
+      if (!hasReader())
+        return NULL;
+      uint64_t now_ms = getMonotonicMs();
+      if (!full_since_ms) {
+        full_since_ms = now_ms;
+      } else if (now_ms - full_since_ms >= kFullTimeoutMs) {
+        control_->dropped.fetch_add(1, std::memory_order_relaxed);
+        return NULL;
+      }
+    }
+    sched_yield();
+  }
+}
+
+bool PreloadRing::hasReader() const {
+  return kill(control_->reader_pid, 0) == 0 || errno != ESRCH;
+}
+
+void PreloadRing::commit(PreloadRecord* record, size_t path_size) {
+  // The size is the last thing the reader sees. seq_cst orders it
+  // before the load of |reader_sleeping| below, which pairs with the
+  // store in |wait|.
+  __atomic_store_n(&record->size, getRecordSize(path_size),
+                   __ATOMIC_SEQ_CST);
+  if (control_->reader_sleeping.load()) {
+    control_->wakeups.fetch_add(1);
+    syscall(SYS_futex, &control_->wakeups, FUTEX_WAKE, 1, NULL, NULL, 0);
+  }
+}
+
+PreloadRecord* PreloadRing::front() {
+  uint64_t head = control_->head.load(std::memory_order_relaxed);
+  PreloadRecord* record =
+      reinterpret_cast<PreloadRecord*>(data_ + (head & mask_));
+  if (!__atomic_load_n(&record->size, __ATOMIC_SEQ_CST))
+    return NULL;
+  return record;
+}
+
+void PreloadRing::pop() {
+  uint64_t head = control_->head.load(std::memory_order_relaxed);
+  PreloadRecord* record =
+      reinterpret_cast<PreloadRecord*>(data_ + (head & mask_));
+  uint32_t size = record->size;
+  // Later records may start anywhere in this one, so their sizes must
+  // read zero until they are committed.
+  memset(record, 0, size);
+  control_->head.store(head + size, std::memory_order_release);
+}
+
+bool PreloadRing::skipAbandoned() {
+  uint64_t head = control_->head.load(std::memory_order_relaxed);
+  if (head == control_->tail.load(std::memory_order_acquire))
+    return false;
+  PreloadRecord* record =
+      reinterpret_cast<PreloadRecord*>(data_ + (head & mask_));
+  if (__atomic_load_n(&record->size, __ATOMIC_SEQ_CST) ||
+      kill(record->owner, 0) == 0 || errno != ESRCH) {
+    return false;
+  }
+  // It may have committed just before it exited.
+  if (__atomic_load_n(&record->size, __ATOMIC_SEQ_CST))
+    return false;
+  uint32_t size = record->reserved_size;
+  memset(record, 0, size);
+  control_->head.store(head + size, std::memory_order_release);
+  return true;
+}
+
+bool PreloadRing::empty() const {
+  return control_->head.load(std::memory_order_relaxed) ==
+      control_->tail.load(std::memory_order_acquire);
+}
+
+uint64_t PreloadRing::dropped() const {
+  return control_->dropped.load(std::memory_order_relaxed);
+}
+
+void PreloadRing::wait(int timeout_ms) {
+  uint32_t wakeups = control_->wakeups.load();
+  control_->reader_sleeping.store(1);
+  if (!front()) {
+    timespec ts = { timeout_ms / 1000, (timeout_ms % 1000) * 1000000L };
+    syscall(SYS_futex, &control_->wakeups, FUTEX_WAIT, wakeups, &ts,
+            NULL, 0);
+  }
+  control_->reader_sleeping.store(0);
+}
+
+}  // namespace katd
@@ -0,0 +1,131 @@
+#ifndef KATD_PRELOAD_RING_H_
+#define KATD_PRELOAD_RING_H_
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+namespace katd {
+
+// The environment variable which tells libkatd_preload.so the path of
+// the ring.
+#define KATD_PRELOAD_RING_ENV "KATD_PRELOAD_RING"
+
+enum PreloadRecordKind {
+  // An event of |type| for |path|.
+  PRELOAD_EVENT,
+  // The process is about to exec |path|. Only PRELOAD_EXEC_DONE from the
+  // same pid tells it succeeded.
+  PRELOAD_EXEC,
+  // libkatd_preload.so was loaded into a new program. Instead of a path,
+  // the record has the arguments of the program, each terminated by a
+  // NUL, and |error| is their size.
+  PRELOAD_EXEC_DONE,
+  // The process is exiting. Not sent by _exit or fatal signals.
+  PRELOAD_EXIT,
+  // The process was forked, or libkatd_preload.so was loaded into it,
+  // which may be the first katd hears of a child started by vfork or
+  // posix_spawn. |error| is the pid of its parent.
+  PRELOAD_FORK,
+};
+
+// A record in the ring, followed by a NUL terminated absolute path which
+// is not normalized.
+struct PreloadRecord {
+  // The size of the record including the path, rounded up to 8 bytes.
+  // Zero until the record is committed.
+  uint32_t size;
+  // The size and the pid of the writer, set when the record is reserved,
+  // so the reader can skip it if the writer dies before committing.
+  uint32_t reserved_size;
+  int32_t owner;
+  uint8_t kind;
+  int8_t type;
+  uint16_t syscall;
+  int32_t pid;
+  int32_t error;
+
+  const char* path() const { return reinterpret_cast<const char*>(this + 1); }
+  char* path() { return reinterpret_cast<char*>(this + 1); }
+};
+
+// A bounded ring in a shared file, written by any number of traced
+// threads and processes and read by katd.
+//
+// Writers reserve space by bumping |tail| and commit a record by storing
+// its size. The reader consumes committed records in order, zeroes them
+// and bumps |head|. The data is mapped twice back to back, so a record
+// which crosses the end of the ring is still contiguous.
+//
+// Reservations take a robust mutex, which the next writer recovers if a
+// writer dies holding it. A writer stamps its record with its size and
+// pid before it bumps |tail|, so a record whose writer died before
+// committing it is skipped rather than waited for forever.
+//
+// This does not need libstdc++, so libkatd_preload.so does not make
+// every traced program load it. The mapping is kept until exit.
+class PreloadRing {
+public:
+  // Constant initialized, so libkatd_preload.so can use the ring from its
+  // constructor before dynamic initializers run.
+  constexpr PreloadRing()
+    : control_(NULL),
+      data_(NULL),
+      mask_(0) {
+  }
+
+  // Creates the file at |path| for the reader, replacing a stale one.
+  // |capacity| must be a power of two and a multiple of the page size.
+  void create(const char* path, size_t capacity);
+  // Maps an existing ring for a writer. Returns false on failure.
+  bool open(const char* path);
+
+  // Writer side. Returns a record with room for a path of |path_size|
+  // bytes including the NUL, or NULL if the reader has gone away or the
+  // ring stayed full for ten seconds, in which case the record is
+  // counted as dropped. The record must be committed soon, since the
+  // reader waits for it.
+  PreloadRecord* reserve(size_t path_size);
+  void commit(PreloadRecord* record, size_t path_size);
+  bool hasReader() const;
+
+  // Reader side. Returns the oldest record, or NULL if it is not
+  // committed yet. The record is released by |pop|.
+  PreloadRecord* front();
+  void pop();
+  // Pops the oldest record if it is reserved but its writer exited
+  // without committing it. Returns whether it did.
+  bool skipAbandoned();
+  // Whether no writer has reserved a record which is not popped.
+  bool empty() const;
+  // The number of records writers dropped since the ring was full.
+  uint64_t dropped() const;
+  // Sleeps until a writer commits or |timeout_ms| passes. Signals wake
+  // it up early.
+  void wait(int timeout_ms);
+
+private:
+  struct Control {
+    uint64_t capacity;
+    int32_t reader_pid;
+    // Held while a writer reserves a record.
+    pthread_mutex_t writer_mu;
+    std::atomic<uint64_t> dropped;
+    alignas(64) std::atomic<uint64_t> tail;
+    alignas(64) std::atomic<uint64_t> head;
+    std::atomic<uint32_t> reader_sleeping;
+    std::atomic<uint32_t> wakeups;
+  };
+
+  bool map(int fd, size_t capacity);
+
+  Control* control_;
+  char* data_;
+  uint64_t mask_;
+};
+
+}  // namespace katd
+
+#endif  // KATD_PRELOAD_RING_H_
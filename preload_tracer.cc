@@ -0,0 +1,300 @@
+#include "preload_tracer.h"
+
+#include <elf.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <string>
+#include <thread>
+
+#include "event.h"
+#include "event_filter.h"
+#include "handler.h"
+#include "log.h"
+#include "path_util.h"
+#include "symlink_resolver.h"
+#include "syscalls.h"
+
+using namespace std;
+
+namespace katd {
+
+// The ring is shared by all traced processes. Writers wait for katd
+// when it is full, and drop their records if it stays full.
+static const size_t kRingCapacity = 8 << 20;
+// How many times katd polls the ring before it sleeps.
+static const int kSpinCount = 1000;
+// katd checks if the command exited at least this often.
+static const int kWaitTimeoutMs = 100;
+
+PreloadTracer::PreloadTracer(char** argv)
+  : argv_(argv),
+    paths_(PathTable::global()),
+    resolver_(NULL),
+    filter_(NULL) {
+}
+
+PreloadTracer::~PreloadTracer() {
+  delete resolver_;
+  delete filter_;
+}
+
+void PreloadTracer::addHandler(Handler* handler) {
+  handlers_.push_back(handler);
+}
+
+void PreloadTracer::set_resolve_symlinks(bool r) {
+  delete resolver_;
+  resolver_ = r ? new SymlinkResolver(paths_) : NULL;
+}
+
+void PreloadTracer::set_filter(const EventFilter& filter) {
+  delete filter_;
+  filter_ = new EventFilter(filter);
+}
+
+template <typename Ehdr, typename Phdr>
+static bool hasInterpreter(int fd) {
+  Ehdr ehdr;
+  if (pread(fd, &ehdr, sizeof(ehdr), 0) != sizeof(ehdr))
+    return false;
+  for (int i = 0; i < ehdr.e_phnum; i++) {
+    Phdr phdr;
+    if (pread(fd, &phdr, sizeof(phdr), ehdr.e_phoff + i * ehdr.e_phentsize) !=
+        sizeof(phdr)) {
+      return false;
+    }
+    if (phdr.p_type == PT_INTERP)
+      return true;
+  }
+  return false;
+}
+
+// Returns the path execvp would run for |argv0|.
+static string findProgram(const char* argv0) {
+  const char* dirs = getenv("PATH");
+  if (strchr(argv0, '/') || !dirs)
+    return argv0;
+  for (const char* p = dirs;; p++) {
+    const char* end = strchrnul(p, ':');
+    string dir(p, end - p);
+    string path = (dir.empty() ? "" : dir + "/") + argv0;
+    if (access(path.c_str(), X_OK) == 0)
+      return path;
+    if (!*end)
+      return argv0;
+    p = end;
+  }
+}
+
+bool PreloadTracer::canTrace(const char* argv0) {
+  string path = findProgram(argv0);
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return true;
+  // Scripts run an interpreter, which is usually dynamically linked.
+  unsigned char ident[EI_NIDENT];
+  bool r = true;
+  if (pread(fd, ident, sizeof(ident), 0) == sizeof(ident) &&
+      !memcmp(ident, ELFMAG, SELFMAG)) {
+    if (ident[EI_CLASS] == ELFCLASS64)
+      r = hasInterpreter<Elf64_Ehdr, Elf64_Phdr>(fd);
+    else
+      r = hasInterpreter<Elf32_Ehdr, Elf32_Phdr>(fd);
+  }
+  close(fd);
+  return r;
+}
+
+static string getPreloadLibraryPath() {
+  char buf[PATH_MAX + 1];
+  ssize_t size = readlink("/proc/self/exe", buf, PATH_MAX);
+  PCHECK(size > 0);
+  string path(buf, size);
+  path.resize(path.rfind('/') + 1);
+  return path + "libkatd_preload.so";
+}
+
+static void handleChild(int) {
+}
+
+void PreloadTracer::run() {
+  string lib = getPreloadLibraryPath();
+  PCHECK(access(lib.c_str(), R_OK) == 0);
+  struct stat st;
+  const char* dir =
+      stat("/dev/shm", &st) == 0 && S_ISDIR(st.st_mode) ? "/dev/shm" : "/tmp";
+  char ring_path[PATH_MAX];
+  snprintf(ring_path, sizeof(ring_path), "%s/katd-%d", dir, getpid());
+  ring_.create(ring_path, kRingCapacity);
+
+  // Without SA_RESTART, SIGCHLD wakes up the ring wait.
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = &handleChild;
+  PCHECK(sigaction(SIGCHLD, &sa, NULL) == 0);
+
+  const char* preload = getenv("LD_PRELOAD");
+  if (preload && *preload)
+    lib += ":" + string(preload);
+
+  int pid = fork();
+  PCHECK(pid >= 0);
+  if (pid == 0) {
+    PCHECK(setenv("LD_PRELOAD", lib.c_str(), 1) == 0);
+    PCHECK(setenv(KATD_PRELOAD_RING_ENV, ring_path, 1) == 0);
+    execvp(argv_[0], argv_);
+    fprintf(stderr, "failed to start %s: %s\n", argv_[0], strerror(errno));
+    _exit(127);
+  }
+
+  // The command reports its own start with PRELOAD_EXEC_DONE.
+  string program = findProgram(argv_[0]);
+  if (program[0] != '/') {
+    char cwd[PATH_MAX + 1];
+    PCHECK(getcwd(cwd, PATH_MAX + 1));
+    program = string(cwd) + "/" + program;
+  }
+  bool inserted;
+  *pending_execs_.insert(pid, &inserted) = internPath(program.c_str());
+  procs_.insert(pid, &inserted);
+
+  // Descendants which outlive the command are not waited for.
+  bool exited = false;
+  for (;;) {
+    PreloadRecord* record = ring_.front();
+    for (int i = 0; !record && i < kSpinCount; i++) {
+      this_thread::yield();
+      record = ring_.front();
+    }
+    if (record) {
+      handleRecord(*record);
+      ring_.pop();
+      continue;
+    }
+    if (ring_.skipAbandoned())
+      continue;
+    if (exited)
+      break;
+    int status;
+    if (waitpid(pid, &status, WNOHANG) == pid) {
+      // Drain the records written before the exit.
+      exited = true;
+      continue;
+    }
+    ring_.wait(kWaitTimeoutMs);
+  }
+
+  unlink(ring_path);
+  for (size_t i = 0; i < handlers_.size(); i++)
+    handlers_[i]->flush();
+}
+
+void PreloadTracer::handleRecord(const PreloadRecord& record) {
+  Event ev;
+  ev.pid = record.pid;
+  ev.syscall = static_cast<Syscall>(record.syscall);
+  ev.type = static_cast<EventType>(record.type);
+  ev.error = record.error;
+
+  switch (record.kind) {
+  case PRELOAD_EXEC: {
+    bool inserted;
+    *pending_execs_.insert(record.pid, &inserted) = internPath(record.path());
+    return;
+  }
+
+  case PRELOAD_EXEC_DONE: {
+    args_.clear();
+    const char* p = record.path();
+    const char* end = p + record.error;
+    while (p < end) {
+      args_.push_back(p);
+      p += args_.back().size() + 1;
+    }
+    PathId* path = pending_execs_.find(record.pid);
+    // Not exec'd by a traced program.
+    if (path) {
+      ev.path_id = *path;
+      ev.error = 0;
+      pending_execs_.erase(record.pid);
+      sendEvent(ev);
+    }
+    for (size_t i = 0; i < handlers_.size(); i++)
+      handlers_[i]->handleExec(record.pid, args_);
+    return;
+  }
+
+  case PRELOAD_EXIT:
+    procs_.erase(record.pid);
+    for (size_t i = 0; i < handlers_.size(); i++)
+      handlers_[i]->handleExit(record.pid);
+    return;
+
+  case PRELOAD_FORK: {
+    // Also sent after each exec of a process we know.
+    bool inserted;
+    procs_.insert(record.pid, &inserted);
+    if (inserted) {
+      for (size_t i = 0; i < handlers_.size(); i++)
+        handlers_[i]->handleFork(record.error, record.pid);
+    }
+    return;
+  }
+
+  case PRELOAD_EVENT:
+    ev.path_id = internPath(record.path());
+    if (ev.syscall == SYSCALL_EXECVE && ev.error)
+      pending_execs_.erase(record.pid);
+    break;
+
+  default:
+    CHECK(false);
+  }
+
+  if (ev.error)
+    ev.type = getFailureType(ev.type);
+  sendEvent(ev);
+
+  if (resolver_ && !ev.error) {
+    switch (ev.syscall) {
+    case SYSCALL_RENAME:
+    case SYSCALL_RENAMEAT:
+    case SYSCALL_RENAMEAT2:
+    case SYSCALL_RMDIR:
+    case SYSCALL_SYMLINK:
+    case SYSCALL_SYMLINKAT:
+    case SYSCALL_UNLINK:
+    case SYSCALL_UNLINKAT:
+      // Cached directories may be replaced.
+      resolver_->invalidate();
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+void PreloadTracer::sendEvent(const Event& event) {
+  if (filter_ && !filter_->matches(event))
+    return;
+  for (size_t i = 0; i < handlers_.size(); i++)
+    handlers_[i]->handleEvent(event);
+}
+
+PathId PreloadTracer::internPath(const char* path) {
+  path_buf_ = path;
+  path_buf_.resize(normalizePath(&path_buf_[0], path_buf_.size()));
+  if (resolver_)
+    return resolver_->resolve(path_buf_.data(), path_buf_.size());
+  return paths_->intern(path_buf_);
+}
+
+}  // namespace katd
@@ -0,0 +1,66 @@
+#ifndef KATD_PRELOAD_TRACER_H_
+#define KATD_PRELOAD_TRACER_H_
+
+#include <string>
+#include <vector>
+
+#include "path_table.h"
+#include "pid_table.h"
+#include "preload_ring.h"
+
+namespace katd {
+
+struct Event;
+class EventFilter;
+class Handler;
+class SymlinkResolver;
+
+// Runs a command with libkatd_preload.so, which reports the libc calls
+// of the command and its descendants through a shared ring. There are
+// no ptrace stops, but statically linked programs and syscalls made
+// without libc are not seen. Use Tracer for them.
+class PreloadTracer {
+public:
+  explicit PreloadTracer(char** argv);
+  ~PreloadTracer();
+
+  void addHandler(Handler* handler);
+  // Runs the command until it exits.
+  void run();
+
+  // Resolves symlinks in the directories of paths.
+  void set_resolve_symlinks(bool r);
+  // Reports only the events which pass |filter|. The preloaded library
+  // still reports all of them to katd.
+  void set_filter(const EventFilter& filter);
+
+  // The number of records the traced processes dropped since the ring
+  // was full.
+  uint64_t dropped() const { return ring_.dropped(); }
+
+  // Returns false if |argv0| is a statically linked executable, which
+  // libkatd_preload.so cannot be loaded into.
+  static bool canTrace(const char* argv0);
+
+private:
+  void handleRecord(const PreloadRecord& record);
+  void sendEvent(const Event& event);
+  PathId internPath(const char* path);
+
+  char** argv_;
+  std::vector<Handler*> handlers_;
+  PathTable* paths_;
+  SymlinkResolver* resolver_;
+  EventFilter* filter_;
+  PreloadRing ring_;
+  // The programs processes are about to exec.
+  PidTable<PathId> pending_execs_;
+  // The processes handleFork was called for, and the command.
+  PidTable<bool> procs_;
+  std::string path_buf_;
+  std::vector<std::string> args_;
+};
+
+}  // namespace katd
+
+#endif  // KATD_PRELOAD_TRACER_H_
@@ -0,0 +1,81 @@
+#ifndef KATD_SPSC_RING_H_
+#define KATD_SPSC_RING_H_
+
+#include <stddef.h>
+
+#include <atomic>
+#include <vector>
+
+namespace katd {
+
+// A bounded lock-free ring buffer for a single producer thread and a
+// single consumer thread. Slots are reused in place, so members like the
+// argument vector of AsyncHandler's items keep their buffers and pushing
+// usually does not allocate.
+template <typename T>
+class SpscRing {
+public:
+  // |capacity| must be a power of two.
+  explicit SpscRing(size_t capacity)
+    : slots_(capacity),
+      mask_(capacity - 1),
+      head_(0),
+      cached_tail_(0),
+      tail_(0),
+      cached_head_(0) {
+  }
+
+  // Producer side. Returns a slot to fill, or NULL if the ring is full.
+  // The slot is published by |push|.
+  T* back() {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - cached_head_ > mask_) {
+      cached_head_ = head_.load(std::memory_order_acquire);
+      if (tail - cached_head_ > mask_)
+        return NULL;
+    }
+    return &slots_[tail & mask_];
+  }
+
+  void push() {
+    tail_.store(tail_.load(std::memory_order_relaxed) + 1,
+                std::memory_order_release);
+  }
+
+  // Consumer side. Returns the oldest element, or NULL if the ring is
+  // empty. The slot is released by |pop|.
+  T* front() {
+    size_t head = head_.load(std::memory_order_relaxed);
+    if (head == cached_tail_) {
+      cached_tail_ = tail_.load(std::memory_order_acquire);
+      if (head == cached_tail_)
+        return NULL;
+    }
+    return &slots_[head & mask_];
+  }
+
+  void pop() {
+    head_.store(head_.load(std::memory_order_relaxed) + 1,
+                std::memory_order_release);
+  }
+
+  // Can be called from either side.
+  bool empty() const {
+    return head_.load(std::memory_order_acquire) ==
+        tail_.load(std::memory_order_acquire);
+  }
+
+private:
+  std::vector<T> slots_;
+  const size_t mask_;
+  // The indices are on separate cache lines with the copy of the other
+  // side's index each side caches.
+  alignas(64) std::atomic<size_t> head_;
+  size_t cached_tail_;
+  alignas(64) std::atomic<size_t> tail_;
+  size_t cached_head_;
+};
+
+}  // namespace katd
+
+#endif  // KATD_SPSC_RING_H_
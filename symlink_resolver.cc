@@ -0,0 +1,116 @@
+#include "symlink_resolver.h"
+
+#include <limits.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "path_util.h"
+
+using namespace std;
+
+namespace katd {
+
+// Same as the kernel's limit of nested symlinks.
+static const int kMaxSymlinkDepth = 40;
+
+// A generation which never matches, for entries not resolved yet.
+static const uint32_t kInvalidGeneration = 0;
+
+SymlinkResolver::DirEntry::DirEntry()
+  : resolved(PathTable::kEmptyPathId),
+    generation(kInvalidGeneration),
+    dev(0),
+    ino(0) {
+}
+
+SymlinkResolver::SymlinkResolver(PathTable* paths)
+  : paths_(paths),
+    generation_(kInvalidGeneration + 1) {
+}
+
+PathId SymlinkResolver::resolve(const char* path, size_t size) {
+  if (size == 0 || path[0] != '/')
+    return paths_->intern(path, size);
+  const char* slash = static_cast<const char*>(memrchr(path, '/', size));
+  size_t dir_size = slash - path;
+  if (dir_size == 0)
+    return paths_->intern(path, size);
+
+  PathId dir = resolveDir(path, dir_size, 0);
+  return resolveChild(dir, slash + 1, size - dir_size - 1, -1);
+}
+
+// Resolves "/a/b" of "/a/b/c". Returns the resolved directory.
+PathId SymlinkResolver::resolveDir(const char* dir, size_t size,
+                                   int depth) {
+  PathId lexical = paths_->intern(dir, size);
+  DirEntry* entry = findEntry(lexical);
+  if (entry->generation == generation_)
+    return entry->resolved;
+
+  if (entry->generation != kInvalidGeneration) {
+    // Cached before the namespace may have changed.
+    struct stat st;
+    bool exists = lstat(paths_->str(lexical), &st) == 0;
+    if (exists ? st.st_dev == entry->dev && st.st_ino == entry->ino :
+        entry->ino == 0) {
+      entry->generation = generation_;
+      return entry->resolved;
+    }
+  }
+
+  const char* slash = static_cast<const char*>(memrchr(dir, '/', size));
+  PathId parent = slash == dir ?
+      paths_->intern("/", 1) : resolveDir(dir, slash - dir, depth);
+  PathId resolved = resolveChild(parent, slash + 1, size - (slash - dir) - 1,
+                                 depth);
+
+  // |entry| may be moved by the recursion.
+  // Cache missing directories too, with zero inode numbers.
+  entry = findEntry(lexical);
+  struct stat st;
+  if (lstat(paths_->str(lexical), &st) != 0) {
+    st.st_dev = 0;
+    st.st_ino = 0;
+  }
+  entry->resolved = resolved;
+  entry->generation = generation_;
+  entry->dev = st.st_dev;
+  entry->ino = st.st_ino;
+  return resolved;
+}
+
+// Returns |dir|/|name|, following it if it is a symlink and |depth| is
+// not negative.
+PathId SymlinkResolver::resolveChild(PathId dir, const char* name,
+                                     size_t size, int depth) {
+  string path(paths_->str(dir), paths_->size(dir));
+  if (path.size() > 1)
+    path += '/';
+  path.append(name, size);
+  if (depth < 0 || depth >= kMaxSymlinkDepth)
+    return paths_->intern(path);
+
+  char target[PATH_MAX];
+  ssize_t len = readlink(path.c_str(), target, sizeof(target));
+  if (len <= 0 || static_cast<size_t>(len) == sizeof(target))
+    return paths_->intern(path);
+
+  string resolved;
+  if (target[0] != '/')
+    resolved.assign(paths_->str(dir), paths_->size(dir)) += '/';
+  resolved.append(target, len);
+  resolved.resize(normalizePath(&resolved[0], resolved.size()));
+  if (resolved.size() == 1)
+    return paths_->intern(resolved);
+  return resolveDir(resolved.data(), resolved.size(), depth + 1);
+}
+
+SymlinkResolver::DirEntry* SymlinkResolver::findEntry(PathId lexical) {
+  if (lexical >= dirs_.size())
+    dirs_.resize(lexical + 1);
+  return &dirs_[lexical];
+}
+
+}  // namespace katd
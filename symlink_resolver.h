@@ -0,0 +1,53 @@
+#ifndef KATD_SYMLINK_RESOLVER_H_
+#define KATD_SYMLINK_RESOLVER_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <string>
+#include <vector>
+
+#include "path_table.h"
+
+namespace katd {
+
+// Resolves symlinks in the directory part of normalized absolute paths,
+// using katd's view of the file system. The last component is kept as
+// is, since syscalls like lstat and unlink do not follow it.
+//
+// Resolved directories are cached by their lexical PathId, so readlink
+// runs once per directory instead of once per event. The tracer calls
+// |invalidate| when a traced process may have changed the namespace;
+// entries cached before that are validated with a single lstat which
+// compares the device and inode numbers.
+class SymlinkResolver {
+public:
+  explicit SymlinkResolver(PathTable* paths);
+
+  PathId resolve(const char* path, size_t size);
+  void invalidate() { generation_++; }
+
+private:
+  struct DirEntry {
+    DirEntry();
+
+    PathId resolved;
+    uint32_t generation;
+    dev_t dev;
+    ino_t ino;
+  };
+
+  PathId resolveDir(const char* dir, size_t size, int depth);
+  PathId resolveChild(PathId dir, const char* name, size_t size,
+                      int depth);
+  DirEntry* findEntry(PathId lexical);
+
+  PathTable* paths_;
+  // Indexed by the lexical PathId of directories.
+  std::vector<DirEntry> dirs_;
+  uint32_t generation_;
+};
+
+}  // namespace katd
+
+#endif  // KATD_SYMLINK_RESOLVER_H_
@@ -1,12 +1,21 @@
 #include "syscalls.h"
 
-#include <assert.h>
+#include "event.h"
 
 namespace katd {
 
 static const char* SYSCALL_NAMES[] = {
   "???",
-#define DEFINE_SYSCALL(x, p) #x,
+#define DEFINE_SYSCALL(x, path, at_fd, flags, path2, at_fd2, type) #x,
+#include "syscalls.tab"
+#undef DEFINE_SYSCALL
+};
+
+// Indexed by Syscall, so decoding a syscall is a single load.
+static const SyscallTraits SYSCALL_TRAITS[] = {
+  { -1, -1, -1, -1, -1, INVALID_EVENT_TYPE },
+#define DEFINE_SYSCALL(x, path, at_fd, flags, path2, at_fd2, type) \
+  { path, at_fd, flags, path2, at_fd2, type },
 #include "syscalls.tab"
 #undef DEFINE_SYSCALL
 };
@@ -15,16 +24,8 @@ const char* getSyscallName(Syscall s) {
   return SYSCALL_NAMES[s];
 }
 
-int getPathArgIndex(Syscall s) {
-  switch (s) {
-  case UNINTERESTING_SYSCALL:
-    return -1;
-#define DEFINE_SYSCALL(x, p) case SYSCALL_ ## x: return p;
-#include "syscalls.tab"
-#undef DEFINE_SYSCALL
-  default:
-    assert(0);
-  }
+const SyscallTraits& getSyscallTraits(Syscall s) {
+  return SYSCALL_TRAITS[s];
 }
 
 }  // namespace katd
@@ -5,15 +5,14 @@ namespace katd {
 
 enum Syscall {
   UNINTERESTING_SYSCALL,
-#define DEFINE_SYSCALL(x, p) SYSCALL_ ## x,
+#define DEFINE_SYSCALL(x, path, at_fd, flags, path2, at_fd2, type) SYSCALL_ ## x,
 #include "syscalls.tab"
 #undef DEFINE_SYSCALL
+  NUM_SYSCALLS
 };
 
 const char* getSyscallName(Syscall s);
 
-int getPathArgIndex(Syscall s);
-
 }  // namespace katd
 
 #endif  // KATD_SYSCALLS_H_
@@ -0,0 +1,323 @@
+#include "timeline_handler.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/wait.h>
+
+#include <algorithm>
+#include <utility>
+
+using namespace std;
+
+namespace katd {
+
+// The row of the critical path, above any pid.
+static const int kCriticalPathTid = 0x7fffffff;
+
+TimelineHandler::Process::Process()
+  : pid(0),
+    parent(kNoProcess),
+    has_times(false),
+    times(),
+    reads(0),
+    writes(0),
+    stats(0),
+    failures(0),
+    critical(false),
+    critical_ns(0) {
+}
+
+TimelineHandler::TimelineHandler()
+  : fp_(NULL),
+    origin_ns_(0) {
+}
+
+// Returns the process which has |pid| now, starting one if there is
+// none.
+size_t TimelineHandler::getProcess(int pid) {
+  size_t* pr = current_.find(pid);
+  if (pr)
+    return *pr;
+  return startProcess(pid, kNoProcess);
+}
+
+size_t TimelineHandler::startProcess(int pid, size_t parent) {
+  procs_.push_back(Process());
+  size_t pr = procs_.size() - 1;
+  procs_[pr].pid = pid;
+  procs_[pr].parent = parent;
+  if (parent != kNoProcess) {
+    procs_[parent].children.push_back(pr);
+    // It runs the program of its parent until it execs.
+    procs_[pr].args = procs_[parent].args;
+  }
+  bool inserted;
+  *current_.insert(pid, &inserted) = pr;
+  return pr;
+}
+
+void TimelineHandler::handleEvent(const Event& event) {
+  Process* proc = &procs_[getProcess(event.pid)];
+  switch (event.type) {
+  case READ_CONTENT:
+    proc->reads++;
+    break;
+  case WRITE_CONTENT:
+  case REMOVE_CONTENT:
+  case WRITE_METADATA:
+    proc->writes++;
+    break;
+  case READ_METADATA:
+    proc->stats++;
+    break;
+  case READ_FAILURE:
+  case WRITE_FAILURE:
+    proc->failures++;
+    break;
+  default:
+    break;
+  }
+}
+
+void TimelineHandler::handleFork(int parent_pid, int pid) {
+  startProcess(pid, getProcess(parent_pid));
+}
+
+void TimelineHandler::handleExec(int pid, const vector<string>& args) {
+  procs_[getProcess(pid)].args = args;
+}
+
+void TimelineHandler::handleProcessTimes(int pid, const ProcessTimes& times) {
+  Process* proc = &procs_[getProcess(pid)];
+  proc->has_times = true;
+  proc->times = times;
+}
+
+void TimelineHandler::handleExit(int pid) {
+  current_.erase(pid);
+}
+
+void TimelineHandler::flush() {
+  origin_ns_ = ~static_cast<uint64_t>(0);
+  for (size_t i = 0; i < procs_.size(); i++) {
+    if (procs_[i].has_times)
+      origin_ns_ = min(origin_ns_, procs_[i].times.start_ns);
+  }
+  findCriticalPath();
+  if (fp_) {
+    writeTimeline();
+    fflush(fp_);
+  }
+}
+
+void TimelineHandler::findCriticalPath() {
+  critical_path_.clear();
+  // Starts from the process which exited last among those katd did not
+  // see start, i.e. the command or the attached processes.
+  size_t last = kNoProcess;
+  for (size_t i = 0; i < procs_.size(); i++) {
+    const Process& p = procs_[i];
+    if (p.parent != kNoProcess || !p.has_times)
+      continue;
+    if (last == kNoProcess || p.times.exit_ns > procs_[last].times.exit_ns)
+      last = i;
+  }
+  if (last == kNoProcess)
+    return;
+  addCriticalPath(last, procs_[last].times.exit_ns);
+  // Collected from the end.
+  reverse(critical_path_.begin(), critical_path_.end());
+}
+
+// Adds the critical path of |pr| which ends at |end_ns|, the latest
+// first.
+void TimelineHandler::addCriticalPath(size_t pr, uint64_t end_ns) {
+  procs_[pr].critical = true;
+  // By exit, the last first. A child reaped by another tracer thread
+  // may be seen to exit after its parent, so it is taken to exit by
+  // |end_ns| at the latest.
+  vector<pair<uint64_t, size_t> > children;
+  for (size_t i = 0; i < procs_[pr].children.size(); i++) {
+    size_t child = procs_[pr].children[i];
+    if (!procs_[child].has_times)
+      continue;
+    uint64_t exit_ns = min(procs_[child].times.exit_ns, end_ns);
+    children.push_back(make_pair(exit_ns, child));
+  }
+  sort(children.rbegin(), children.rend());
+
+  uint64_t t = end_ns;
+  for (size_t i = 0; i < children.size(); i++) {
+    uint64_t exit_ns = children[i].first;
+    size_t child = children[i].second;
+    // Children which exit after |t| ran beside the path.
+    if (exit_ns > t)
+      continue;
+    Segment s = { pr, exit_ns, t };
+    critical_path_.push_back(s);
+    procs_[pr].critical_ns += t - exit_ns;
+    addCriticalPath(child, exit_ns);
+    t = procs_[child].times.start_ns;
+  }
+  uint64_t start_ns = min(procs_[pr].times.start_ns, t);
+  Segment s = { pr, start_ns, t };
+  critical_path_.push_back(s);
+  procs_[pr].critical_ns += t - start_ns;
+}
+
+static void writeJsonString(FILE* fp, const char* s, size_t size) {
+  fputc('"', fp);
+  for (size_t i = 0; i < size; i++) {
+    unsigned char c = s[i];
+    if (c == '"' || c == '\\')
+      fprintf(fp, "\\%c", c);
+    else if (c < 0x20)
+      fprintf(fp, "\\u%04x", c);
+    else
+      fputc(c, fp);
+  }
+  fputc('"', fp);
+}
+
+static string joinArgs(const vector<string>& args) {
+  string s;
+  for (size_t i = 0; i < args.size(); i++) {
+    if (i)
+      s += ' ';
+    s += args[i];
+  }
+  return s;
+}
+
+// Writes the basename of the program, e.g. "cc1plus".
+void TimelineHandler::writeName(size_t pr) {
+  const Process& p = procs_[pr];
+  if (p.args.empty()) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "pid %d", p.pid);
+    writeJsonString(fp_, buf, strlen(buf));
+    return;
+  }
+  const string& arg0 = p.args[0];
+  size_t slash = arg0.rfind('/');
+  size_t begin = slash == string::npos ? 0 : slash + 1;
+  writeJsonString(fp_, arg0.data() + begin, arg0.size() - begin);
+}
+
+// Writes a complete event in microseconds from the first start.
+void TimelineHandler::writeEvent(size_t pr, int tid,
+                                 uint64_t begin_ns, uint64_t end_ns) {
+  fputs(",\n{\"name\":", fp_);
+  writeName(pr);
+  fprintf(fp_, ",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,"
+          "\"dur\":%.3f", procs_[0].pid, tid,
+          (begin_ns - origin_ns_) / 1e3, (end_ns - begin_ns) / 1e3);
+}
+
+void TimelineHandler::writeTimeline() {
+  // Every process is a thread of the first one in the viewers, so each
+  // pid is a row. Rows are in the order of a depth-first walk of the
+  // tree, which puts children under their parents.
+  int root_pid = procs_.empty() ? 0 : procs_[0].pid;
+  fprintf(fp_, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+          "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+          "\"args\":{\"name\":\"katd\"}}", root_pid);
+  fprintf(fp_, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+          "\"tid\":%d,\"args\":{\"name\":\"critical path\"}}",
+          root_pid, kCriticalPathTid);
+  fprintf(fp_, ",\n{\"name\":\"thread_sort_index\",\"ph\":\"M\","
+          "\"pid\":%d,\"tid\":%d,\"args\":{\"sort_index\":-1}}",
+          root_pid, kCriticalPathTid);
+
+  PidTable<bool> named;
+  int sort_index = 0;
+  vector<size_t> stack;
+  for (size_t i = procs_.size(); i > 0; i--) {
+    if (procs_[i - 1].parent == kNoProcess)
+      stack.push_back(i - 1);
+  }
+  while (!stack.empty()) {
+    size_t pr = stack.back();
+    stack.pop_back();
+    const Process& p = procs_[pr];
+    // Pushed in reverse, so they are walked in the order they started.
+    for (size_t i = p.children.size(); i > 0; i--)
+      stack.push_back(p.children[i - 1]);
+    if (!p.has_times)
+      continue;
+
+    // A reused pid shares the row of the first process which had it.
+    bool inserted;
+    named.insert(p.pid, &inserted);
+    if (inserted) {
+      fprintf(fp_, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+              "\"tid\":%d,\"args\":{\"name\":", root_pid, p.pid);
+      writeName(pr);
+      fprintf(fp_, "}},\n{\"name\":\"thread_sort_index\",\"ph\":\"M\","
+              "\"pid\":%d,\"tid\":%d,\"args\":{\"sort_index\":%d}}",
+              root_pid, p.pid, sort_index++);
+    }
+
+    const ProcessTimes& t = p.times;
+    writeEvent(pr, p.pid, t.start_ns, t.exit_ns);
+    fputs(",\"args\":{\"argv\":", fp_);
+    string args = joinArgs(p.args);
+    writeJsonString(fp_, args.data(), args.size());
+    fprintf(fp_, ",\"pid\":%d", p.pid);
+    if (p.parent != kNoProcess)
+      fprintf(fp_, ",\"parent\":%d", procs_[p.parent].pid);
+    if (WIFEXITED(t.status))
+      fprintf(fp_, ",\"exit\":%d", WEXITSTATUS(t.status));
+    else if (WIFSIGNALED(t.status))
+      fprintf(fp_, ",\"signal\":%d", WTERMSIG(t.status));
+    fprintf(fp_, ",\"user_ms\":%.3f,\"sys_ms\":%.3f,\"max_rss_kb\":%lld,"
+            "\"reads\":%llu,\"writes\":%llu,\"stats\":%llu,"
+            "\"failures\":%llu",
+            t.user_ns / 1e6, t.sys_ns / 1e6,
+            static_cast<long long>(t.max_rss_kb),
+            static_cast<unsigned long long>(p.reads),
+            static_cast<unsigned long long>(p.writes),
+            static_cast<unsigned long long>(p.stats),
+            static_cast<unsigned long long>(p.failures));
+    if (p.critical)
+      fprintf(fp_, ",\"critical_ms\":%.3f", p.critical_ns / 1e6);
+    fputs("}}", fp_);
+  }
+
+  for (size_t i = 0; i < critical_path_.size(); i++) {
+    const Segment& s = critical_path_[i];
+    if (s.end_ns == s.begin_ns)
+      continue;
+    writeEvent(s.proc, kCriticalPathTid, s.begin_ns, s.end_ns);
+    fprintf(fp_, ",\"args\":{\"pid\":%d}}", procs_[s.proc].pid);
+  }
+  fputs("\n]}\n", fp_);
+}
+
+void TimelineHandler::printCriticalPath(FILE* fp) const {
+  if (critical_path_.empty())
+    return;
+  uint64_t begin_ns = critical_path_.front().begin_ns;
+  uint64_t end_ns = critical_path_.back().end_ns;
+  fprintf(fp, "critical path: %.3fs\n", (end_ns - begin_ns) / 1e9);
+  fprintf(fp, "%9s %9s %7s %6s %6s %6s  %s\n",
+          "own", "wall", "pid", "reads", "writes", "stats", "argv");
+  // Processes are in the order they started.
+  for (size_t i = 0; i < procs_.size(); i++) {
+    const Process& p = procs_[i];
+    if (!p.critical)
+      continue;
+    int depth = 0;
+    for (size_t pr = p.parent; pr != kNoProcess; pr = procs_[pr].parent)
+      depth++;
+    fprintf(fp, "%8.3fs %8.3fs %7d %6llu %6llu %6llu  %*s%s\n",
+            p.critical_ns / 1e9,
+            (p.times.exit_ns - p.times.start_ns) / 1e9, p.pid,
+            static_cast<unsigned long long>(p.reads),
+            static_cast<unsigned long long>(p.writes),
+            static_cast<unsigned long long>(p.stats),
+            depth * 2, "", joinArgs(p.args).c_str());
+  }
+}
+
+}  // namespace katd
@@ -0,0 +1,95 @@
+#ifndef KATD_TIMELINE_HANDLER_H_
+#define KATD_TIMELINE_HANDLER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+
+#include "event.h"
+#include "handler.h"
+#include "pid_table.h"
+
+namespace katd {
+
+// Collects the process tree of a run with the times, arguments and
+// numbers of file events of each process, and writes it at flush as a
+// timeline in the Chrome trace event format, which Perfetto and
+// chrome://tracing show. Needs Tracer::set_process_times. Processes
+// without times, e.g. ones still running when katd detached, are left
+// out.
+//
+// The critical path is the chain of processes which kept the run from
+// finishing earlier. Going back from the exit of a process, it follows
+// the child which exited last, then from the start of that child the
+// child which exited last before it, and so on. The time between is the
+// process's own. This is how a build tool waits for the steps a step
+// depends on, e.g. a link for its compiles.
+class TimelineHandler : public Handler {
+public:
+  TimelineHandler();
+
+  virtual void handleEvent(const Event& event);
+  virtual void handleFork(int parent_pid, int pid);
+  virtual void handleExec(int pid, const std::vector<std::string>& args);
+  virtual void handleProcessTimes(int pid, const ProcessTimes& times);
+  virtual void handleExit(int pid);
+  // Finds the critical path and writes the timeline.
+  virtual void flush();
+
+  void set_output(FILE* fp) { fp_ = fp; }
+
+  // Prints the processes on the critical path in the order they
+  // started, indented by depth, after flush.
+  void printCriticalPath(FILE* fp) const;
+
+private:
+  static const size_t kNoProcess = ~static_cast<size_t>(0);
+
+  struct Process {
+    Process();
+    int pid;
+    size_t parent;
+    std::vector<size_t> children;
+    std::vector<std::string> args;
+    bool has_times;
+    ProcessTimes times;
+    // Numbers of events. Writes include remove and write_metadata, and
+    // stats are read_metadata.
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t stats;
+    uint64_t failures;
+    bool critical;
+    // The process's own time on the critical path.
+    uint64_t critical_ns;
+  };
+
+  // A stretch of the critical path, in the process's own time.
+  struct Segment {
+    size_t proc;
+    uint64_t begin_ns;
+    uint64_t end_ns;
+  };
+
+  size_t getProcess(int pid);
+  size_t startProcess(int pid, size_t parent);
+  void findCriticalPath();
+  void addCriticalPath(size_t pr, uint64_t end_ns);
+  void writeTimeline();
+  void writeName(size_t pr);
+  void writeEvent(size_t pr, int tid, uint64_t begin_ns, uint64_t end_ns);
+
+  FILE* fp_;
+  std::vector<Process> procs_;
+  // The process which has each pid now.
+  PidTable<size_t> current_;
+  std::vector<Segment> critical_path_;
+  uint64_t origin_ns_;
+};
+
+}  // namespace katd
+
+#endif  // KATD_TIMELINE_HANDLER_H_
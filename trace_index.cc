@@ -0,0 +1,485 @@
+#include "trace_index.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "binary_trace.h"
+#include "event.h"
+#include "handler.h"
+#include "log.h"
+#include "path_table.h"
+#include "pid_table.h"
+
+using namespace std;
+
+namespace katd {
+
+const char kTraceIndexMagic[8] = { 'K', 'A', 'T', 'D', 'I', 'D', 'X', '1' };
+
+static const size_t kElementSizes[NUM_INDEX_SECTIONS] = {
+  8, 4, 4, 4, 2, 2, 1,
+  8, 1, 8, 4,
+  4, 4, 8, 4, 8, 4, 8, 1,
+};
+
+// Splits the events of a trace into processes as BinaryTraceReader
+// replays its process records. Both passes of writeTraceIndex see the
+// same processes in the same order.
+class ProcessSplitter : public Handler {
+public:
+  struct Process {
+    int pid;
+    uint32_t parent;
+    uint64_t num_events;
+    vector<string> args;
+  };
+
+  explicit ProcessSplitter(bool keep_args)
+    : keep_args_(keep_args) {
+  }
+
+  virtual void handleEvent(const Event& /*event*/) {}
+
+  virtual void handleFork(int parent_pid, int pid) {
+    uint32_t parent = getProcess(parent_pid);
+    // Starts a new process even if the exit of the old one is missing.
+    start(pid, parent);
+  }
+
+  virtual void handleExec(int pid, const vector<string>& args) {
+    uint32_t pr = getProcess(pid);
+    if (keep_args_)
+      processes_[pr].args = args;
+  }
+
+  virtual void handleExit(int pid) {
+    current_.erase(pid);
+  }
+
+  // Returns the process which has |pid| now, starting one if there is
+  // none.
+  uint32_t getProcess(int pid) {
+    uint32_t* pr = current_.find(pid);
+    if (pr)
+      return *pr;
+    return start(pid, TraceIndex::kNoProcess);
+  }
+
+  vector<Process>* processes() { return &processes_; }
+
+private:
+  uint32_t start(int pid, uint32_t parent) {
+    Process p;
+    p.pid = pid;
+    p.parent = parent;
+    p.num_events = 0;
+    processes_.push_back(p);
+    bool inserted;
+    *current_.insert(pid, &inserted) = processes_.size() - 1;
+    return processes_.size() - 1;
+  }
+
+  bool keep_args_;
+  vector<Process> processes_;
+  PidTable<uint32_t> current_;
+};
+
+static bool comparePathIds(PathId a, PathId b) {
+  const PathTable* paths = PathTable::global();
+  size_t a_size = paths->size(a);
+  size_t b_size = paths->size(b);
+  int r = memcmp(paths->str(a), paths->str(b), min(a_size, b_size));
+  return r ? r < 0 : a_size < b_size;
+}
+
+// Orders processes by pid and then by start.
+struct ProcessOrder {
+  explicit ProcessOrder(const vector<ProcessSplitter::Process>& procs)
+    : procs(procs) {
+  }
+  bool operator()(uint32_t a, uint32_t b) const {
+    if (procs[a].pid != procs[b].pid)
+      return procs[a].pid < procs[b].pid;
+    return a < b;
+  }
+  const vector<ProcessSplitter::Process>& procs;
+};
+
+static bool fail(const string& msg, string* err) {
+  *err = msg + ": " + strerror(errno);
+  return false;
+}
+
+bool writeTraceIndex(const char* trace, const char* index, string* err) {
+  PathTable* paths = PathTable::global();
+
+  // Counts the events of each path and process.
+  ProcessSplitter splitter(true);
+  vector<uint64_t> path_counts;
+  uint64_t num_events = 0;
+  {
+    BinaryTraceReader reader;
+    if (!reader.open(trace))
+      return fail(trace, err);
+    reader.set_handler(&splitter);
+    Event ev;
+    while (reader.next(&ev)) {
+      num_events++;
+      if (ev.path_id >= path_counts.size())
+        path_counts.resize(ev.path_id + 1);
+      path_counts[ev.path_id]++;
+      (*splitter.processes())[splitter.getProcess(ev.pid)].num_events++;
+    }
+    if (reader.truncated()) {
+      fprintf(stderr, "%s: truncated at offset %zu, indexing the events "
+              "before it\n", trace, reader.offset());
+    }
+  }
+  // Event numbers in the index are 32bit.
+  if (num_events > UINT32_MAX) {
+    *err = string(trace) + ": too many events";
+    return false;
+  }
+
+  vector<PathId> sorted_paths;
+  for (size_t i = 0; i < path_counts.size(); i++) {
+    if (path_counts[i])
+      sorted_paths.push_back(i);
+  }
+  sort(sorted_paths.begin(), sorted_paths.end(), comparePathIds);
+  // Index path ids by PathId.
+  vector<uint32_t> path_ids(path_counts.size());
+  uint64_t path_data_size = 0;
+  for (size_t i = 0; i < sorted_paths.size(); i++) {
+    path_ids[sorted_paths[i]] = i;
+    path_data_size += paths->size(sorted_paths[i]) + 1;
+  }
+
+  const vector<ProcessSplitter::Process>& procs = *splitter.processes();
+  vector<uint32_t> sorted_procs(procs.size());
+  for (size_t i = 0; i < procs.size(); i++)
+    sorted_procs[i] = i;
+  sort(sorted_procs.begin(), sorted_procs.end(), ProcessOrder(procs));
+  // Index process ids by the order of start.
+  vector<uint32_t> proc_ids(procs.size());
+  uint64_t args_size = 0;
+  uint64_t num_children = 0;
+  for (size_t i = 0; i < sorted_procs.size(); i++) {
+    const ProcessSplitter::Process& p = procs[sorted_procs[i]];
+    proc_ids[sorted_procs[i]] = i;
+    for (size_t j = 0; j < p.args.size(); j++)
+      args_size += p.args[j].size() + 1;
+    if (p.parent != TraceIndex::kNoProcess)
+      num_children++;
+  }
+
+  uint64_t num_paths = sorted_paths.size();
+  uint64_t num_procs = procs.size();
+  uint64_t counts[NUM_INDEX_SECTIONS] = {
+    num_events, num_events, num_events, num_events, num_events, num_events,
+    num_events,
+    num_paths + 1, path_data_size, num_paths + 1, num_events,
+    num_procs, num_procs, num_procs + 1, num_events, num_procs + 1,
+    num_children, num_procs + 1, args_size,
+  };
+  TraceIndexHeader header;
+  memset(&header, 0, sizeof(header));
+  header.num_events = num_events;
+  header.num_paths = num_paths;
+  header.num_processes = num_procs;
+  uint64_t size = sizeof(header);
+  for (int i = 0; i < NUM_INDEX_SECTIONS; i++) {
+    size = (size + 7) & ~7;
+    header.section_offsets[i] = size;
+    header.section_sizes[i] = counts[i] * kElementSizes[i];
+    size += header.section_sizes[i];
+  }
+
+  int fd = open(index, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  if (fd < 0)
+    return fail(index, err);
+  if (ftruncate(fd, size) < 0) {
+    close(fd);
+    return fail(index, err);
+  }
+  void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED)
+    return fail(index, err);
+  char* data = static_cast<char*>(p);
+  uint64_t* sections[NUM_INDEX_SECTIONS];
+  for (int i = 0; i < NUM_INDEX_SECTIONS; i++) {
+    sections[i] =
+        reinterpret_cast<uint64_t*>(data + header.section_offsets[i]);
+  }
+#define SECTION(type, section) reinterpret_cast<type*>(sections[section])
+
+  uint64_t* path_start = SECTION(uint64_t, INDEX_PATH_START);
+  char* path_data = SECTION(char, INDEX_PATH_DATA);
+  uint64_t* path_events_start = SECTION(uint64_t, INDEX_PATH_EVENTS_START);
+  path_start[0] = 0;
+  path_events_start[0] = 0;
+  for (size_t i = 0; i < sorted_paths.size(); i++) {
+    PathId id = sorted_paths[i];
+    memcpy(path_data + path_start[i], paths->str(id), paths->size(id) + 1);
+    path_start[i + 1] = path_start[i] + paths->size(id) + 1;
+    path_events_start[i + 1] = path_events_start[i] + path_counts[id];
+  }
+
+  int32_t* proc_pid = SECTION(int32_t, INDEX_PROCESS_PID);
+  uint32_t* proc_parent = SECTION(uint32_t, INDEX_PROCESS_PARENT);
+  uint64_t* proc_events_start =
+      SECTION(uint64_t, INDEX_PROCESS_EVENTS_START);
+  uint64_t* children_start = SECTION(uint64_t, INDEX_PROCESS_CHILDREN_START);
+  uint32_t* children = SECTION(uint32_t, INDEX_PROCESS_CHILDREN);
+  uint64_t* args_start = SECTION(uint64_t, INDEX_PROCESS_ARGS_START);
+  char* args = SECTION(char, INDEX_PROCESS_ARGS);
+  vector<uint64_t> child_counts(num_procs + 1);
+  for (size_t i = 0; i < procs.size(); i++) {
+    if (procs[i].parent != TraceIndex::kNoProcess)
+      child_counts[proc_ids[procs[i].parent]]++;
+  }
+  proc_events_start[0] = 0;
+  children_start[0] = 0;
+  args_start[0] = 0;
+  for (size_t i = 0; i < sorted_procs.size(); i++) {
+    const ProcessSplitter::Process& p = procs[sorted_procs[i]];
+    proc_pid[i] = p.pid;
+    proc_parent[i] = p.parent;
+    if (p.parent != TraceIndex::kNoProcess)
+      proc_parent[i] = proc_ids[p.parent];
+    proc_events_start[i + 1] = proc_events_start[i] + p.num_events;
+    children_start[i + 1] = children_start[i] + child_counts[i];
+    uint64_t pos = args_start[i];
+    for (size_t j = 0; j < p.args.size(); j++) {
+      memcpy(args + pos, p.args[j].c_str(), p.args[j].size() + 1);
+      pos += p.args[j].size() + 1;
+    }
+    args_start[i + 1] = pos;
+  }
+  // Children in the order they started.
+  vector<uint64_t> child_pos(children_start, children_start + num_procs);
+  for (size_t i = 0; i < procs.size(); i++) {
+    if (procs[i].parent != TraceIndex::kNoProcess)
+      children[child_pos[proc_ids[procs[i].parent]]++] = proc_ids[i];
+  }
+
+  // Fills the columns and the lists of events.
+  vector<uint64_t> path_pos(path_events_start,
+                            path_events_start + num_paths);
+  vector<uint64_t> proc_pos(proc_events_start,
+                            proc_events_start + num_procs);
+  uint64_t* offsets = SECTION(uint64_t, INDEX_EVENT_OFFSET);
+  uint32_t* event_paths = SECTION(uint32_t, INDEX_EVENT_PATH);
+  uint32_t* event_procs = SECTION(uint32_t, INDEX_EVENT_PROCESS);
+  int32_t* pids = SECTION(int32_t, INDEX_EVENT_PID);
+  uint16_t* syscalls = SECTION(uint16_t, INDEX_EVENT_SYSCALL);
+  uint16_t* errors = SECTION(uint16_t, INDEX_EVENT_ERROR);
+  int8_t* types = SECTION(int8_t, INDEX_EVENT_TYPE);
+  uint32_t* path_events = SECTION(uint32_t, INDEX_PATH_EVENTS);
+  uint32_t* proc_events = SECTION(uint32_t, INDEX_PROCESS_EVENTS);
+#undef SECTION
+  ProcessSplitter splitter2(false);
+  BinaryTraceReader reader;
+  bool ok = reader.open(trace);
+  if (ok) {
+    reader.set_handler(&splitter2);
+    Event ev;
+    for (uint32_t e = 0; e < num_events; e++) {
+      // The trace may not change between the passes.
+      CHECK(reader.next(&ev));
+      // |next| stops right after the event record.
+      offsets[e] = reader.offset() - sizeof(BinaryRecordHeader) -
+          sizeof(BinaryEventRecord);
+      uint32_t path = path_ids[ev.path_id];
+      uint32_t proc = proc_ids[splitter2.getProcess(ev.pid)];
+      event_paths[e] = path;
+      event_procs[e] = proc;
+      pids[e] = ev.pid;
+      syscalls[e] = ev.syscall;
+      errors[e] = ev.error;
+      types[e] = ev.type;
+      path_events[path_pos[path]++] = e;
+      proc_events[proc_pos[proc]++] = e;
+    }
+  }
+
+  // The magic goes last, so an index which was not finished is not
+  // taken for one.
+  if (ok) {
+    memcpy(header.magic, kTraceIndexMagic, sizeof(header.magic));
+    memcpy(data, &header, sizeof(header));
+  }
+  PCHECK(munmap(data, size) == 0);
+  if (!ok)
+    return fail(trace, err);
+  return true;
+}
+
+TraceIndex::TraceIndex()
+  : data_(NULL),
+    size_(0),
+    header_(NULL) {
+}
+
+TraceIndex::~TraceIndex() {
+  if (data_)
+    munmap(const_cast<char*>(data_), size_);
+}
+
+bool TraceIndex::open(const char* filename) {
+  int fd = ::open(filename, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    return false;
+  }
+  if (static_cast<size_t>(st.st_size) < sizeof(TraceIndexHeader)) {
+    close(fd);
+    errno = EINVAL;
+    return false;
+  }
+  size_ = st.st_size;
+  void* p = mmap(NULL, size_, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED)
+    return false;
+  data_ = static_cast<const char*>(p);
+  // Queries touch a few pages here and there.
+  madvise(p, size_, MADV_RANDOM);
+  header_ = reinterpret_cast<const TraceIndexHeader*>(data_);
+  if (memcmp(header_->magic, kTraceIndexMagic, sizeof(kTraceIndexMagic)) ||
+      !checkSections()) {
+    errno = EINVAL;
+    return false;
+  }
+  return true;
+}
+
+// Checks that the sections are in the file and have the sizes of the
+// counts. Entries of the sections are not checked, which would read the
+// whole index.
+bool TraceIndex::checkSections() const {
+  for (int i = 0; i < NUM_INDEX_SECTIONS; i++) {
+    uint64_t offset = header_->section_offsets[i];
+    uint64_t size = header_->section_sizes[i];
+    if (offset % 8 || offset > size_ || size > size_ - offset ||
+        size % kElementSizes[i]) {
+      return false;
+    }
+  }
+
+  uint64_t num_events = header_->num_events;
+  uint64_t num_paths = header_->num_paths;
+  uint64_t num_procs = header_->num_processes;
+  static const TraceIndexSection kEventSections[] = {
+    INDEX_EVENT_OFFSET, INDEX_EVENT_PATH, INDEX_EVENT_PROCESS,
+    INDEX_EVENT_PID, INDEX_EVENT_SYSCALL, INDEX_EVENT_ERROR,
+    INDEX_EVENT_TYPE,
+  };
+  for (size_t i = 0; i < sizeof(kEventSections) / sizeof(kEventSections[0]);
+       i++) {
+    TraceIndexSection s = kEventSections[i];
+    if (header_->section_sizes[s] != num_events * kElementSizes[s])
+      return false;
+  }
+  if (header_->section_sizes[INDEX_PROCESS_PID] != num_procs * 4 ||
+      header_->section_sizes[INDEX_PROCESS_PARENT] != num_procs * 4) {
+    return false;
+  }
+
+  // Each *_START section is followed by the section it indexes.
+  static const TraceIndexSection kStartSections[] = {
+    INDEX_PATH_START, INDEX_PATH_EVENTS_START, INDEX_PROCESS_EVENTS_START,
+    INDEX_PROCESS_CHILDREN_START, INDEX_PROCESS_ARGS_START,
+  };
+  for (size_t i = 0; i < sizeof(kStartSections) / sizeof(kStartSections[0]);
+       i++) {
+    TraceIndexSection s = kStartSections[i];
+    TraceIndexSection list = static_cast<TraceIndexSection>(s + 1);
+    uint64_t n = s < INDEX_PROCESS_PID ? num_paths : num_procs;
+    if (header_->section_sizes[s] != (n + 1) * 8)
+      return false;
+    const uint64_t* start = get<uint64_t>(s);
+    if (start[0] || start[n] * kElementSizes[list] !=
+        header_->section_sizes[list]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void TraceIndex::getEvent(uint32_t e, Event* ev) const {
+  uint32_t p = eventPath(e);
+  ev->path_id = PathTable::global()->intern(path(p), pathSize(p));
+  ev->pid = get<int32_t>(INDEX_EVENT_PID)[e];
+  ev->syscall = eventSyscall(e);
+  ev->type = eventType(e);
+  ev->error = get<uint16_t>(INDEX_EVENT_ERROR)[e];
+}
+
+// Returns the first path which is not less than |path|.
+uint32_t TraceIndex::lowerBound(const string& path) const {
+  uint32_t lo = 0;
+  uint32_t hi = numPaths();
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    size_t size = pathSize(mid);
+    int r = memcmp(this->path(mid), path.data(), min(size, path.size()));
+    if (r < 0 || (r == 0 && size < path.size()))
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+bool TraceIndex::findPath(const string& path, uint32_t* p) const {
+  *p = lowerBound(path);
+  return *p < numPaths() && pathSize(*p) == path.size() &&
+      !memcmp(this->path(*p), path.data(), path.size());
+}
+
+void TraceIndex::findPrefix(const string& prefix,
+                            uint32_t* begin, uint32_t* end) const {
+  *begin = lowerBound(prefix);
+  // The paths which start with |prefix| are those before the smallest
+  // string which is greater than all of them, e.g. "/a/c" for "/a/b".
+  string next = prefix;
+  while (!next.empty() && next[next.size() - 1] == '\xff')
+    next.resize(next.size() - 1);
+  if (next.empty()) {
+    *end = numPaths();
+    return;
+  }
+  next[next.size() - 1]++;
+  *end = lowerBound(next);
+}
+
+void TraceIndex::getProcessArgs(uint32_t pr, vector<string>* args) const {
+  args->clear();
+  const uint64_t* start = get<uint64_t>(INDEX_PROCESS_ARGS_START);
+  const char* p = get<char>(INDEX_PROCESS_ARGS) + start[pr];
+  const char* end = get<char>(INDEX_PROCESS_ARGS) + start[pr + 1];
+  while (p < end) {
+    args->push_back(p);
+    p += args->back().size() + 1;
+  }
+}
+
+void TraceIndex::findPid(int pid, uint32_t* begin, uint32_t* end) const {
+  const int32_t* pids = get<int32_t>(INDEX_PROCESS_PID);
+  size_t n = numProcesses();
+  *begin = lower_bound(pids, pids + n, pid) - pids;
+  *end = upper_bound(pids, pids + n, pid) - pids;
+}
+
+}  // namespace katd
@@ -0,0 +1,170 @@
+#ifndef KATD_TRACE_INDEX_H_
+#define KATD_TRACE_INDEX_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "event.h"
+#include "syscalls.h"
+
+namespace katd {
+
+// An index of a binary trace, which katd-query maps to memory and
+// answers from by binary search without reading the trace. The index is
+// a TraceIndexHeader followed by sections, each an array aligned to 8
+// bytes. Integers are in the host byte order.
+//
+// Events are numbered from zero in the order of the trace, and each of
+// their fields is a column indexed by the number. Paths are sorted
+// bytewise, so a path is found by binary search and the paths under a
+// directory are a range. Each path has the numbers of its events in
+// order.
+//
+// A process is a pid from its fork, or from its first record, until its
+// exit, so a reused pid is another process. Processes are sorted by pid
+// and then by start. Each has its parent, its children, the arguments
+// of its last exec and the numbers of its events. Traces without
+// process records have a process per pid and no parents.
+extern const char kTraceIndexMagic[8];
+
+enum TraceIndexSection {
+  // Per event.
+  INDEX_EVENT_OFFSET,  // uint64_t, of the record in the trace
+  INDEX_EVENT_PATH,  // uint32_t
+  INDEX_EVENT_PROCESS,  // uint32_t
+  INDEX_EVENT_PID,  // int32_t
+  INDEX_EVENT_SYSCALL,  // uint16_t
+  INDEX_EVENT_ERROR,  // uint16_t
+  INDEX_EVENT_TYPE,  // int8_t
+
+  // The *_START sections have an entry per path or process and one for
+  // the end, which index the section after them.
+  INDEX_PATH_START,  // uint64_t
+  INDEX_PATH_DATA,  // char, each path terminated by NUL
+  INDEX_PATH_EVENTS_START,  // uint64_t
+  INDEX_PATH_EVENTS,  // uint32_t
+
+  INDEX_PROCESS_PID,  // int32_t
+  INDEX_PROCESS_PARENT,  // uint32_t, or TraceIndex::kNoProcess
+  INDEX_PROCESS_EVENTS_START,  // uint64_t
+  INDEX_PROCESS_EVENTS,  // uint32_t
+  INDEX_PROCESS_CHILDREN_START,  // uint64_t
+  INDEX_PROCESS_CHILDREN,  // uint32_t
+  INDEX_PROCESS_ARGS_START,  // uint64_t
+  INDEX_PROCESS_ARGS,  // char, each argument terminated by NUL
+
+  NUM_INDEX_SECTIONS
+};
+
+struct TraceIndexHeader {
+  char magic[8];
+  uint64_t num_events;
+  uint64_t num_paths;
+  uint64_t num_processes;
+  uint64_t section_offsets[NUM_INDEX_SECTIONS];
+  uint64_t section_sizes[NUM_INDEX_SECTIONS];
+};
+
+// Writes the index of |trace| to |index|. Returns false with a message
+// in |err| on failure. The trace is read twice: first to count the
+// events of each path and process, then to fill the index in place, so
+// only the counts are kept in memory. A truncated trace is indexed up to
+// the cut with a warning on stderr.
+bool writeTraceIndex(const char* trace, const char* index, std::string* err);
+
+class TraceIndex {
+public:
+  static const uint32_t kNoProcess = ~0u;
+
+  TraceIndex();
+  ~TraceIndex();
+
+  // Returns false and sets errno if |filename| cannot be mapped, or to
+  // EINVAL if it is not an index.
+  bool open(const char* filename);
+
+  size_t numEvents() const { return header_->num_events; }
+  uint64_t eventOffset(uint32_t e) const {
+    return get<uint64_t>(INDEX_EVENT_OFFSET)[e];
+  }
+  uint32_t eventPath(uint32_t e) const {
+    return get<uint32_t>(INDEX_EVENT_PATH)[e];
+  }
+  uint32_t eventProcess(uint32_t e) const {
+    return get<uint32_t>(INDEX_EVENT_PROCESS)[e];
+  }
+  Syscall eventSyscall(uint32_t e) const {
+    return static_cast<Syscall>(get<uint16_t>(INDEX_EVENT_SYSCALL)[e]);
+  }
+  EventType eventType(uint32_t e) const {
+    return static_cast<EventType>(get<int8_t>(INDEX_EVENT_TYPE)[e]);
+  }
+  // Fills |ev| with event |e|. Its path is interned to
+  // PathTable::global().
+  void getEvent(uint32_t e, Event* ev) const;
+
+  size_t numPaths() const { return header_->num_paths; }
+  const char* path(uint32_t p) const {
+    return get<char>(INDEX_PATH_DATA) + get<uint64_t>(INDEX_PATH_START)[p];
+  }
+  size_t pathSize(uint32_t p) const {
+    const uint64_t* start = get<uint64_t>(INDEX_PATH_START);
+    return start[p + 1] - start[p] - 1;
+  }
+  // Returns false if |path| has no events.
+  bool findPath(const std::string& path, uint32_t* p) const;
+  // The paths which start with |prefix| are [*begin, *end).
+  void findPrefix(const std::string& prefix,
+                  uint32_t* begin, uint32_t* end) const;
+  const uint32_t* pathEvents(uint32_t p, size_t* size) const {
+    return getList(INDEX_PATH_EVENTS_START, INDEX_PATH_EVENTS, p, size);
+  }
+
+  size_t numProcesses() const { return header_->num_processes; }
+  int processPid(uint32_t pr) const {
+    return get<int32_t>(INDEX_PROCESS_PID)[pr];
+  }
+  uint32_t processParent(uint32_t pr) const {
+    return get<uint32_t>(INDEX_PROCESS_PARENT)[pr];
+  }
+  const uint32_t* processEvents(uint32_t pr, size_t* size) const {
+    return getList(INDEX_PROCESS_EVENTS_START, INDEX_PROCESS_EVENTS, pr,
+                   size);
+  }
+  const uint32_t* processChildren(uint32_t pr, size_t* size) const {
+    return getList(INDEX_PROCESS_CHILDREN_START, INDEX_PROCESS_CHILDREN,
+                   pr, size);
+  }
+  void getProcessArgs(uint32_t pr, std::vector<std::string>* args) const;
+  // The processes of |pid| are [*begin, *end), in the order they ran.
+  void findPid(int pid, uint32_t* begin, uint32_t* end) const;
+
+private:
+  template <typename T>
+  const T* get(TraceIndexSection section) const {
+    return reinterpret_cast<const T*>(
+        data_ + header_->section_offsets[section]);
+  }
+
+  const uint32_t* getList(TraceIndexSection start,
+                          TraceIndexSection list,
+                          uint32_t i, size_t* size) const {
+    const uint64_t* s = get<uint64_t>(start);
+    *size = s[i + 1] - s[i];
+    return get<uint32_t>(list) + s[i];
+  }
+
+  uint32_t lowerBound(const std::string& path) const;
+  bool checkSections() const;
+
+  const char* data_;
+  size_t size_;
+  const TraceIndexHeader* header_;
+};
+
+}  // namespace katd
+
+#endif  // KATD_TRACE_INDEX_H_
@@ -3,20 +3,46 @@
 
 #include <stdint.h>
 
+#include <string>
+#include <vector>
+
 #include "syscalls.h"
 
 namespace katd {
 
+// The syscall a thread is stopped at. The number and the arguments are
+// filled at the entrance and kept until the exit.
+struct SyscallInfo {
+  SyscallInfo();
+
+  Syscall syscall;
+  bool is_entry;
+  int64_t args[6];
+  int64_t retval;
+};
+
 class Tracee {
 public:
   static Tracee* create(const char* filename);
   virtual ~Tracee();
 
-  virtual void* getRegisterBuffer() = 0;
-  virtual Syscall getSyscall() const = 0;
-  virtual int64_t getReturnValue() const = 0;
-  virtual int64_t getArgument(int n) const = 0;
-  virtual bool setupSeccomp() const { return false; }
+  // Updates |info| for |pid| which is in a ptrace-stop. Returns false if
+  // the stop is not a syscall stop, or |pid| was killed since it
+  // stopped.
+  virtual bool getSyscallInfo(int pid, SyscallInfo* info) = 0;
+  // Installs a seccomp filter which stops the calling process at the
+  // syscalls for which |traced|, indexed by Syscall, is true.
+  virtual bool setupSeccomp(const std::vector<bool>& /*traced*/) const {
+    return false;
+  }
+  // Makes |pid|, a new process at its first stop, wait in rt_sigsuspend
+  // with all signals blocked once it is resumed, so it runs nothing while
+  // it has no tracer. Its registers go to |saved|. Returns false if the
+  // architecture does not support it.
+  virtual bool park(int /*pid*/, std::string* /*saved*/) { return false; }
+  // Gives |pid|, parked and stopped again by its new tracer, back the
+  // registers park saved. It resumes where it stopped first.
+  virtual void unpark(int /*pid*/, const std::string& /*saved*/) {}
 };
 
 }  // namespace katd
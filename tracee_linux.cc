@@ -1,117 +1,347 @@
 #include "tracee.h"
 
 #include <assert.h>
+#include <errno.h>
+#include <linux/audit.h>
 #ifdef USE_SECCOMP
-#include <seccomp.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+#include <sys/prctl.h>
 #endif
+#include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/ptrace.h>
+#include <sys/syscall.h>
+#include <sys/user.h>
+
+#include <string>
+#include <vector>
 
 #include "log.h"
 #include "syscalls.h"
 
+using namespace std;
+
 namespace katd {
 
-class Tracee_x86_64 : public Tracee {
+// Larger than any syscall number of the supported architectures.
+static const uint32_t kMaxSyscallNumber = 512;
+
+static_assert(NUM_SYSCALLS <= 256, "Syscall does not fit in SyscallTable");
+
+struct SyscallNumber {
+  uint32_t nr;
+  Syscall syscall;
+};
+
+// The Syscall of each number of an architecture, so that decoding a
+// number is a single load instead of a switch.
+struct SyscallTable {
+  uint8_t syscalls[kMaxSyscallNumber];
+};
+
+template <size_t N>
+static constexpr SyscallTable makeSyscallTable(
+    const SyscallNumber (&numbers)[N]) {
+  SyscallTable table = {};
+  for (size_t i = 0; i < N; i++)
+    table.syscalls[numbers[i].nr] = numbers[i].syscall;
+  return table;
+}
+
+static Syscall lookupSyscall(const SyscallTable& table, uint64_t nr) {
+  if (nr >= kMaxSyscallNumber)
+    return UNINTERESTING_SYSCALL;
+  return static_cast<Syscall>(table.syscalls[nr]);
+}
+
+// A syscall ABI a tracee may use.
+struct SyscallArch {
+  uint32_t audit_arch;
+  const SyscallTable* table;
+  // Return values are 32bit and need sign extension.
+  bool is_32bit;
+};
+
+#define DEFINE_SYSCALL_NUMBER(nr, name) { nr, SYSCALL_ ## name },
+
+#if defined(__x86_64__)
+static constexpr SyscallNumber kX86_64Numbers[] = {
+#include "syscalls_x86_64.tab"
+};
+static constexpr SyscallTable kX86_64Syscalls =
+    makeSyscallTable(kX86_64Numbers);
+static const SyscallArch kX86_64Arch = {
+  AUDIT_ARCH_X86_64, &kX86_64Syscalls, false
+};
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+static constexpr SyscallNumber kI386Numbers[] = {
+#include "syscalls_i386.tab"
+};
+static constexpr SyscallTable kI386Syscalls = makeSyscallTable(kI386Numbers);
+static const SyscallArch kI386Arch = {
+  AUDIT_ARCH_I386, &kI386Syscalls, true
+};
+#endif
+
+#if defined(__aarch64__)
+static constexpr SyscallNumber kAarch64Numbers[] = {
+#include "syscalls_aarch64.tab"
+};
+static constexpr SyscallTable kAarch64Syscalls =
+    makeSyscallTable(kAarch64Numbers);
+static const SyscallArch kAarch64Arch = {
+  AUDIT_ARCH_AARCH64, &kAarch64Syscalls, false
+};
+#endif
+
+#undef DEFINE_SYSCALL_NUMBER
+
+#ifdef USE_SECCOMP
+
+// Appends a section which returns SECCOMP_RET_TRACE for syscalls of
+// |arch| which are |traced|. The accumulator must hold the arch of the
+// syscall when the section starts.
+static void addSeccompArch(const SyscallArch& arch,
+                           const vector<bool>& traced,
+                           vector<sock_filter>* prog) {
+  vector<uint32_t> nums;
+  for (uint32_t nr = 0; nr < kMaxSyscallNumber; nr++) {
+    Syscall syscall = lookupSyscall(*arch.table, nr);
+    if (syscall != UNINTERESTING_SYSCALL && traced[syscall])
+      nums.push_back(nr);
+  }
+  // The section is |nums.size()| comparisons followed by LD, RET_ALLOW
+  // and RET_TRACE, which all must be reachable by 8bit jump offsets.
+  CHECK(nums.size() + 3 <= 255);
+
+  sock_filter jump_arch =
+      BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, arch.audit_arch, 0,
+               static_cast<uint8_t>(nums.size() + 3));
+  prog->push_back(jump_arch);
+  sock_filter load_nr =
+      BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(seccomp_data, nr));
+  prog->push_back(load_nr);
+  for (size_t i = 0; i < nums.size(); i++) {
+    sock_filter jump_nr =
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, nums[i],
+                 static_cast<uint8_t>(nums.size() - i), 0);
+    prog->push_back(jump_nr);
+  }
+  sock_filter allow = BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW);
+  prog->push_back(allow);
+  sock_filter trace = BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_TRACE);
+  prog->push_back(trace);
+}
+
+#endif  // USE_SECCOMP
+
+// Decodes syscall stops with PTRACE_GET_SYSCALL_INFO, which tells the
+// ABI of each stop, and falls back to the registers of the architecture
+// on kernels older than 5.3.
+class LinuxTracee : public Tracee {
 public:
-  virtual void* getRegisterBuffer() {
-    return &registers_;
-  }
-
-  virtual Syscall getSyscall() const {
-    switch (registers_.orig_rax) {
-    case 21:  // access
-      return SYSCALL_ACCESS;
-    case 163:  // acct
-      return SYSCALL_ACCT;
-    case 80:  // chdir
-      return SYSCALL_CHDIR;
-    case 90:  // chmod
-      return SYSCALL_CHMOD;
-    case 92:  // chown
-      return SYSCALL_CHOWN;
-    case 161:  // chroot
-      return SYSCALL_CHROOT;
-    case 56:  // clone
-      return SYSCALL_CLONE;
-    case 85:  // creat
-      return SYSCALL_CREAT;
-    case 59:  // execve
-      return SYSCALL_EXECVE;
-    case 269:  // faccessat
-      return SYSCALL_FACCESSAT;
-    case 268:  // fchmodat
-      return SYSCALL_FCHMODAT;
-    case 260:  // fchownat
-      return SYSCALL_FCHOWNAT;
-    case 57:  // fork
-      return SYSCALL_FORK;
-    case 262:  // newfstatat
-      return SYSCALL_FSTATAT;
-    case 261:  // futimesat
-      return SYSCALL_FUTIMESAT;
-    case 94:  // lchown
-      return SYSCALL_LCHOWN;
-    case 86:  // link
-      return SYSCALL_LINK;
-    case 265:  // linkat
-      return SYSCALL_LINKAT;
-    case 6:  // lstat
-      return SYSCALL_LSTAT;
-    case 83:  // mkdir
-      return SYSCALL_MKDIR;
-    case 258:  // mkdirat
-      return SYSCALL_MKDIRAT;
-    case 133:  // mknod
-      return SYSCALL_MKNOD;
-    case 259:  // mknodat
-      return SYSCALL_MKNODAT;
-    case 2:  // open
-      return SYSCALL_OPEN;
-    case 257:  // openat
-      return SYSCALL_OPENAT;
-    case 89:  // readlink
-      return SYSCALL_READLINK;
-    case 267:  // readlinkat
-      return SYSCALL_READLINKAT;
-    case 82:  // rename
-      return SYSCALL_RENAME;
-    case 264:  // renameat
-      return SYSCALL_RENAMEAT;
-    case 84:  // rmdir
-      return SYSCALL_RMDIR;
-    case 4:  // stat
-      return SYSCALL_STAT;
-    case 137:  // statfs
-      return SYSCALL_STATFS;
-    case 88:  // symlink
-      return SYSCALL_SYMLINK;
-    case 266:  // symlinkat
-      return SYSCALL_SYMLINKAT;
-    case 76:  // truncate
-      return SYSCALL_TRUNCATE;
-    case 87:  // unlink
-      return SYSCALL_UNLINK;
-    case 263:  // unlinkat
-      return SYSCALL_UNLINKAT;
-    case 134:  // uselib
-      return SYSCALL_USELIB;
-    case 132:  // utime
-    case 235:  // utimes
-      return SYSCALL_UTIME;
-    case 280:  // utimensat
-      return SYSCALL_UTIMENSAT;
-    case 58:  // vfork
-      return SYSCALL_VFORK;
-    default:
-      return UNINTERESTING_SYSCALL;
+  // |arches| are the ABIs tracees may use, the native one first.
+  LinuxTracee(const SyscallArch* const* arches, size_t num_arches)
+    : arches_(arches),
+      num_arches_(num_arches),
+      use_get_syscall_info_(true) {
+  }
+
+  virtual bool getSyscallInfo(int pid, SyscallInfo* info) {
+    if (use_get_syscall_info_) {
+      __ptrace_syscall_info si;
+      if (ptrace(PTRACE_GET_SYSCALL_INFO, pid, sizeof(si), &si) >= 0) {
+        const SyscallArch* arch = findArch(si.arch);
+        switch (si.op) {
+        case PTRACE_SYSCALL_INFO_ENTRY:
+        case PTRACE_SYSCALL_INFO_SECCOMP:
+          // The layouts of entry and seccomp are the same for nr and
+          // args.
+          info->syscall = arch ? lookupSyscall(*arch->table, si.entry.nr) :
+              UNINTERESTING_SYSCALL;
+          info->is_entry = true;
+          for (int i = 0; i < 6; i++)
+            info->args[i] = si.entry.args[i];
+          info->retval = -ENOSYS;
+          return true;
+        case PTRACE_SYSCALL_INFO_EXIT:
+          info->is_entry = false;
+          info->retval = arch && arch->is_32bit ?
+              static_cast<int32_t>(si.exit.rval) : si.exit.rval;
+          return true;
+        default:
+          return false;
+        }
+      }
+      // SIGKILLed since it stopped. Its exit is reported next.
+      if (errno == ESRCH)
+        return false;
+      // Kernels older than 5.3 do not know the request.
+      PCHECK(errno == EIO);
+      use_get_syscall_info_ = false;
+    }
+    return getSyscallInfoFromRegisters(pid, info);
+  }
+
+#ifdef USE_SECCOMP
+  virtual bool setupSeccomp(const vector<bool>& traced) const {
+    vector<sock_filter> prog;
+    sock_filter load_arch =
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(seccomp_data, arch));
+    prog.push_back(load_arch);
+    for (size_t i = 0; i < num_arches_; i++)
+      addSeccompArch(*arches_[i], traced, &prog);
+    sock_filter allow = BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW);
+    prog.push_back(allow);
+
+    sock_fprog fprog;
+    fprog.len = prog.size();
+    fprog.filter = &prog[0];
+    // Needed to install a filter without CAP_SYS_ADMIN.
+    if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) < 0)
+      return false;
+    if (prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &fprog) < 0)
+      return false;
+    return true;
+  }
+#endif  // USE_SECCOMP
+
+protected:
+  virtual bool getSyscallInfoFromRegisters(int pid, SyscallInfo* info) = 0;
+
+private:
+  const SyscallArch* findArch(uint32_t audit_arch) const {
+    for (size_t i = 0; i < num_arches_; i++) {
+      if (arches_[i]->audit_arch == audit_arch)
+        return arches_[i];
+    }
+    return NULL;
+  }
+
+  const SyscallArch* const* arches_;
+  size_t num_arches_;
+  bool use_get_syscall_info_;
+};
+
+#if defined(__x86_64__)
+
+static const SyscallArch* const kX86_64Arches[] = {
+  &kX86_64Arch, &kI386Arch,
+};
+
+// Also traces 32bit tracees, which run in compatibility mode.
+class Tracee_x86_64 : public LinuxTracee {
+public:
+  Tracee_x86_64()
+    : LinuxTracee(kX86_64Arches,
+                  sizeof(kX86_64Arches) / sizeof(kX86_64Arches[0])) {
+  }
+
+  // The first stop of a new process is in the kernel's return path of
+  // fork. -ERESTARTNOINTR in rax makes the kernel back up to the syscall
+  // instruction and run the syscall in orig_rax instead, without a
+  // handler in between.
+  virtual bool park(int pid, string* saved) {
+    Registers regs;
+    PCHECK(ptrace(PTRACE_GETREGS, pid, 0, &regs) >= 0);
+    saved->assign(reinterpret_cast<const char*>(&regs), sizeof(regs));
+    // The full mask is put below the red zone, which is free while the
+    // process does not run.
+    uint64_t mask = isI386(regs) ? regs.rsp & 0xffffffff : regs.rsp - 128;
+    mask -= sizeof(uint64_t);
+    PCHECK(ptrace(PTRACE_POKEDATA, pid, mask, ~0UL) >= 0);
+    if (isI386(regs)) {
+      regs.orig_rax = kI386RtSigsuspend;
+      regs.rbx = mask;
+      regs.rcx = sizeof(uint64_t);
+    } else {
+      regs.orig_rax = SYS_rt_sigsuspend;
+      regs.rdi = mask;
+      regs.rsi = sizeof(uint64_t);
+    }
+    regs.rax = -kErestartNoIntr;
+    PCHECK(ptrace(PTRACE_SETREGS, pid, 0, &regs) >= 0);
+    return true;
+  }
+
+  virtual void unpark(int pid, const string& saved) {
+    CHECK(saved.size() == sizeof(Registers));
+    PCHECK(ptrace(PTRACE_SETREGS, pid, 0, saved.data()) >= 0);
+  }
+
+protected:
+  virtual bool getSyscallInfoFromRegisters(int pid, SyscallInfo* info) {
+    if (ptrace(PTRACE_GETREGS, pid, 0, &registers_) < 0) {
+      PCHECK(errno == ESRCH);
+      return false;
     }
+    info->syscall = getSyscall();
+    for (int i = 0; i < 6; i++)
+      info->args[i] = getArgument(i);
+    info->retval = getReturnValue();
+    info->is_entry = info->retval == -ENOSYS;
+    return true;
   }
 
-  virtual int64_t getReturnValue() const {
+private:
+  struct Registers {
+    uint64_t  r15, r14, r13, r12, rbp, rbx, r11, r10;
+    uint64_t  r9, r8, rax, rcx, rdx, rsi, rdi, orig_rax;
+    uint64_t  rip, cs, eflags;
+    uint64_t  rsp, ss;
+    uint64_t  fs_base,  gs_base;
+    uint64_t  ds, es, fs, gs;
+  };
+
+  // Not in the headers for userspace.
+  static const uint64_t kErestartNoIntr = 513;
+  static const uint64_t kI386RtSigsuspend = 179;
+
+  // A 32bit tracee runs with the compatibility mode code segment.
+  static bool isI386(const Registers& regs) {
+    return regs.cs == 0x23;
+  }
+  bool isI386() const {
+    return isI386(registers_);
+  }
+
+  Syscall getSyscall() const {
+    if (isI386())
+      return lookupSyscall(kI386Syscalls, registers_.orig_rax);
+    return lookupSyscall(kX86_64Syscalls, registers_.orig_rax);
+  }
+
+  int64_t getReturnValue() const {
+    if (isI386())
+      return static_cast<int32_t>(registers_.rax);
     return registers_.rax;
   }
 
-  virtual int64_t getArgument(int n) const {
+  int64_t getArgument(int n) const {
+    if (isI386()) {
+      switch (n) {
+      case 0:
+        return static_cast<uint32_t>(registers_.rbx);
+      case 1:
+        return static_cast<uint32_t>(registers_.rcx);
+      case 2:
+        return static_cast<uint32_t>(registers_.rdx);
+      case 3:
+        return static_cast<uint32_t>(registers_.rsi);
+      case 4:
+        return static_cast<uint32_t>(registers_.rdi);
+      case 5:
+        return static_cast<uint32_t>(registers_.rbp);
+      default:
+        assert(0);
+      }
+    }
+
     switch (n) {
     case 0:
       return registers_.rdi;
@@ -130,92 +360,88 @@ public:
     }
   }
 
-  virtual bool setupSeccomp() const {
-#ifdef USE_SECCOMP
-    scmp_filter_ctx sctx = seccomp_init(SCMP_ACT_ALLOW);
-    static const char* kSyscallNames[] = {
-      "access",
-      "acct",
-      "chdir",
-      "chmod",
-      "chown",
-      "chroot",
-      "clone",
-      "creat",
-      // TODO: Catch execve.
-      //"execve",
-      "faccessat",
-      "fchmodat",
-      "fchownat",
-      "fork",
-      "newfstatat",
-      "futimesat",
-      "lchown",
-      "link",
-      "linkat",
-      "lstat",
-      "mkdir",
-      "mkdirat",
-      "mknod",
-      "mknodat",
-      "open",
-      "openat",
-      "readlink",
-      "readlinkat",
-      "rename",
-      "renameat",
-      "rmdir",
-      "stat",
-      "statfs",
-      "symlink",
-      "symlinkat",
-      "truncate",
-      "unlink",
-      "unlinkat",
-      "uselib",
-      "utime",
-      "utimes",
-      "utimensat",
-      "vfork",
-      0,
-    };
-    for (const char** sys = kSyscallNames; *sys; sys++) {
-      int num = seccomp_syscall_resolve_name_arch(AUDIT_ARCH_X86_64, *sys);
-      PCHECK(num > 0);
-      PCHECK(seccomp_rule_add(sctx, SCMP_ACT_TRACE(42), num, 0) >= 0);
-    }
-    PCHECK(seccomp_arch_add(sctx, AUDIT_ARCH_I386) >= 0);
-    for (const char** sys = kSyscallNames; *sys; sys++) {
-      int num = seccomp_syscall_resolve_name_arch(AUDIT_ARCH_I386, *sys);
-      // TODO: 32bit support is utterly broken.
-      if (num < 0)
-        continue;
-      PCHECK(seccomp_rule_add(sctx, SCMP_ACT_TRACE(42), num, 0) >= 0);
+  Registers registers_;
+};
+
+#elif defined(__i386__)
+
+static const SyscallArch* const kI386Arches[] = {
+  &kI386Arch,
+};
+
+class Tracee_i386 : public LinuxTracee {
+public:
+  Tracee_i386()
+    : LinuxTracee(kI386Arches, 1) {
+  }
+
+protected:
+  virtual bool getSyscallInfoFromRegisters(int pid, SyscallInfo* info) {
+    user_regs_struct regs;
+    if (ptrace(PTRACE_GETREGS, pid, 0, &regs) < 0) {
+      PCHECK(errno == ESRCH);
+      return false;
     }
-    PCHECK(seccomp_load(sctx) >= 0);
+    info->syscall = lookupSyscall(kI386Syscalls,
+                                  static_cast<uint32_t>(regs.orig_eax));
+    info->args[0] = static_cast<uint32_t>(regs.ebx);
+    info->args[1] = static_cast<uint32_t>(regs.ecx);
+    info->args[2] = static_cast<uint32_t>(regs.edx);
+    info->args[3] = static_cast<uint32_t>(regs.esi);
+    info->args[4] = static_cast<uint32_t>(regs.edi);
+    info->args[5] = static_cast<uint32_t>(regs.ebp);
+    info->retval = static_cast<int32_t>(regs.eax);
+    info->is_entry = info->retval == -ENOSYS;
     return true;
-#else
-    return false;
-#endif
   }
+};
 
-private:
-  struct Registers {
-    uint64_t  r15, r14, r13, r12, rbp, rbx, r11, r10;
-    uint64_t  r9, r8, rax, rcx, rdx, rsi, rdi, orig_rax;
-    uint64_t  rip, cs, eflags;
-    uint64_t  rsp, ss;
-    uint64_t  fs_base,  gs_base;
-    uint64_t  ds, es, fs, gs;
-  };
+#elif defined(__aarch64__)
 
-  Registers registers_;
+static const SyscallArch* const kAarch64Arches[] = {
+  &kAarch64Arch,
+};
+
+// 32bit ARM tracees are not decoded.
+class Tracee_aarch64 : public LinuxTracee {
+public:
+  Tracee_aarch64()
+    : LinuxTracee(kAarch64Arches, 1) {
+  }
+
+protected:
+  // x0 holds both the first argument and the return value, and nothing
+  // in the registers tells an entry from an exit, so the stops cannot be
+  // decoded without PTRACE_GET_SYSCALL_INFO.
+  virtual bool getSyscallInfoFromRegisters(int /*pid*/,
+                                           SyscallInfo* /*info*/) {
+    fprintf(stderr, "katd needs Linux 5.3 or later on aarch64\n");
+    abort();
+  }
 };
 
+#else
+#error "katd supports Linux on x86_64, i386 and aarch64"
+#endif
+
 Tracee* Tracee::create(const char* /*filename*/) {
+#if defined(__x86_64__)
   return new Tracee_x86_64();
+#elif defined(__i386__)
+  return new Tracee_i386();
+#else
+  return new Tracee_aarch64();
+#endif
 }
 
 Tracee::~Tracee() {}
 
+SyscallInfo::SyscallInfo()
+  : syscall(UNINTERESTING_SYSCALL),
+    is_entry(false),
+    retval(0) {
+  for (int i = 0; i < 6; i++)
+    args[i] = 0;
+}
+
 }  // namespace katd
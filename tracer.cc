@@ -1,29 +1,44 @@
 #include "tracer.h"
 
 #include <assert.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <setjmp.h>
 #include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ptrace.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <condition_variable>
+#include <map>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <utility>
 
 #include "event.h"
+#include "event_filter.h"
 #include "handler.h"
 #include "log.h"
+#include "path_util.h"
+#include "symlink_resolver.h"
 #include "syscalls.h"
 #include "tracee.h"
+#include "tracer_stats.h"
 
 using namespace std;
 
@@ -40,20 +55,99 @@ using namespace std;
 
 namespace katd {
 
+struct Tracer::ShardGroup {
+  ShardGroup()
+    : live(0),
+      done(false) {
+  }
+
+  // Guards the inboxes of the shards.
+  mutex mu;
+  // Notified when a shard gets processes or |done| is set.
+  condition_variable cond;
+  vector<Tracer*> shards;
+  // Processes traced by all shards. The run ends when it drops to zero.
+  atomic<size_t> live;
+  atomic<bool> done;
+  // Handlers and the symlink resolver are called by one shard at a time.
+  mutex handler_mu;
+  mutex resolver_mu;
+};
+
+// A shard which hands a process over, or ends the run, kicks the other
+// shards with kKickSignal, since they may be blocked in waitpid for
+// their own processes. The handler jumps out of waitpid, but only while
+// the shard is between checking its inbox and waitpid returning, so a
+// kick is never lost and a stop is never consumed and dropped.
+static const int kKickSignal = SIGUSR1;
+static thread_local sigjmp_buf g_kick_jmp;
+static thread_local volatile sig_atomic_t g_kick_armed;
+
+static void handleKick(int) {
+  if (g_kick_armed) {
+    g_kick_armed = 0;
+    siglongjmp(g_kick_jmp, 1);
+  }
+}
+
 Tracer::Tracer(char** argv)
   : argv_(argv),
+    root_pid_(-1),
+    attach_pid_(0),
+    exit_status_(-1),
     pid_(-1),
     follow_children_(false),
-    is_in_syscall_(false) {
-  tracee_ = Tracee::create(argv_[0]);
+    state_(NULL),
+    use_process_vm_readv_(true),
+    paths_(PathTable::global()),
+    resolver_(NULL),
+    filter_(NULL),
+    stats_(NULL),
+    process_times_(false),
+    rusage_(),
+    num_threads_(1),
+    group_(NULL),
+    shard_(0),
+    thread_(),
+    inbox_size_(0),
+    num_traced_(0) {
+  tracee_ = Tracee::create(argv_ ? argv_[0] : NULL);
 }
 
 Tracer::~Tracer() {
+  delete resolver_;
+  delete filter_;
 }
 
 Tracer::ProcessState::ProcessState()
+  : exe(PathTable::kEmptyPathId),
+    cwd(PathTable::kEmptyPathId),
+    num_threads(0),
+    start_ns(0) {
+}
+
+Tracer::ThreadState::ThreadState()
   : status(0),
-    execve_handled(false) {
+    has_seccomp_filter(false),
+    tgid(0),
+    proc(NULL),
+    hand_off_to(-1) {
+}
+
+Tracer::FdState::FdState()
+  : path(PathTable::kEmptyPathId),
+    is_open(false),
+    cloexec(false) {
+}
+
+void Tracer::set_resolve_symlinks(bool r) {
+  delete resolver_;
+  resolver_ = r ? new SymlinkResolver(paths_) : NULL;
+}
+
+void Tracer::set_filter(const EventFilter& filter) {
+  delete filter_;
+  filter_ = new EventFilter(filter);
 }
 
 void Tracer::addHandler(Handler* handler) {
@@ -61,33 +155,91 @@ void Tracer::addHandler(Handler* handler) {
 }
 
 void Tracer::run() {
-  attach();
+  if (stats_)
+    stats_->start();
+  if (num_threads_ > 1 && follow_children_ && !attach_pid_) {
+    runShards();
+  } else {
+    if (attach_pid_)
+      seize();
+    else
+      attach();
+    traceLoop();
+  }
 
-  int opts = 0;
-#ifdef USE_SECCOMP
-  opts |= PTRACE_O_TRACESECCOMP;
-#endif
-  if (follow_children_) {
-    opts |= PTRACE_O_TRACECLONE | PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK;
+  for (size_t i = 0; i < handlers_.size(); i++)
+    handlers_[i]->flush();
+  if (stats_) {
+    stats_->stop();
+    for (size_t i = 0; i < handlers_.size(); i++)
+      stats_->setHandler(i, *handlers_[i]);
   }
-  PTRACE(SETOPTIONS, pid_, 0, opts);
+}
 
-  while (!pids_.empty()) {
-#ifdef USE_SECCOMP
-      if (is_in_syscall_)
-        PTRACE(SYSCALL, pid_, 0, 0);
-      else
-        PTRACE(CONT, pid_, 0, 0);
-#else
-      PTRACE(SYSCALL, pid_, 0, 0);
-#endif
+void Tracer::traceLoop() {
+  while (group_ ? !group_->done : !threads_.empty()) {
     if (!wait()) {
       continue;
     }
     handleSyscall();
+    resume(pid_, state_, 0);
   }
 }
 
+// Runs this tracer as shard 0 and num_threads_ - 1 more in threads. The
+// command starts in shard 0, and processes move to other shards when
+// they are forked.
+void Tracer::runShards() {
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = &handleKick;
+  sa.sa_flags = SA_RESTART;
+  PCHECK(sigaction(kKickSignal, &sa, NULL) == 0);
+
+  ShardGroup group;
+  group_ = &group;
+  shard_ = 0;
+  thread_ = pthread_self();
+  group.shards.push_back(this);
+  for (int i = 1; i < num_threads_; i++) {
+    Tracer* shard = new Tracer(NULL);
+    shard->follow_children_ = true;
+    shard->use_process_vm_readv_ = use_process_vm_readv_;
+    shard->process_times_ = process_times_;
+    shard->resolver_ = resolver_;
+    if (filter_)
+      shard->filter_ = new EventFilter(*filter_);
+    shard->handlers_ = handlers_;
+    if (stats_)
+      shard->stats_ = new TracerStats();
+    shard->group_ = &group;
+    shard->shard_ = i;
+    group.shards.push_back(shard);
+  }
+  // The threads are known before any process is handed over.
+  vector<thread> threads;
+  for (size_t i = 1; i < group.shards.size(); i++) {
+    threads.push_back(thread(&Tracer::traceLoop, group.shards[i]));
+    group.shards[i]->thread_ = threads.back().native_handle();
+  }
+
+  attach();
+  traceLoop();
+
+  for (size_t i = 0; i < threads.size(); i++)
+    threads[i].join();
+  for (size_t i = 1; i < group.shards.size(); i++) {
+    Tracer* shard = group.shards[i];
+    if (stats_) {
+      stats_->merge(*shard->stats_);
+      delete shard->stats_;
+    }
+    shard->resolver_ = NULL;
+    delete shard;
+  }
+  group_ = NULL;
+}
+
 static string normalizeDir(string cwd) {
   while (!cwd.empty() && cwd[cwd.size() - 1] == '/')
     cwd.resize(cwd.size() - 1);
@@ -96,38 +248,411 @@ static string normalizeDir(string cwd) {
 }
 
 void Tracer::attach() {
+  vector<bool> traced;
+  getTracedSyscalls(&traced);
   root_pid_ = pid_ = fork();
   PCHECK(pid_ >= 0);
   if (pid_ == 0) {
     PTRACE(TRACEME, 0, 0, 0);
+    // Wait until the parent sets PTRACE_O_TRACESECCOMP. Otherwise,
+    // SECCOMP_RET_TRACE makes syscalls fail with ENOSYS.
+    PCHECK(raise(SIGSTOP) == 0);
 #ifdef USE_SECCOMP
-    PCHECK(tracee_->setupSeccomp());
+    // Children and threads inherit the filter. Without -f they have no
+    // tracer, and their traced syscalls would fail with ENOSYS.
+    if (follow_children_)
+      PCHECK(tracee_->setupSeccomp(traced));
 #endif
     PCHECK(execvp(argv_[0], argv_) == 0);
   }
 
-  pids_.insert(pid_);
-  ProcessState* state = &states_[pid_];
+  ThreadState* state = addThread(pid_, pid_);
+#ifdef USE_SECCOMP
+  state->has_seccomp_filter = follow_children_;
+#endif
+  ProcessState* proc = state->proc;
   char cwd_buf[PATH_MAX + 1];
   PCHECK(getcwd(cwd_buf, PATH_MAX + 1));
-  state->cwd = normalizeDir(cwd_buf);
+  proc->cwd = paths_->intern(normalizeDir(cwd_buf));
   for (char** p = argv_; *p; p++)
-    state->args.push_back(*p);
+    proc->args.push_back(*p);
 
   if (!wait()) {
     fprintf(stderr, "failed to run the binary: %s\n", argv_[0]);
     abort();
   }
+
+  PTRACE(SETOPTIONS, pid_, 0, getPtraceOptions());
+  resume(pid_, state, 0);
+}
+
+// Adds |tid| of the process |tgid|. The process is added with its first
+// thread.
+Tracer::ThreadState* Tracer::addThread(int tid, int tgid) {
+  bool inserted;
+  ThreadState* thread = threads_.insert(tid, &inserted);
+  CHECK(inserted);
+  thread->tgid = tgid;
+  thread->proc = procs_.insert(tgid, &inserted);
+  if (inserted && process_times_)
+    thread->proc->start_ns = getNanoTime();
+  thread->proc->num_threads++;
+  if (group_) {
+    num_traced_++;
+    group_->live++;
+  }
+  return thread;
+}
+
+// Removes |tid|, and its process with the last thread.
+void Tracer::removeThread(int tid) {
+  ThreadState* thread = threads_.find(tid);
+  if (!thread)
+    return;
+  int tgid = thread->tgid;
+  int status = thread->status;
+  ProcessState* proc = thread->proc;
+  threads_.erase(tid);
+  if (!--proc->num_threads) {
+    // The last thread of a process is its leader, which the kernel
+    // reports after the others, so rusage_ is of the whole process.
+    if (process_times_)
+      sendProcessTimes(tgid, *proc, status);
+    sendExit(tgid);
+    procs_.erase(tgid);
+  }
+  if (group_) {
+    num_traced_--;
+    countExit();
+  }
+}
+
+int Tracer::getPtraceOptions() const {
+  // PTRACE_GET_SYSCALL_INFO tells syscall-enter-stop from
+  // syscall-exit-stop only with PTRACE_O_TRACESYSGOOD.
+  int opts = PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACEEXEC;
+#ifdef USE_SECCOMP
+  opts |= PTRACE_O_TRACESECCOMP;
+#endif
+  if (follow_children_) {
+    opts |= PTRACE_O_TRACECLONE | PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK;
+  }
+  return opts;
+}
+
+// Whether the tracer needs |syscall| to follow fds, the cwd and new
+// processes, whatever events are reported.
+static bool changesState(Syscall syscall) {
+  switch (syscall) {
+  case SYSCALL_CHDIR:
+  case SYSCALL_CLONE:
+  case SYSCALL_CLONE3:
+  case SYSCALL_CLOSE:
+  case SYSCALL_CLOSE_RANGE:
+  case SYSCALL_CREAT:
+  case SYSCALL_DUP:
+  case SYSCALL_DUP2:
+  case SYSCALL_DUP3:
+  case SYSCALL_FCHDIR:
+  case SYSCALL_FCNTL:
+  case SYSCALL_FORK:
+  case SYSCALL_OPEN:
+  case SYSCALL_OPENAT:
+  case SYSCALL_OPENAT2:
+  case SYSCALL_VFORK:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// Whether |syscall| may replace directories SymlinkResolver cached.
+static bool invalidatesResolver(Syscall syscall) {
+  switch (syscall) {
+  case SYSCALL_RENAME:
+  case SYSCALL_RENAMEAT:
+  case SYSCALL_RENAMEAT2:
+  case SYSCALL_RMDIR:
+  case SYSCALL_SYMLINK:
+  case SYSCALL_SYMLINKAT:
+  case SYSCALL_UNLINK:
+  case SYSCALL_UNLINKAT:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// Fills |traced|, indexed by Syscall, with the syscalls the seccomp
+// filter stops at.
+void Tracer::getTracedSyscalls(vector<bool>* traced) const {
+  traced->assign(NUM_SYSCALLS, false);
+  for (int i = 1; i < NUM_SYSCALLS; i++) {
+    Syscall syscall = static_cast<Syscall>(i);
+    (*traced)[i] = !filter_ || filter_->mayMatch(syscall) ||
+        changesState(syscall) || (resolver_ && invalidatesResolver(syscall));
+  }
+}
+
+// SIGINT and SIGTERM make an attached tracer detach. Like kicks of
+// shards, the handler jumps out of waitid only while it is armed, so the
+// signal is never missed between checking g_interrupted and waitid. It
+// may be delivered to another thread, e.g. of AsyncHandler, which passes
+// it on to the tracer thread.
+static volatile sig_atomic_t g_interrupted;
+static pthread_t g_tracer_thread;
+static thread_local sigjmp_buf g_interrupt_jmp;
+static thread_local volatile sig_atomic_t g_interrupt_armed;
+
+static void handleInterrupt(int sig) {
+  g_interrupted = 1;
+  if (g_interrupt_armed) {
+    g_interrupt_armed = 0;
+    siglongjmp(g_interrupt_jmp, 1);
+  }
+  if (!pthread_equal(pthread_self(), g_tracer_thread))
+    pthread_kill(g_tracer_thread, sig);
+}
+
+void Tracer::seize() {
+  g_tracer_thread = pthread_self();
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = &handleInterrupt;
+  PCHECK(sigaction(SIGINT, &sa, NULL) == 0);
+  PCHECK(sigaction(SIGTERM, &sa, NULL) == 0);
+
+  root_pid_ = attach_pid_;
+  if (!seizeProcess(root_pid_)) {
+    fprintf(stderr, "failed to attach to %d: %s\n",
+            root_pid_, strerror(errno));
+    abort();
+  }
+  if (!follow_children_)
+    return;
+
+  // Seize descendants breadth first. Children forked after their parent
+  // is seized are reported by PTRACE_O_TRACEFORK.
+  multimap<int, int> children;
+  DIR* dir = opendir("/proc");
+  PCHECK(dir);
+  while (dirent* ent = readdir(dir)) {
+    int pid = atoi(ent->d_name);
+    if (pid <= 0)
+      continue;
+    char buf[PATH_MAX];
+    snprintf(buf, sizeof(buf), "/proc/%d/stat", pid);
+    FILE* fp = fopen(buf, "r");
+    if (!fp)
+      continue;
+    int ppid;
+    // The command name may contain spaces and parens.
+    if (fgets(buf, sizeof(buf), fp)) {
+      char* p = strrchr(buf, ')');
+      if (p && sscanf(p, ") %*c %d", &ppid) == 1)
+        children.insert(make_pair(ppid, pid));
+    }
+    fclose(fp);
+  }
+  closedir(dir);
+
+  vector<int> queue(1, root_pid_);
+  for (size_t i = 0; i < queue.size(); i++) {
+    pair<multimap<int, int>::iterator, multimap<int, int>::iterator> r =
+        children.equal_range(queue[i]);
+    for (multimap<int, int>::iterator iter = r.first; iter != r.second;
+         ++iter) {
+      // Fails for children which were already auto-attached or exited.
+      if (!procs_.find(iter->second) && seizeProcess(iter->second))
+        queue.push_back(iter->second);
+    }
+  }
+}
+
+// Seizes the process |pid| and its threads.
+bool Tracer::seizeProcess(int pid) {
+  if (!seizeThread(pid))
+    return false;
+  ThreadState* state = addThread(pid, pid);
+  loadProcessState(pid, state->proc);
+  sendExec(pid, state->proc->args);
+
+  // Threads started after this are reported by PTRACE_O_TRACECLONE.
+  vector<int> tids(1, pid);
+  char buf[64];
+  snprintf(buf, sizeof(buf), "/proc/%d/task", pid);
+  if (DIR* dir = opendir(buf)) {
+    while (dirent* ent = readdir(dir)) {
+      int tid = atoi(ent->d_name);
+      if (tid > 0 && !threads_.find(tid) && seizeThread(tid)) {
+        addThread(tid, pid);
+        tids.push_back(tid);
+      }
+    }
+    closedir(dir);
+  }
+
+  // There is no seccomp filter, so stop at every syscall.
+  for (size_t i = 0; i < tids.size(); i++)
+    PTRACE(SYSCALL, tids[i], 0, 0);
+  return true;
+}
+
+// Seizes |tid| and waits until it stops.
+bool Tracer::seizeThread(int tid) {
+  if (ptrace(PTRACE_SEIZE, tid, 0, getPtraceOptions()) < 0)
+    return false;
+  PTRACE(INTERRUPT, tid, 0, 0);
+  for (;;) {
+    int status;
+    PCHECK(waitpid(tid, &status, __WALL) == tid);
+    if (!WIFSTOPPED(status))
+      return false;
+    if ((status >> 16) == PTRACE_EVENT_STOP)
+      return true;
+    // A signal arrived before the interrupt. Deliver it and wait for
+    // the interrupt stop.
+    PTRACE(CONT, tid, 0, WSTOPSIG(status));
+  }
+}
+
+// Reads the arguments of |pid|. They are only reliable right after
+// exec, since programs may overwrite them.
+static void readCommandLine(int pid, vector<string>* args) {
+  args->clear();
+  char buf[64];
+  snprintf(buf, sizeof(buf), "/proc/%d/cmdline", pid);
+  FILE* fp = fopen(buf, "re");
+  if (!fp)
+    return;
+  string arg;
+  int c;
+  while ((c = getc(fp)) != EOF) {
+    if (c) {
+      arg += c;
+    } else {
+      args->push_back(arg);
+      arg.clear();
+    }
+  }
+  fclose(fp);
+}
+
+// Rebuilds the arguments, the cwd and the fd table from /proc.
+void Tracer::loadProcessState(int pid, ProcessState* state) {
+  char buf[PATH_MAX + 1];
+  char link[PATH_MAX + 1];
+  readCommandLine(pid, &state->args);
+
+  snprintf(buf, sizeof(buf), "/proc/%d/cwd", pid);
+  ssize_t len = readlink(buf, link, PATH_MAX);
+  if (len > 0)
+    state->cwd = paths_->intern(normalizeDir(string(link, len)));
+
+  snprintf(buf, sizeof(buf), "/proc/%d/fd", pid);
+  DIR* dir = opendir(buf);
+  if (!dir)
+    return;
+  while (dirent* ent = readdir(dir)) {
+    if (ent->d_name[0] == '.')
+      continue;
+    int fd = atoi(ent->d_name);
+    snprintf(buf, sizeof(buf), "/proc/%d/fd/%d", pid, fd);
+    len = readlink(buf, link, PATH_MAX);
+    // Skip pipes, sockets and so on.
+    if (len <= 0 || link[0] != '/')
+      continue;
+
+    bool cloexec = false;
+    snprintf(buf, sizeof(buf), "/proc/%d/fdinfo/%d", pid, fd);
+    if (FILE* fp = fopen(buf, "r")) {
+      unsigned flags;
+      while (fgets(buf, sizeof(buf), fp)) {
+        if (sscanf(buf, "flags: %o", &flags) == 1)
+          cloexec = flags & O_CLOEXEC;
+      }
+      fclose(fp);
+    }
+
+    if (static_cast<size_t>(fd) >= state->fds.size())
+      state->fds.resize(fd + 1);
+    FdState* s = &state->fds[fd];
+    s->path = paths_->intern(link, len);
+    s->is_open = true;
+    s->cloexec = cloexec;
+  }
+  closedir(dir);
+}
+
+void Tracer::detachAll() {
+  vector<int> pids;
+  threads_.getPids(&pids);
+  pids.insert(pids.end(), pending_children_.begin(), pending_children_.end());
+  for (size_t i = 0; i < pids.size(); i++)
+    ptrace(PTRACE_INTERRUPT, pids[i], 0, 0);
+  for (size_t i = 0; i < pids.size(); i++) {
+    int status;
+    if (waitpid(pids[i], &status, __WALL) != pids[i] ||
+        !WIFSTOPPED(status)) {
+      continue;
+    }
+    // Give back a signal we intercepted in signal-delivery-stop.
+    int sig = 0;
+    if ((status >> 16) == 0 && (WSTOPSIG(status) & ~SI_KERNEL) != SIGTRAP)
+      sig = WSTOPSIG(status);
+    ptrace(PTRACE_DETACH, pids[i], 0, sig);
+  }
+  pending_children_.clear();
+  threads_.clear();
+  procs_.clear();
+}
+
+void Tracer::resume(int pid, const ThreadState* state, int sig) {
+  // The seccomp filter stops the tracee only at the entrance of syscalls
+  // we are interested in. Use PTRACE_SYSCALL to see their exits.
+  __ptrace_request req =
+      state->has_seccomp_filter && !state->syscall.is_entry ?
+      PTRACE_CONT : PTRACE_SYSCALL;
+  // A tracee SIGKILLed since it stopped is gone until its exit is
+  // reported.
+  if (ptrace(req, pid, 0, sig) < 0)
+    PCHECK(errno == ESRCH);
 }
 
 bool Tracer::wait() {
   int status;
-  pid_ = ::wait(&status);
+  uint64_t start = stats_ ? getNanoTime() : 0;
+  if (group_) {
+    if (!waitShard(&status))
+      return false;
+  } else {
+    // WNOWAIT leaves the stop to be consumed after SIGINT is disarmed.
+    // __WALL to see threads, whose exit signal is not SIGCHLD.
+    siginfo_t info;
+    if (!sigsetjmp(g_interrupt_jmp, 1)) {
+      g_interrupt_armed = 1;
+      if (!g_interrupted) {
+        int r = waitid(P_ALL, 0, &info,
+                       WEXITED | WSTOPPED | WNOWAIT | __WALL);
+        g_interrupt_armed = 0;
+        PCHECK(r == 0);
+      }
+    }
+    g_interrupt_armed = 0;
+    if (g_interrupted) {
+      detachAll();
+      return false;
+    }
+    pid_ = wait4(info.si_pid, &status, __WALL,
+                 process_times_ ? &rusage_ : NULL);
+  }
+  if (stats_)
+    stats_->wait()->add(getNanoTime() - start);
   PCHECK(pid_ >= 0);
 
-  std::map<int, ProcessState>::iterator found = states_.find(pid_);
-  if (found != states_.end())
-    found->second.status = status;
+  state_ = threads_.find(pid_);
+  if (state_)
+    state_->status = status;
 
 #ifdef USE_SECCOMP
   if ((status >> 8) == (SIGTRAP | (PTRACE_EVENT_SECCOMP << 8))) {
@@ -136,19 +661,55 @@ bool Tracer::wait() {
 #endif
 
   if (!WIFSTOPPED(status)) {
-    pids_.erase(pid_);
-    if (pids_.empty())
+    if (pid_ == root_pid_ && !attach_pid_)
+      exit_status_ = status;
+    removeThread(pid_);
+    state_ = NULL;
+    if (threads_.empty())
       return false;
     return wait();
   }
 
+  if (!state_) {
+    // A new child or thread can stop before its parent reports it.
+    // Keep it stopped until handleFork or handleNewThread knows its
+    // state.
+    pending_children_.push_back(pid_);
+    return wait();
+  }
+
+  if (state_->hand_off_to >= 0) {
+    handOff(pid_, state_);
+    state_ = NULL;
+    return wait();
+  }
+
+  int event = status >> 16;
+  if (event == PTRACE_EVENT_FORK || event == PTRACE_EVENT_VFORK ||
+      event == PTRACE_EVENT_CLONE) {
+    if (stats_)
+      stats_->countOtherStop();
+    handleNewChild(event);
+    resume(pid_, state_, 0);
+    return wait();
+  }
+  if (event == PTRACE_EVENT_EXEC) {
+    if (stats_)
+      stats_->countOtherStop();
+    handleExecEvent();
+    resume(pid_, state_, 0);
+    return wait();
+  }
+
   int sig = WSTOPSIG(status);
   if (sig != SIGTRAP && sig != (SIGTRAP | SI_KERNEL) &&
       sig != SIGSTOP && sig != SIGTSTP && sig != SIGTTIN && sig != SIGTTOU) {
+    if (stats_)
+      stats_->countOtherStop();
     siginfo_t siginfo;
     if (ptrace(PTRACE_GETSIGINFO, pid_, 0, &siginfo) >= 0) {
       // This is signal-delivery-stop. Deliver the signal to the tracee.
-      PTRACE(SYSCALL, pid_, 0, sig);
+      resume(pid_, state_, sig);
     }
     return wait();
   }
@@ -157,11 +718,24 @@ bool Tracer::wait() {
 }
 
 void Tracer::handleSyscall() {
-  PTRACE(GETREGS, pid_, 0, tracee_->getRegisterBuffer());
+  SyscallInfo* info = &state_->syscall;
+  uint64_t start = stats_ ? getNanoTime() : 0;
+  bool is_syscall_stop = tracee_->getSyscallInfo(pid_, info);
+  if (stats_) {
+    stats_->getSyscallInfo()->add(getNanoTime() - start);
+    if (is_syscall_stop)
+      stats_->countStop(info->syscall, info->is_entry);
+    else
+      stats_->countOtherStop();
+  }
+  if (!is_syscall_stop)
+    return;
+
   Event ev;
-  ev.pid = pid_;
-  ev.syscall = tracee_->getSyscall();
-  int64_t retval = tracee_->getReturnValue();
+  ev.path_id = PathTable::kEmptyPathId;
+  ev.pid = state_->tgid;
+  ev.syscall = info->syscall;
+  int64_t retval = info->retval;
   ev.error = 0;
   if (-4096 < retval && retval < 0)
     ev.error = -retval;
@@ -169,209 +743,354 @@ void Tracer::handleSyscall() {
 #if 0
   fprintf(stderr, "stop %s(%d) %ld %ld %ld => %ld\n",
           getSyscallName(ev.syscall), ev.syscall,
-          tracee_->getArgument(0),
-          tracee_->getArgument(1),
-          tracee_->getArgument(2),
+          getArgument(0),
+          getArgument(1),
+          getArgument(2),
           retval);
 #endif
 
-  is_in_syscall_ = (retval == -ENOSYS);
   // Do not care the syscall entrace and uninteresting syscalls.
   // However, we need to check the arguments of execve at its entrance.
-  if ((is_in_syscall_ && ev.syscall != SYSCALL_EXECVE) ||
+  if ((info->is_entry && ev.syscall != SYSCALL_EXECVE &&
+       ev.syscall != SYSCALL_EXECVEAT) ||
       ev.syscall == UNINTERESTING_SYSCALL)
     return;
 
-  int at_fd = AT_FDCWD;
-  int at_fd_arg_index = 0;
-  switch (ev.syscall) {
-  case SYSCALL_SYMLINKAT:
-    at_fd_arg_index = 1;
-    goto peek_at_fd;
-
-  case SYSCALL_FACCESSAT:
-  case SYSCALL_FCHMODAT:
-  case SYSCALL_FCHOWNAT:
-  case SYSCALL_FSTATAT:
-  case SYSCALL_FUTIMESAT:
-  case SYSCALL_LINKAT:
-  case SYSCALL_MKDIRAT:
-  case SYSCALL_MKNODAT:
-  case SYSCALL_OPENAT:
-  case SYSCALL_READLINKAT:
-  case SYSCALL_RENAMEAT:
-  case SYSCALL_UNLINKAT:
-  case SYSCALL_UTIMENSAT:
-  peek_at_fd:
-    at_fd = tracee_->getArgument(at_fd_arg_index);
-    break;
-
-  default:
-    break;
+  // Without seccomp, we stop at syscalls whose events do not pass, too.
+  // Skip them before reading any paths, unless we need them to follow
+  // fds and the cwd. Failed calls change nothing, except close.
+  bool changes_state = changesState(ev.syscall) &&
+      (!ev.error || ev.syscall == SYSCALL_CLOSE);
+  if (filter_ && !changes_state &&
+      !(info->is_entry ? filter_->mayMatch(ev.syscall) :
+        filter_->mayMatch(ev.syscall, ev.error != 0))) {
+    if (resolver_ && !ev.error && invalidatesResolver(ev.syscall))
+      invalidateResolver();
+    return;
   }
 
-  int path_arg_index = getPathArgIndex(ev.syscall);
-  if (path_arg_index >= 0) {
-    peekPathArgument(path_arg_index, at_fd, &ev.path);
-    //fprintf(stderr, "%s %s\n", getSyscallName(ev.syscall), ev.path.c_str());
+  const SyscallTraits& traits = getSyscallTraits(ev.syscall);
+  // Set for a call on an fd we did not see opened, e.g. fstat of the
+  // inherited stdout, which has no path to report.
+  bool unknown_fd = false;
+  if (traits.path_arg >= 0) {
+    int at_fd = traits.at_fd_arg >= 0 ?
+        getArgument(traits.at_fd_arg) : AT_FDCWD;
+    // futimens(3) is utimensat without a path.
+    bool empty_path =
+        ev.syscall == SYSCALL_UTIMENSAT && !getArgument(traits.path_arg);
+    if (traits.flags_arg >= 0)
+      empty_path |= getArgument(traits.flags_arg) & AT_EMPTY_PATH;
+    unknown_fd = !peekPathArgument(traits.path_arg, at_fd, empty_path,
+                                   &ev.path_id) && empty_path;
   }
 
-  ev.type = INVALID_EVENT_TYPE;
+  ev.type = traits.type;
   switch (ev.syscall) {
-  case SYSCALL_ACCESS:
-  case SYSCALL_FACCESSAT:
-  case SYSCALL_FSTATAT:
-  case SYSCALL_LSTAT:
-  case SYSCALL_READLINK:
-  case SYSCALL_READLINKAT:
-  case SYSCALL_STAT:
-  case SYSCALL_STATFS:
-    ev.type = READ_METADATA;
-    break;
-
-  case SYSCALL_ACCT:
-  case SYSCALL_CHMOD:
-  case SYSCALL_CHOWN:
-  case SYSCALL_FCHMODAT:
-  case SYSCALL_FCHOWNAT:
-  case SYSCALL_FUTIMESAT:
-  case SYSCALL_LCHOWN:
-  case SYSCALL_UTIME:
-  case SYSCALL_UTIMENSAT:
-    ev.type = WRITE_METADATA;
-    break;
-
   case SYSCALL_CREAT:
-  case SYSCALL_MKDIR:
-  case SYSCALL_MKDIRAT:
-  case SYSCALL_MKNOD:
-  case SYSCALL_MKNODAT:
-  case SYSCALL_SYMLINK:
-  case SYSCALL_SYMLINKAT:
-  case SYSCALL_TRUNCATE:
-    ev.type = WRITE_CONTENT;
-    break;
-
-  case SYSCALL_RMDIR:
-  case SYSCALL_UNLINK:
-  case SYSCALL_UNLINKAT:
-    ev.type = REMOVE_CONTENT;
+    if (retval >= 0)
+      setFd(retval, ev.path_id, false);
     break;
 
   case SYSCALL_CHDIR:
-    ev.type = READ_METADATA;
     if (!ev.error)
-      states_[pid_].cwd = normalizeDir(ev.path);
+      state_->proc->cwd = paths_->intern(normalizeDir(ev.path()));
     break;
 
-  case SYSCALL_CHROOT:
-    break;
-  case SYSCALL_CLONE:
-    handleClone(retval);
+  case SYSCALL_CLOSE:
+  case SYSCALL_CLOSE_RANGE:
+  case SYSCALL_DUP:
+  case SYSCALL_DUP2:
+  case SYSCALL_DUP3:
+  case SYSCALL_FCHDIR:
+  case SYSCALL_FCNTL:
+    handleFdSyscall(ev, retval);
     break;
+
   case SYSCALL_EXECVE:
+  case SYSCALL_EXECVEAT:
     handleExecve(&ev);
     break;
 
-  case SYSCALL_FORK:
-  case SYSCALL_VFORK:
-    handleFork(retval);
+  case SYSCALL_RENAMEAT2:
+    // Both files are kept, each with the content of the other.
+    if (getArgument(4) & RENAME_EXCHANGE)
+      ev.type = WRITE_CONTENT;
+    handleSecondPath(&ev, traits);
     break;
 
   case SYSCALL_LINK:
   case SYSCALL_LINKAT:
-    handleLink(&ev);
+  case SYSCALL_RENAME:
+  case SYSCALL_RENAMEAT:
+    handleSecondPath(&ev, traits);
     break;
 
   case SYSCALL_OPEN:
   case SYSCALL_OPENAT:
+  case SYSCALL_OPENAT2:
     handleOpen(&ev, retval);
     break;
 
-  case SYSCALL_RENAME:
-  case SYSCALL_RENAMEAT:
-    handleRename(&ev);
-    break;
-
   case SYSCALL_USELIB:
     // We do not support uselib.
     assert(0);
-  case UNINTERESTING_SYSCALL:
-    assert(0);
+  default:
+    // New children are handled by handleNewChild.
+    break;
   }
 
-  if (ev.type != INVALID_EVENT_TYPE) {
+  if (ev.type != INVALID_EVENT_TYPE && !unknown_fd) {
     if (ev.error) {
-      switch (ev.type) {
-      case READ_CONTENT:
-      case READ_METADATA:
-      case REMOVE_CONTENT:
-        ev.type = READ_FAILURE;
-        break;
-      case WRITE_CONTENT:
-      case WRITE_METADATA:
-        ev.type = WRITE_FAILURE;
-        break;
-      default:
-        assert(0);
-      }
+      assert(ev.type != READ_FAILURE && ev.type != WRITE_FAILURE);
+      ev.type = getFailureType(ev.type);
     }
+    sendEvent(ev);
+  }
 
-    for (size_t i = 0; i < handlers_.size(); i++)
-      handlers_[i]->handleEvent(ev);
+  if (resolver_ && !ev.error && invalidatesResolver(ev.syscall))
+    invalidateResolver();
+}
+
+void Tracer::invalidateResolver() {
+  if (group_) {
+    lock_guard<mutex> lock(group_->resolver_mu);
+    resolver_->invalidate();
+  } else {
+    resolver_->invalidate();
+  }
+}
+
+// Reads up to |size| bytes of the tracee's memory. Returns the number
+// of bytes read, which may be short when the range crosses an unmapped
+// page, or -1 when nothing could be read.
+ssize_t Tracer::readMemory(uintptr_t addr, char* buf, size_t size) {
+  if (use_process_vm_readv_) {
+    iovec local = { buf, size };
+    iovec remote = { reinterpret_cast<void*>(addr), size };
+    ssize_t r = process_vm_readv(pid_, &local, 1, &remote, 1, 0);
+    if (r >= 0 || (errno != ENOSYS && errno != EPERM))
+      return r;
+    // The kernel does not allow process_vm_readv. Use PTRACE_PEEKDATA.
+    use_process_vm_readv_ = false;
   }
+
+  size_t done = 0;
+  while (done < size) {
+    uintptr_t word_addr = (addr + done) & ~(sizeof(long) - 1);
+    size_t offset = addr + done - word_addr;
+    errno = 0;
+    long val = ptrace(PTRACE_PEEKDATA, pid_, word_addr, 0);
+    if (val == -1 && errno)
+      return done ? static_cast<ssize_t>(done) : -1;
+    size_t len = min(sizeof(val) - offset, size - done);
+    memcpy(buf + done, reinterpret_cast<char*>(&val) + offset, len);
+    done += len;
+  }
+  return done;
 }
 
-bool Tracer::peekStringArgument(int arg, string* path) const {
-  char* ptr = reinterpret_cast<char*>(tracee_->getArgument(arg));
-  if (!ptr)
+int64_t Tracer::getArgument(int n) {
+  return state_->syscall.args[n];
+}
+
+bool Tracer::peekStringArgument(int arg, string* path) {
+  uintptr_t addr = getArgument(arg);
+  if (!addr)
     return false;
+  // Read chunks which never cross a page boundary so we do not fault on
+  // the page after the string. PTRACE_PEEKDATA costs a syscall per word,
+  // so read a word at a time in that case.
+  static const size_t kPageSize = sysconf(_SC_PAGESIZE);
   for (;;) {
-    // TOOD(hamaji): Handle ptrace failures.
-    long val = PTRACE(PEEKDATA, pid_, ptr, 0);
-    path->resize(path->size() + sizeof(val));
-    memcpy(&(*path)[path->size() - sizeof(val)], &val, sizeof(val));
-    size_t len = strlen(path->c_str());
-    if (len != path->size()) {
-      path->resize(len);
+    size_t unit = use_process_vm_readv_ ? kPageSize : sizeof(long);
+    size_t chunk = unit - addr % unit;
+    size_t old_size = path->size();
+    path->resize(old_size + chunk);
+    ssize_t r = readMemory(addr, &(*path)[old_size], chunk);
+    if (stats_ && r > 0)
+      stats_->addBytesPeeked(r);
+    if (r <= 0) {
+      path->resize(old_size);
+      return false;
+    }
+    // Only scan the bytes we have just read.
+    const char* nul = static_cast<const char*>(
+        memchr(&(*path)[old_size], '\0', r));
+    if (nul) {
+      path->resize(nul - path->data());
       return true;
     }
-    ptr += sizeof(val);
+    path->resize(old_size + r);
+    addr += r;
   }
 }
 
-bool Tracer::peekPathArgument(int arg, int at_fd, string* path) {
-  if (!peekStringArgument(arg, path))
+bool Tracer::peekPathArgument(int arg, int at_fd, bool empty_path,
+                              PathId* path_id) {
+  peek_buf_.clear();
+  uint64_t start = stats_ ? getNanoTime() : 0;
+  bool ok = peekStringArgument(arg, &peek_buf_);
+  if (stats_)
+    stats_->addPeek(getNanoTime() - start);
+  // Without |empty_path|, the call fails with an empty path and there is
+  // no file to report. With it, the path is |at_fd| itself, which falls
+  // out of appending the empty path to its directory below.
+  if (empty_path && !getArgument(arg))
+    ok = true;
+  if (!ok || (peek_buf_.empty() && !empty_path))
     return false;
-  if ((*path)[0] != '/') {
-    if (at_fd == AT_FDCWD) {
-      *path = states_[pid_].cwd + *path;
+  if (peek_buf_[0] == '/') {
+    *path_id = internPath(&peek_buf_);
+    return true;
+  }
+
+  if (at_fd == AT_FDCWD) {
+    PathId cwd = state_->proc->cwd;
+    path_buf_.assign(paths_->str(cwd), paths_->size(cwd));
+  } else {
+    const FdState* fd = getFd(at_fd);
+    if (fd) {
+      path_buf_.assign(paths_->str(fd->path), paths_->size(fd->path));
+      while (!path_buf_.empty() && path_buf_[path_buf_.size() - 1] == '/')
+        path_buf_.resize(path_buf_.size() - 1);
+      path_buf_.push_back('/');
+    } else if (peek_buf_.empty()) {
+      // The fd itself, which was not opened by a path we saw.
+      return false;
     } else {
-      const ProcessState& state = states_[pid_];
-      map<int, string>::const_iterator found = state.fds.find(at_fd);
-      if (found != state.fds.end()) {
-        *path = normalizeDir(found->second) + *path;
-      } else {
-        *path = "<bad fd>/" + *path;
-      }
+      path_buf_ = "<bad fd>/";
     }
   }
+  path_buf_ += peek_buf_;
+  *path_id = internPath(&path_buf_);
   return true;
 }
 
+// Normalizes |path| in place and interns it.
+PathId Tracer::internPath(string* path) {
+  path->resize(normalizePath(&(*path)[0], path->size()));
+  if (resolver_) {
+    unique_lock<mutex> lock;
+    if (group_)
+      lock = unique_lock<mutex>(group_->resolver_mu);
+    return resolver_->resolve(path->data(), path->size());
+  }
+  return paths_->intern(*path);
+}
+
+// Whether |ev| may pass the filter by its syscall and type, before its
+// path is read.
+bool Tracer::mayMatchType(const Event& ev) const {
+  return !filter_ || filter_->matchesType(
+      ev.syscall, ev.error ? getFailureType(ev.type) : ev.type);
+}
+
 void Tracer::sendEvent(const Event& event) {
+  if (filter_ && !filter_->matches(event))
+    return;
+  unique_lock<mutex> lock;
+  if (group_)
+    lock = unique_lock<mutex>(group_->handler_mu);
+  if (stats_) {
+    for (size_t i = 0; i < handlers_.size(); i++) {
+      uint64_t start = getNanoTime();
+      handlers_[i]->handleEvent(event);
+      stats_->handler(i)->add(getNanoTime() - start);
+    }
+    return;
+  }
   for (size_t i = 0; i < handlers_.size(); i++)
     handlers_[i]->handleEvent(event);
 }
 
+void Tracer::sendFork(int parent_pid, int pid) {
+  unique_lock<mutex> lock;
+  if (group_)
+    lock = unique_lock<mutex>(group_->handler_mu);
+  for (size_t i = 0; i < handlers_.size(); i++)
+    handlers_[i]->handleFork(parent_pid, pid);
+}
+
+void Tracer::sendExec(int pid, const vector<string>& args) {
+  unique_lock<mutex> lock;
+  if (group_)
+    lock = unique_lock<mutex>(group_->handler_mu);
+  for (size_t i = 0; i < handlers_.size(); i++)
+    handlers_[i]->handleExec(pid, args);
+}
+
+static uint64_t getNanos(const timeval& tv) {
+  return tv.tv_sec * 1000000000ULL + tv.tv_usec * 1000ULL;
+}
+
+void Tracer::sendProcessTimes(int pid, const ProcessState& proc,
+                              int status) {
+  ProcessTimes times;
+  times.start_ns = proc.start_ns;
+  times.exit_ns = getNanoTime();
+  times.user_ns = getNanos(rusage_.ru_utime);
+  times.sys_ns = getNanos(rusage_.ru_stime);
+  times.max_rss_kb = rusage_.ru_maxrss;
+  times.status = status;
+  unique_lock<mutex> lock;
+  if (group_)
+    lock = unique_lock<mutex>(group_->handler_mu);
+  for (size_t i = 0; i < handlers_.size(); i++)
+    handlers_[i]->handleProcessTimes(pid, times);
+}
+
+void Tracer::sendExit(int pid) {
+  unique_lock<mutex> lock;
+  if (group_)
+    lock = unique_lock<mutex>(group_->handler_mu);
+  for (size_t i = 0; i < handlers_.size(); i++)
+    handlers_[i]->handleExit(pid);
+}
+
+const Tracer::FdState* Tracer::getFd(int fd) {
+  const vector<FdState>& fds = state_->proc->fds;
+  if (fd < 0 || static_cast<size_t>(fd) >= fds.size() || !fds[fd].is_open)
+    return NULL;
+  return &fds[fd];
+}
+
+void Tracer::setFd(int fd, PathId path, bool cloexec) {
+  vector<FdState>* fds = &state_->proc->fds;
+  if (static_cast<size_t>(fd) >= fds->size())
+    fds->resize(fd + 1);
+  FdState* s = &(*fds)[fd];
+  s->path = path;
+  s->is_open = true;
+  s->cloexec = cloexec;
+}
+
 void Tracer::handleOpen(Event* ev, int fd) {
-  assert(ev->syscall == SYSCALL_OPEN || ev->syscall == SYSCALL_OPENAT);
-  if (fd >= 0) {
-    states_[pid_].fds[fd] = ev->path;
+  int64_t flag;
+  switch (ev->syscall) {
+  case SYSCALL_OPEN:
+    flag = getArgument(1);
+    break;
+  case SYSCALL_OPENAT:
+    flag = getArgument(2);
+    break;
+  case SYSCALL_OPENAT2: {
+    // The flags are the first field of struct open_how. If it cannot be
+    // read, neither could the kernel, and the call failed.
+    uint64_t how_flags = 0;
+    if (readMemory(getArgument(2), reinterpret_cast<char*>(&how_flags),
+                   sizeof(how_flags)) != sizeof(how_flags)) {
+      how_flags = 0;
+    }
+    flag = how_flags;
+    break;
   }
+  default:
+    assert(0);
+  }
+  if (fd >= 0)
+    setFd(fd, ev->path_id, flag & O_CLOEXEC);
 
-  int flag_arg_index = ev->syscall == SYSCALL_OPEN ? 1 : 2;
-  int64_t flag = tracee_->getArgument(flag_arg_index);
   switch (flag & O_ACCMODE) {
   case O_WRONLY:
     ev->type = WRITE_CONTENT;
@@ -387,57 +1106,346 @@ void Tracer::handleOpen(Event* ev, int fd) {
   }
 }
 
+void Tracer::handleFdSyscall(const Event& ev, int64_t retval) {
+  int fd = getArgument(0);
+  if (ev.syscall == SYSCALL_CLOSE) {
+    // The fd is released even if close fails, except with EBADF.
+    if (ev.error != EBADF && getFd(fd))
+      state_->proc->fds[fd].is_open = false;
+    return;
+  }
+  if (ev.error)
+    return;
+
+  if (ev.syscall == SYSCALL_CLOSE_RANGE) {
+    vector<FdState>* fds = &state_->proc->fds;
+    uint32_t last = getArgument(1);
+    bool cloexec = getArgument(2) & CLOSE_RANGE_CLOEXEC;
+    for (size_t i = static_cast<uint32_t>(fd);
+         i <= last && i < fds->size(); i++) {
+      if (cloexec)
+        (*fds)[i].cloexec = true;
+      else
+        (*fds)[i].is_open = false;
+    }
+    return;
+  }
+
+  const FdState* old_fd = getFd(fd);
+  switch (ev.syscall) {
+  case SYSCALL_DUP:
+  case SYSCALL_DUP2:
+  case SYSCALL_DUP3: {
+    // dup2 of the same fd keeps the close-on-exec flag.
+    if (ev.syscall == SYSCALL_DUP2 && retval == fd)
+      break;
+    bool cloexec =
+        ev.syscall == SYSCALL_DUP3 && (getArgument(2) & O_CLOEXEC);
+    if (old_fd)
+      setFd(retval, old_fd->path, cloexec);
+    else if (getFd(retval))
+      state_->proc->fds[retval].is_open = false;
+    break;
+  }
+
+  case SYSCALL_FCHDIR:
+    state_->proc->cwd = old_fd ?
+        paths_->intern(normalizeDir(paths_->str(old_fd->path))) :
+        paths_->intern("<bad fd>/");
+    break;
+
+  case SYSCALL_FCNTL:
+    switch (getArgument(1)) {
+    case F_DUPFD:
+    case F_DUPFD_CLOEXEC:
+      if (old_fd)
+        setFd(retval, old_fd->path, getArgument(1) == F_DUPFD_CLOEXEC);
+      else if (getFd(retval))
+        state_->proc->fds[retval].is_open = false;
+      break;
+    case F_SETFD:
+      if (old_fd)
+        state_->proc->fds[fd].cloexec = getArgument(2) & FD_CLOEXEC;
+      break;
+    default:
+      break;
+    }
+    break;
+
+  default:
+    assert(0);
+  }
+}
+
+void Tracer::handleNewChild(int event) {
+  unsigned long pid;
+  PTRACE(GETEVENTMSG, pid_, 0, &pid);
+  if (event == PTRACE_EVENT_CLONE) {
+    handleClone(pid);
+  } else {
+    handleFork(pid, true);
+  }
+}
+
 void Tracer::handleClone(int pid) {
-  int64_t flag = tracee_->getArgument(0);
-  if (flag & CLONE_THREAD)
+  // The flags of clone3 are in the tracee's memory, so tell threads by
+  // their tgid.
+  char buf[64];
+  snprintf(buf, sizeof(buf), "/proc/%d/task/%d", state_->tgid, pid);
+  struct stat st;
+  if (stat(buf, &st) == 0) {
+    handleNewThread(pid);
     return;
-  handleFork(pid);
+  }
+  // Only forks are handed over to other shards. A clone may share more
+  // than the tracer knows with its parent.
+  handleFork(pid, false);
 }
 
-void Tracer::handleFork(int pid) {
+// Returns true if |pid| stopped before its parent reported it, and
+// forgets it.
+bool Tracer::takePendingChild(int pid) {
+  vector<int>::iterator found =
+      find(pending_children_.begin(), pending_children_.end(), pid);
+  if (found == pending_children_.end())
+    return false;
+  pending_children_.erase(found);
+  return true;
+}
+
+void Tracer::handleNewThread(int tid) {
+  if (tid <= 0)
+    return;
+  ThreadState* thread = addThread(tid, state_->tgid);
+  thread->has_seccomp_filter = state_->has_seccomp_filter;
+  if (takePendingChild(tid))
+    resume(tid, thread, 0);
+}
+
+void Tracer::handleFork(int pid, bool may_hand_off) {
   if (!follow_children_ || pid <= 0)
     return;
-  CHECK(pids_.insert(pid).second);
-  states_[pid].args = states_[pid_].args;
-  states_[pid].cwd = states_[pid_].cwd;
+  ThreadState* child = addThread(pid, pid);
+  CHECK(child->proc->num_threads == 1);
+  const ProcessState* parent = state_->proc;
+  child->proc->args = parent->args;
+  child->proc->exe = parent->exe;
+  child->proc->cwd = parent->cwd;
+  child->proc->fds = parent->fds;
+  child->has_seccomp_filter = state_->has_seccomp_filter;
+  // The child runs only after this, so this comes before its events.
+  sendFork(state_->tgid, pid);
+  if (group_ && may_hand_off)
+    child->hand_off_to = pickShard();
+  if (takePendingChild(pid)) {
+    if (child->hand_off_to >= 0)
+      handOff(pid, child);
+    else
+      resume(pid, child, 0);
+  }
+}
+
+// Returns the shard with the fewest threads if handing the new child
+// over to it balances the shards better, or -1 to keep it. The number
+// of threads is a rough measure of load, since many of them only wait
+// for their children.
+int Tracer::pickShard() const {
+  // Includes the new child.
+  size_t best_traced = num_traced_.load(memory_order_relaxed);
+  int best = -1;
+  for (size_t i = 0; i < group_->shards.size(); i++) {
+    size_t n = group_->shards[i]->num_traced_.load(memory_order_relaxed) + 1;
+    if (n < best_traced) {
+      best = i;
+      best_traced = n;
+    }
+  }
+  return best;
+}
+
+// Moves |pid|, a new process at its first stop, to the shard picked for
+// it. The process is parked before the detach, so it makes no syscall
+// and no signal, SIGCONT included, runs it until the other shard seizes
+// it. It stays on this shard where it cannot be parked.
+void Tracer::handOff(int pid, ThreadState* state) {
+  Tracer* to = group_->shards[state->hand_off_to];
+  state->hand_off_to = -1;
+  HandOff h;
+  if (!tracee_->park(pid, &h.regs)) {
+    resume(pid, state, 0);
+    return;
+  }
+  h.pid = pid;
+  h.thread = *state;
+  h.proc = *state->proc;
+  PTRACE(DETACH, pid, 0, 0);
+  {
+    lock_guard<mutex> lock(group_->mu);
+    to->inbox_.push_back(h);
+    to->inbox_size_++;
+    to->num_traced_++;
+  }
+  threads_.erase(pid);
+  procs_.erase(pid);
+  num_traced_--;
+  to->kick();
+}
+
+// Seizes the processes other shards handed over, and interrupts each to
+// unpark it.
+void Tracer::takeInbox() {
+  if (!inbox_size_)
+    return;
+  vector<HandOff> inbox;
+  {
+    lock_guard<mutex> lock(group_->mu);
+    inbox.swap(inbox_);
+    inbox_size_ = 0;
+  }
+  for (size_t i = 0; i < inbox.size(); i++) {
+    const HandOff& h = inbox[i];
+    int status = 0;
+    if (ptrace(PTRACE_SEIZE, h.pid, 0, getPtraceOptions()) < 0 ||
+        ptrace(PTRACE_INTERRUPT, h.pid, 0, 0) < 0 ||
+        waitpid(h.pid, &status, __WALL | __WNOTHREAD) < 0 ||
+        !WIFSTOPPED(status)) {
+      // Killed while it was parked.
+      sendExit(h.pid);
+      num_traced_--;
+      countExit();
+      continue;
+    }
+    // Counted by the shard which handed it over.
+    bool inserted;
+    ThreadState* thread = threads_.insert(h.pid, &inserted);
+    *thread = h.thread;
+    thread->status = status;
+    thread->proc = procs_.insert(h.pid, &inserted);
+    *thread->proc = h.proc;
+    tracee_->unpark(h.pid, h.regs);
+    resume(h.pid, thread, 0);
+  }
+}
+
+void Tracer::kick() {
+  group_->cond.notify_all();
+  pthread_kill(thread_, kKickSignal);
+}
+
+// Waits for a stop of a thread of this shard. Returns false when the
+// run finished.
+bool Tracer::waitShard(int* status) {
+  for (;;) {
+    takeInbox();
+    if (group_->done)
+      return false;
+    if (threads_.empty()) {
+      unique_lock<mutex> lock(group_->mu);
+      while (!inbox_size_ && !group_->done)
+        group_->cond.wait(lock);
+      continue;
+    }
+
+    // Kicked, so check the inbox again.
+    if (sigsetjmp(g_kick_jmp, 1))
+      continue;
+    g_kick_armed = 1;
+    if (inbox_size_ || group_->done) {
+      g_kick_armed = 0;
+      continue;
+    }
+    // WNOWAIT leaves the stop to be consumed after the kick is
+    // disarmed.
+    siginfo_t info;
+    int r = waitid(P_ALL, 0, &info,
+                   WEXITED | WSTOPPED | WNOWAIT | __WALL | __WNOTHREAD);
+    g_kick_armed = 0;
+    PCHECK(r == 0);
+    pid_ = wait4(info.si_pid, status, __WALL | __WNOTHREAD,
+                 process_times_ ? &rusage_ : NULL);
+    return true;
+  }
+}
+
+// Counts a thread which is no longer traced, and ends the run after the
+// last one.
+void Tracer::countExit() {
+  if (--group_->live)
+    return;
+  {
+    lock_guard<mutex> lock(group_->mu);
+    group_->done = true;
+  }
+  for (size_t i = 0; i < group_->shards.size(); i++) {
+    if (group_->shards[i] != this)
+      group_->shards[i]->kick();
+  }
 }
 
 void Tracer::handleExecve(Event* ev) {
-  ProcessState* state = &states_[pid_];
-  if (ev->error == ENOSYS) {
-    vector<string>* args = &state->args;
-    args->clear();
-    args->push_back(ev->path);
-    // TODO(hamaji): Copy all arguments.
-    state->execve_handled = false;
-  } else if (!state->execve_handled) {
-    // We stop three times (syscall-enter-stop, execve-stop, and
-    // syscall-exit-stop) for a single execve. Ignore the last stop by
-    // checking execve_handled.
-    ev->path = state->args[0];
+  ProcessState* proc = state_->proc;
+  if (state_->syscall.is_entry) {
+    proc->exe = ev->path_id;
+  } else if (ev->error) {
+    // A successful execve is reported by handleExecEvent.
+    ev->path_id = proc->exe;
     ev->type = READ_CONTENT;
-    state->execve_handled = true;
   }
 }
 
-void Tracer::handleRename(Event* ev) {
-  assert(ev->syscall == SYSCALL_RENAME || ev->syscall == SYSCALL_RENAMEAT);
-  ev->type = ev->error ? READ_FAILURE : REMOVE_CONTENT;
-  sendEvent(*ev);
-  ev->type = WRITE_CONTENT;
-  ev->path.clear();
-  int64_t newpath_arg_index = ev->syscall == SYSCALL_RENAME ? 1 : 2;
-  peekPathArgument(newpath_arg_index, AT_FDCWD, &ev->path);
+// Called at PTRACE_EVENT_EXEC, i.e., when an execve succeeded.
+void Tracer::handleExecEvent() {
+  unsigned long old_tid;
+  PTRACE(GETEVENTMSG, pid_, 0, &old_tid);
+  if (static_cast<int>(old_tid) != pid_) {
+    // A thread other than the leader called execve. It took over the
+    // tid of the leader, and its old tid is gone without an exit. The
+    // other threads exit.
+    if (ThreadState* old = threads_.find(old_tid)) {
+      state_->has_seccomp_filter = old->has_seccomp_filter;
+      state_->syscall = old->syscall;
+    }
+    removeThread(old_tid);
+  }
+
+  ProcessState* proc = state_->proc;
+  for (size_t i = 0; i < proc->fds.size(); i++) {
+    if (proc->fds[i].cloexec)
+      proc->fds[i].is_open = false;
+  }
+  // Skip the syscall-exit-stop, which tells nothing new.
+  state_->syscall.is_entry = false;
+
+  Event ev;
+  ev.pid = state_->tgid;
+  ev.syscall = state_->syscall.syscall == SYSCALL_EXECVEAT ?
+      SYSCALL_EXECVEAT : SYSCALL_EXECVE;
+  ev.type = READ_CONTENT;
+  ev.error = 0;
+  ev.path_id = proc->exe;
+  sendEvent(ev);
+
+  // The new program is stopped before it runs, so its arguments are
+  // intact.
+  readCommandLine(pid_, &proc->args);
+  sendExec(state_->tgid, proc->args);
 }
 
-void Tracer::handleLink(Event* ev) {
-  assert(ev->syscall == SYSCALL_LINK || ev->syscall == SYSCALL_LINKAT);
-  ev->type = ev->error ? READ_FAILURE : READ_METADATA;
+// Sends the event of the first path of rename and link, and makes |ev|
+// the event of the second, which is written.
+void Tracer::handleSecondPath(Event* ev, const SyscallTraits& traits) {
+  if (ev->error)
+    ev->type = getFailureType(ev->type);
   sendEvent(*ev);
   ev->type = WRITE_CONTENT;
-  ev->path.clear();
-  int64_t newpath_arg_index = ev->syscall == SYSCALL_LINK ? 1 : 3;
-  peekPathArgument(newpath_arg_index, AT_FDCWD, &ev->path);
+  if (!mayMatchType(*ev)) {
+    ev->type = INVALID_EVENT_TYPE;
+    return;
+  }
+  ev->path_id = PathTable::kEmptyPathId;
+  int at_fd = traits.at_fd2_arg >= 0 ?
+      getArgument(traits.at_fd2_arg) : AT_FDCWD;
+  peekPathArgument(traits.path2_arg, at_fd, false, &ev->path_id);
 }
 
 }  // namespace katd
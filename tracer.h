@@ -1,16 +1,28 @@
 #ifndef KATD_TRACER_H_
 #define KATD_TRACER_H_
 
-#include <map>
-#include <set>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+
+#include <atomic>
 #include <string>
 #include <vector>
 
+#include "path_table.h"
+#include "pid_table.h"
+#include "tracee.h"
+
 namespace katd {
 
 struct Event;
+struct ProcessTimes;
+struct SyscallTraits;
+class EventFilter;
 class Handler;
-class Tracee;
+class SymlinkResolver;
+class TracerStats;
 
 class Tracer {
 public:
@@ -21,41 +33,177 @@ public:
   void run();
 
   void set_follow_children(bool f) { follow_children_ = f; }
+  // Traces the running process |pid| instead of running argv. With
+  // follow_children, its existing descendants are traced too. SIGINT
+  // detaches from all of them.
+  void set_attach_pid(int pid) { attach_pid_ = pid; }
+  // Resolves symlinks in the directories of paths.
+  void set_resolve_symlinks(bool r);
+  // Reads strings with PTRACE_PEEKDATA a word at a time instead of
+  // process_vm_readv. Slower, but useful to compare the two.
+  void set_use_process_vm_readv(bool u) { use_process_vm_readv_ = u; }
+
+  // Traces with |n| threads. Each thread is the tracer of a part of the
+  // process tree, and new processes go to the thread with the fewest.
+  // Handlers are called by one thread at a time. Only with
+  // follow_children, and not when attaching. Processes move only on
+  // x86_64; see handOff.
+  void set_num_threads(int n) { num_threads_ = n; }
+
+  // Reports only the events which pass |filter|. Syscalls none of whose
+  // events pass are not stopped at, unless the tracer needs them to
+  // follow fds and the cwd, and the paths of the rest are read only if
+  // their type passes.
+  void set_filter(const EventFilter& filter);
+
+  // Collects where the tracer spends its time into |stats|.
+  void set_stats(TracerStats* stats) { stats_ = stats; }
+
+  // Sends the times of each process to Handler::handleProcessTimes.
+  // Off by default, since wait4 reads the resource usage at every stop.
+  void set_process_times(bool p) { process_times_ = p; }
+
+  // The wait status of the command after |run|, or -1 if katd attached
+  // to it.
+  int exit_status() const { return exit_status_; }
 
 private:
+  struct FdState {
+    FdState();
+    PathId path;
+    bool is_open;
+    bool cloexec;
+  };
+
+  // Shared by the threads of a process.
   struct ProcessState {
     ProcessState();
     std::vector<std::string> args;
+    // The program passed to the last execve.
+    PathId exe;
+    // Ends with a slash.
+    PathId cwd;
+    // Indexed by fd. Fds not opened by open-like syscalls, e.g. pipes
+    // and the inherited stdio, are not open.
+    std::vector<FdState> fds;
+    // Traced threads. The process exits with the last one.
+    int num_threads;
+    // From getNanoTime, with process_times.
+    uint64_t start_ns;
+  };
+
+  struct ThreadState {
+    ThreadState();
     int status;
-    bool execve_handled;
-    std::string cwd;
-    std::map<int, std::string> fds;
+    // Whether the thread runs with our seccomp filter. Threads we
+    // seized do not.
+    bool has_seccomp_filter;
+    SyscallInfo syscall;
+    int tgid;
+    ProcessState* proc;
+    // The shard which takes over the process at its first stop, or -1.
+    int hand_off_to;
   };
 
+  // A new process moving to another shard.
+  struct HandOff {
+    int pid;
+    ThreadState thread;
+    ProcessState proc;
+    // Saved by Tracee::park.
+    std::string regs;
+  };
+
+  // The tracers of a sharded run. Defined in tracer.cc.
+  struct ShardGroup;
+
+  int getPtraceOptions() const;
+  void getTracedSyscalls(std::vector<bool>* traced) const;
   void attach();
-  void setupSeccomp();
+  void seize();
+  bool seizeProcess(int pid);
+  bool seizeThread(int tid);
+  ThreadState* addThread(int tid, int tgid);
+  void removeThread(int tid);
+  void countExit();
+  void loadProcessState(int pid, ProcessState* state);
+  void detachAll();
+  void traceLoop();
+  void runShards();
+  bool waitShard(int* status);
+  void takeInbox();
+  void kick();
+  int pickShard() const;
+  void handOff(int pid, ThreadState* state);
+  void resume(int pid, const ThreadState* state, int sig);
   bool wait();
   void handleSyscall();
-  bool peekStringArgument(int arg_index, std::string* path) const;
-  bool peekPathArgument(int arg_index, int at_fd, std::string* path);
+  int64_t getArgument(int n);
+  ssize_t readMemory(uintptr_t addr, char* buf, size_t size);
+  bool peekStringArgument(int arg_index, std::string* path);
+  bool peekPathArgument(int arg_index, int at_fd, bool empty_path,
+                        PathId* path_id);
+  PathId internPath(std::string* path);
+  void invalidateResolver();
+  bool mayMatchType(const Event& ev) const;
   void sendEvent(const Event& event);
+  void sendFork(int parent_pid, int pid);
+  void sendExec(int pid, const std::vector<std::string>& args);
+  void sendProcessTimes(int pid, const ProcessState& proc, int status);
+  void sendExit(int pid);
 
+  const FdState* getFd(int fd);
+  void setFd(int fd, PathId path, bool cloexec);
   void handleOpen(Event* ev, int fd);
+  void handleFdSyscall(const Event& ev, int64_t retval);
+  void handleNewChild(int event);
   void handleClone(int pid);
-  void handleFork(int pid);
+  bool takePendingChild(int pid);
+  void handleNewThread(int tid);
+  void handleFork(int pid, bool may_hand_off);
   void handleExecve(Event* ev);
-  void handleRename(Event* ev);
-  void handleLink(Event* ev);
+  void handleExecEvent();
+  void handleSecondPath(Event* ev, const SyscallTraits& traits);
 
   Tracee* tracee_;
   char** argv_;
   int root_pid_;
+  int attach_pid_;
+  int exit_status_;
   int pid_;
   std::vector<Handler*> handlers_;
   bool follow_children_;
-  std::set<int> pids_;
-  std::map<int, ProcessState> states_;
-  bool is_in_syscall_;
+  // By tid.
+  PidTable<ThreadState> threads_;
+  // By tgid.
+  PidTable<ProcessState> procs_;
+  // The state of |pid_|, looked up once per stop.
+  ThreadState* state_;
+  // New children which stopped before their parents reported them.
+  std::vector<int> pending_children_;
+  bool use_process_vm_readv_;
+  PathTable* paths_;
+  SymlinkResolver* resolver_;
+  // Owned, and copied for each shard.
+  EventFilter* filter_;
+  TracerStats* stats_;
+  bool process_times_;
+  // Of the last stop, with process_times.
+  struct rusage rusage_;
+  int num_threads_;
+  // NULL unless sharded.
+  ShardGroup* group_;
+  int shard_;
+  pthread_t thread_;
+  // Processes other shards handed over, guarded by the group.
+  std::vector<HandOff> inbox_;
+  std::atomic<size_t> inbox_size_;
+  // Threads this shard traces, including those in |inbox_|. Read by
+  // other shards to pick one.
+  std::atomic<size_t> num_traced_;
+  // Reused to build paths without allocations.
+  std::string peek_buf_;
+  std::string path_buf_;
 };
 
 }  // namespace katd
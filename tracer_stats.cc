@@ -0,0 +1,189 @@
+#include "tracer_stats.h"
+
+#include <cxxabi.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <typeinfo>
+
+#include "handler.h"
+
+using namespace std;
+
+namespace katd {
+
+LatencyHistogram::LatencyHistogram()
+  : count_(0),
+    total_ns_(0),
+    max_ns_(0) {
+  memset(buckets_, 0, sizeof(buckets_));
+}
+
+void LatencyHistogram::add(uint64_t ns) {
+  int bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+  if (bucket >= kNumBuckets)
+    bucket = kNumBuckets - 1;
+  buckets_[bucket]++;
+  count_++;
+  total_ns_ += ns;
+  if (ns > max_ns_)
+    max_ns_ = ns;
+}
+
+void LatencyHistogram::merge(const LatencyHistogram& other) {
+  for (int i = 0; i < kNumBuckets; i++)
+    buckets_[i] += other.buckets_[i];
+  count_ += other.count_;
+  total_ns_ += other.total_ns_;
+  if (other.max_ns_ > max_ns_)
+    max_ns_ = other.max_ns_;
+}
+
+uint64_t LatencyHistogram::getPercentile(double p) const {
+  uint64_t rank = count_ * p / 100;
+  uint64_t seen = 0;
+  for (int i = 0; i < kNumBuckets; i++) {
+    seen += buckets_[i];
+    if (seen > rank)
+      return min(1ULL << i, static_cast<unsigned long long>(max_ns_));
+  }
+  return max_ns_;
+}
+
+void LatencyHistogram::printJson(FILE* fp) const {
+  fprintf(fp, "{\"count\":%llu,\"total_ns\":%llu,\"max_ns\":%llu,"
+          "\"buckets\":[",
+          static_cast<unsigned long long>(count_),
+          static_cast<unsigned long long>(total_ns_),
+          static_cast<unsigned long long>(max_ns_));
+  // Trailing empty buckets are omitted.
+  int n = kNumBuckets;
+  while (n && !buckets_[n - 1])
+    n--;
+  for (int i = 0; i < n; i++) {
+    fprintf(fp, "%s%llu", i ? "," : "",
+            static_cast<unsigned long long>(buckets_[i]));
+  }
+  fputs("]}", fp);
+}
+
+TracerStats::TracerStats()
+  : other_stops_(0),
+    bytes_peeked_(0),
+    start_ns_(0),
+    wall_ns_(0) {
+  memset(stops_, 0, sizeof(stops_));
+}
+
+LatencyHistogram* TracerStats::handler(size_t i) {
+  if (i >= handlers_.size()) {
+    handlers_.resize(i + 1);
+    handler_names_.resize(i + 1);
+  }
+  return &handlers_[i];
+}
+
+void TracerStats::merge(const TracerStats& other) {
+  for (int i = 0; i < NUM_SYSCALLS; i++) {
+    stops_[i][0] += other.stops_[i][0];
+    stops_[i][1] += other.stops_[i][1];
+  }
+  other_stops_ += other.other_stops_;
+  wait_.merge(other.wait_);
+  get_syscall_info_.merge(other.get_syscall_info_);
+  peek_.merge(other.peek_);
+  bytes_peeked_ += other.bytes_peeked_;
+  for (size_t i = 0; i < other.handlers_.size(); i++)
+    handler(i)->merge(other.handlers_[i]);
+}
+
+void TracerStats::setHandler(size_t i, const Handler& handler) {
+  this->handler(i);
+  const char* mangled = typeid(handler).name();
+  int status;
+  char* name = abi::__cxa_demangle(mangled, NULL, NULL, &status);
+  handler_names_[i] = name ? name : mangled;
+  free(name);
+  if (!handler_names_[i].compare(0, 6, "katd::"))
+    handler_names_[i].erase(0, 6);
+}
+
+static void printTimerRow(FILE* fp, const string& name,
+                          const LatencyHistogram& h) {
+  fprintf(fp, "%-28s %10llu %10.1f %9.2f %9.2f %9.2f %9.2f\n",
+          name.c_str(), static_cast<unsigned long long>(h.count()),
+          h.total_ns() / 1e6,
+          h.count() ? h.total_ns() / 1e3 / h.count() : 0.0,
+          h.getPercentile(50) / 1e3, h.getPercentile(99) / 1e3,
+          h.max_ns() / 1e3);
+}
+
+void TracerStats::printTable(FILE* fp) const {
+  fprintf(fp, "wall time: %.1f ms\n\n", wall_ns_ / 1e6);
+  fprintf(fp, "%-28s %10s %10s\n", "syscall", "entry", "exit");
+  uint64_t total[2] = {};
+  for (int i = 0; i < NUM_SYSCALLS; i++) {
+    if (!stops_[i][true] && !stops_[i][false])
+      continue;
+    const char* name =
+        i == UNINTERESTING_SYSCALL ? "(uninteresting)" :
+        getSyscallName(static_cast<Syscall>(i));
+    fprintf(fp, "%-28s %10llu %10llu\n", name,
+            static_cast<unsigned long long>(stops_[i][true]),
+            static_cast<unsigned long long>(stops_[i][false]));
+    total[0] += stops_[i][true];
+    total[1] += stops_[i][false];
+  }
+  fprintf(fp, "%-28s %10llu %10llu\n", "(total)",
+          static_cast<unsigned long long>(total[0]),
+          static_cast<unsigned long long>(total[1]));
+  fprintf(fp, "%-28s %10llu\n\n", "(other stops)",
+          static_cast<unsigned long long>(other_stops_));
+
+  fprintf(fp, "%-28s %10s %10s %9s %9s %9s %9s\n",
+          "timer", "count", "total ms", "mean us", "p50 us", "p99 us",
+          "max us");
+  printTimerRow(fp, "wait", wait_);
+  printTimerRow(fp, "get syscall info", get_syscall_info_);
+  printTimerRow(fp, "peek string", peek_);
+  for (size_t i = 0; i < handlers_.size(); i++)
+    printTimerRow(fp, "handler " + handler_names_[i], handlers_[i]);
+  fprintf(fp, "\nbytes peeked: %llu\n",
+          static_cast<unsigned long long>(bytes_peeked_));
+}
+
+void TracerStats::printJson(FILE* fp) const {
+  fprintf(fp, "{\"wall_ns\":%llu,\"stops\":{",
+          static_cast<unsigned long long>(wall_ns_));
+  bool first = true;
+  for (int i = 0; i < NUM_SYSCALLS; i++) {
+    if (!stops_[i][true] && !stops_[i][false])
+      continue;
+    const char* name =
+        i == UNINTERESTING_SYSCALL ? "(uninteresting)" :
+        getSyscallName(static_cast<Syscall>(i));
+    fprintf(fp, "%s\"%s\":{\"entry\":%llu,\"exit\":%llu}",
+            first ? "" : ",", name,
+            static_cast<unsigned long long>(stops_[i][true]),
+            static_cast<unsigned long long>(stops_[i][false]));
+    first = false;
+  }
+  fprintf(fp, "},\"other_stops\":%llu,\"wait\":",
+          static_cast<unsigned long long>(other_stops_));
+  wait_.printJson(fp);
+  fputs(",\"get_syscall_info\":", fp);
+  get_syscall_info_.printJson(fp);
+  fputs(",\"peek\":", fp);
+  peek_.printJson(fp);
+  fputs(",\"handlers\":[", fp);
+  for (size_t i = 0; i < handlers_.size(); i++) {
+    fprintf(fp, "%s{\"name\":\"%s\",\"latency\":", i ? "," : "",
+            handler_names_[i].c_str());
+    handlers_[i].printJson(fp);
+    fputc('}', fp);
+  }
+  fprintf(fp, "],\"bytes_peeked\":%llu}\n",
+          static_cast<unsigned long long>(bytes_peeked_));
+}
+
+}  // namespace katd
@@ -0,0 +1,101 @@
+#ifndef KATD_TRACER_STATS_H_
+#define KATD_TRACER_STATS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <string>
+#include <vector>
+
+#include "syscalls.h"
+
+namespace katd {
+
+class Handler;
+
+// Returns a monotonic time in nanoseconds.
+inline uint64_t getNanoTime() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Durations in buckets of powers of two nanoseconds. Bucket i counts
+// durations in [2^(i-1), 2^i).
+class LatencyHistogram {
+public:
+  static const int kNumBuckets = 48;
+
+  LatencyHistogram();
+
+  void add(uint64_t ns);
+  void merge(const LatencyHistogram& other);
+
+  uint64_t count() const { return count_; }
+  uint64_t total_ns() const { return total_ns_; }
+  uint64_t max_ns() const { return max_ns_; }
+  // Returns the upper bound of the bucket which has the |p|th
+  // percentile.
+  uint64_t getPercentile(double p) const;
+
+  void printJson(FILE* fp) const;
+
+private:
+  uint64_t buckets_[kNumBuckets];
+  uint64_t count_;
+  uint64_t total_ns_;
+  uint64_t max_ns_;
+};
+
+// Where Tracer spends its time. Collected only when set_stats is called,
+// since reading the clock around every stop costs too.
+class TracerStats {
+public:
+  TracerStats();
+
+  void countStop(Syscall syscall, bool is_entry) {
+    stops_[syscall][is_entry]++;
+  }
+  // Stops which are not at syscalls, e.g. fork events and signals.
+  void countOtherStop() { other_stops_++; }
+  void addPeek(uint64_t ns) { peek_.add(ns); }
+  // Bytes read from tracees, which is more than the strings since
+  // reads do not stop at NULs.
+  void addBytesPeeked(size_t bytes) { bytes_peeked_ += bytes; }
+
+  LatencyHistogram* wait() { return &wait_; }
+  LatencyHistogram* getSyscallInfo() { return &get_syscall_info_; }
+  // Returns the histogram of the |i|th handler added to the tracer.
+  LatencyHistogram* handler(size_t i);
+  // Names the |i|th handler by its class.
+  void setHandler(size_t i, const Handler& handler);
+
+  // Adds the counts of |other|, e.g. of another tracer thread. The
+  // wall clock and handler names are kept.
+  void merge(const TracerStats& other);
+
+  // Starts and stops the wall clock.
+  void start() { start_ns_ = getNanoTime(); }
+  void stop() { wall_ns_ = getNanoTime() - start_ns_; }
+
+  void printTable(FILE* fp) const;
+  void printJson(FILE* fp) const;
+
+private:
+  uint64_t stops_[NUM_SYSCALLS][2];
+  uint64_t other_stops_;
+  LatencyHistogram wait_;
+  LatencyHistogram get_syscall_info_;
+  LatencyHistogram peek_;
+  uint64_t bytes_peeked_;
+  std::vector<LatencyHistogram> handlers_;
+  std::vector<std::string> handler_names_;
+  uint64_t start_ns_;
+  uint64_t wall_ns_;
+};
+
+}  // namespace katd
+
+#endif  // KATD_TRACER_STATS_H_